@@ -26,6 +26,7 @@
 
 #include "ESPAsyncWebServer.h"
 #include "AsyncWebSynchronization.h"
+#include "WebRingQueue.h"
 
 #ifdef LLC_ESP8266
 #   include <Hash.h>
@@ -82,10 +83,10 @@ namespace llc
     class AsyncEventSourceClient {
         typedef T                           TAsyncEventSource;
         typedef AsyncEventSourceMessage     TSourceMessage;
-        typedef LinkedList<TSourceMessage*> TMessageList;
+        typedef SAWRingQueue<TSourceMessage*, SSE_MAX_QUEUED_MESSAGES>  TMessageQueue;
         AsyncClient              * _client              = {};
         TAsyncEventSource        * _server              = {};
-        TMessageList             _messageQueue          ;
+        TMessageQueue            _messageQueue          = {};
         uint32_t                 _lastId                = {};
 
         void                    _queueMessage           (AsyncEventSourceMessage * dataMessage){
@@ -95,9 +96,7 @@ namespace llc
                 delete dataMessage;
                 return;
             }
-            if(_messageQueue.length() < SSE_MAX_QUEUED_MESSAGES)
-                _messageQueue.add(dataMessage);
-            else {
+            if(false == _messageQueue.push_back(dataMessage)) {
                 ets_printf("ERROR: Too many messages queued\n");
                 delete dataMessage;
             }
@@ -105,17 +104,16 @@ namespace llc
                 _runQueue();
         }
         void                    _runQueue               () {
-            while(false == _messageQueue.isEmpty() && _messageQueue.front()->finished())
-                _messageQueue.remove(_messageQueue.front());
-            for(auto i = _messageQueue.begin(); i != _messageQueue.end(); ++i) {
-                if(false == (*i)->sent())
-                    (*i)->send(_client);
+            while(false == _messageQueue.empty() && _messageQueue.front()->finished())
+                delete _messageQueue.pop_front();
+            for(size_t i = 0; i < _messageQueue.size(); ++i) {
+                if(false == _messageQueue[i]->sent())
+                    _messageQueue[i]->send(_client);
             }
         }
     public:
-                                ~AsyncEventSourceClient ()                                      { _messageQueue.free(); close(); }
-                                AsyncEventSourceClient  (SAWServerRequest * request, TAsyncEventSource * server)
-            : _messageQueue(LinkedList<AsyncEventSourceMessage *>([](AsyncEventSourceMessage *m){ delete  m; })) {
+                                ~AsyncEventSourceClient ()                                      { while(false == _messageQueue.empty()) delete _messageQueue.pop_front(); close(); }
+                                AsyncEventSourceClient  (SAWServerRequest * request, TAsyncEventSource * server) {
             _client = request->client();
             _server = server;
             _lastId = 0;
@@ -136,7 +134,7 @@ namespace llc
         inline  bool            connected               ()                          const       { return _client && _client->connected(); }
         inline  AsyncClient*    client                  ()                          const       { return _client; }
         inline  uint32_t        lastId                  ()                          const       { return _lastId; }
-        inline  uint32_t        packetsWaiting          ()                          const       { return (uint32_t)_messageQueue.length(); }
+        inline  uint32_t        packetsWaiting          ()                          const       { return (uint32_t)_messageQueue.size(); }
         inline  void            close                   ()                                      { if(_client) _client->close(); }
         inline  void            write                   (const char * message, size_t len)      { _queueMessage(new AsyncEventSourceMessage({(const uint8_t*)message, len})); }
         void                    send                    (const char * message, const char * event = 0, uint32_t id = 0, uint32_t reconnect = 0) {
@@ -145,12 +143,12 @@ namespace llc
         }
         inline  void            _onTimeout              (uint32_t)                              { _client->close(true); }
         inline  void            _onDisconnect           ()                                      { _client = {}; _server->_handleDisconnect(this); }
-        inline  void            _onPoll                 ()                                      { if(false == _messageQueue.isEmpty()) _runQueue(); }
+        inline  void            _onPoll                 ()                                      { if(false == _messageQueue.empty()) _runQueue(); }
         void                    _onAck                  (uint32_t len, uint32_t time){
-            while(len && false == _messageQueue.isEmpty()){
+            while(len && false == _messageQueue.empty()){
                 len   = _messageQueue.front()->ack(len, time);
                 if(_messageQueue.front()->finished())
-                    _messageQueue.remove(_messageQueue.front());
+                    delete _messageQueue.pop_front();
             }
             _runQueue();
         }
@@ -0,0 +1,217 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "ESPAsyncWebServer.h"
+
+#if ASYNCWEBSERVER_COROUTINES
+
+#include <memory>
+
+/*
+ * Frame Pool
+ * */
+
+void * llc::SAWCoroutinePool::acquire(size_t size){
+  if(size > SLOT_SIZE)
+    return NULL;
+  AsyncWebLockGuard l(_lock);
+  if(!_slab){
+    _slab = (uint8_t *)malloc(SLOT_SIZE * SAW_COROUTINE_FRAMES);
+    if(!_slab)
+      return NULL;
+    for(size_t i = SAW_COROUTINE_FRAMES; i--; ){
+      FreeSlot * slot = (FreeSlot *)(_slab + i * SLOT_SIZE);
+      slot->next = _free;
+      _free = slot;
+    }
+  }
+  FreeSlot * slot = _free;
+  if(slot)
+    _free = slot->next;
+  return slot;
+}
+
+void llc::SAWCoroutinePool::release(void * frame){
+  if(!frame)
+    return;
+  AsyncWebLockGuard l(_lock);
+  FreeSlot * slot = (FreeSlot *)frame;
+  slot->next = _free;
+  _free = slot;
+}
+
+/*
+ * Coroutine Context
+ * */
+
+llc::SAWCoroutineContext::~SAWCoroutineContext(){
+  std::vector<SAWCoroutineContext *> & active = _route->_active;
+  for(size_t i = 0; i < active.size(); ++i){
+    if(active[i] == this){
+      active[i] = active.back();
+      active.pop_back();
+      break;
+    }
+  }
+  if(_root)
+    _root.destroy();
+  if(_deferred){
+    _deferred->_onAbandon(NULL, NULL);
+    _deferred->release();
+  }
+}
+
+void llc::SAWCoroutineContext::_appendBody(const uint8_t * data, size_t len, size_t total){
+  if(_bodyTooLarge)
+    return;
+  if(total > SAW_COROUTINE_MAX_BODY || _body.length() + len > SAW_COROUTINE_MAX_BODY){
+    _bodyTooLarge = true;
+    _body = String();
+    return;
+  }
+  if(!_body.length())
+    _body.reserve(total);
+  _body.concat((const char *)data, len);
+}
+
+void llc::SAWCoroutineContext::_endBody(){
+  _bodyComplete = true;
+  if(_bodyWaiter){
+    std::coroutine_handle<> h = _bodyWaiter;
+    _bodyWaiter = {};
+    resume(h);
+  }
+}
+
+void llc::SAWCoroutineContext::_abandoned(void * arg){
+  SAWCoroutineContext * context = (SAWCoroutineContext *)arg;
+  // nothing resumes a handler waiting for the body, the socket or an unset future any more; a timer or a set()
+  // already under way still holds the frame and finds the request gone when it arrives
+  if(context->_bodyWaiter || (context->_cancelFn && context->_cancelFn(context->_cancelArg)))
+    delete context;
+}
+
+void llc::SAWCoroutineContext::resume(std::coroutine_handle<> h){
+  if(!_deferred->_current()){
+    // the client went away while the handler was waiting, its frames are dropped with the context
+    delete this;
+    return;
+  }
+  _cancelFn = NULL;
+  h.resume();
+  if(_root.done())
+    _finish();
+}
+
+void llc::SAWCoroutineContext::_finish(){
+  SAWServerResponse * response = _root.promise()._result();
+  SAWServerRequest * request = _deferred->_current();
+  if(!response && request && !request->_responded())
+    // co_return NULL without having sent anything
+    response = new AsyncBasicResponse(500);
+  _root.destroy();
+  _root = {};
+  SAWDeferredRequest * deferred = _deferred;
+  deferred->_onAbandon(NULL, NULL);
+  _deferred = NULL;
+  delete this;
+  if(response)
+    deferred->send(response);
+  else
+    deferred->release();    // the handler sent a response itself
+}
+
+/*
+ * Coroutine Route
+ * */
+
+llc::SAWCoroutineContext * llc::SAWCoroutineRoute::_find(SAWServerRequest * request) const {
+  for(SAWCoroutineContext * context : _active)
+    if(context->_deferred->_current() == request)
+      return context;
+  return NULL;
+}
+
+llc::SAWCoroutineContext * llc::SAWCoroutineRoute::_start(SAWServerRequest * request){
+  SAWDeferredRequest * deferred = request->defer();
+  if(!deferred)
+    return NULL;
+  SAWResponseTask task = _handler(*request);
+  SAWCoroutineContext * context = task ? new (std::nothrow) SAWCoroutineContext(this, deferred, SAWCoroutineContext::root_type()) : NULL;
+  if(!context){
+    deferred->send(503);
+    return NULL;
+  }
+  context->_root = task.release();
+  context->_root.promise()._context = context;
+  deferred->_onAbandon(&SAWCoroutineContext::_abandoned, context);
+  _active.push_back(context);
+  return context;
+}
+
+void llc::SAWCoroutineRoute::handleBody(SAWServerRequest * request, uint8_t * data, size_t len, size_t index, size_t total){
+  SAWCoroutineContext * context = _find(request);
+  if(context){
+    context->_appendBody(data, len, total);
+    return;
+  }
+  if(index)
+    return;
+  // the handler starts with the first body bytes and may await the rest
+  context = _start(request);
+  if(!context)
+    return;
+  context->_appendBody(data, len, total);
+  context->resume(context->_root);
+}
+
+void llc::SAWCoroutineRoute::handleRequest(SAWServerRequest * request){
+  SAWCoroutineContext * context = _find(request);
+  if(context){
+    context->_endBody();
+    return;
+  }
+  context = _start(request);
+  if(!context)
+    return;
+  context->_bodyComplete = true;
+  context->resume(context->_root);
+}
+
+/*
+ * Server
+ * */
+
+AsyncCallbackWebHandler& SAWServer::onAsync(const char* uri, WebRequestMethodComposite method, llc::SAWCoroutineHandler handler){
+  std::shared_ptr<llc::SAWCoroutineRoute> route = std::make_shared<llc::SAWCoroutineRoute>(std::move(handler));
+  AsyncCallbackWebHandler* h = new AsyncCallbackWebHandler();
+  h->setUri(uri);
+  h->setMethod(method);
+  h->onRequest([route](SAWServerRequest * request){ route->handleRequest(request); });
+  h->onBody([route](SAWServerRequest * request, uint8_t * data, size_t len, size_t index, size_t total){ route->handleBody(request, data, len, index, total); });
+  addHandler(h);
+  return *h;
+}
+
+AsyncCallbackWebHandler& SAWServer::onAsync(const char* uri, llc::SAWCoroutineHandler handler){
+  return onAsync(uri, HTTP_ANY, std::move(handler));
+}
+
+#endif // ASYNCWEBSERVER_COROUTINES
@@ -0,0 +1,287 @@
+#include "llc_array_pod.h"
+
+#include "ESPAsyncWebServer.h"
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBCOROUTINE_H_
+#define ASYNCWEBCOROUTINE_H_
+
+#if ASYNCWEBSERVER_COROUTINES
+
+#include <Ticker.h>
+
+#include <atomic>
+#include <coroutine>
+#include <vector>
+
+// Handler coroutines and the tasks they await take their frames from a fixed pool, allocated on first use.
+// A request whose frame doesn't fit a slot, or finds every slot taken, is answered with 503.
+#ifndef SAW_COROUTINE_FRAMES
+#   ifdef LLC_ESP32
+#       define SAW_COROUTINE_FRAMES 8
+#   else
+#       define SAW_COROUTINE_FRAMES 4
+#   endif
+#endif
+#ifndef SAW_COROUTINE_FRAME_SIZE
+#   ifdef LLC_ESP32
+#       define SAW_COROUTINE_FRAME_SIZE 1024
+#   else
+#       define SAW_COROUTINE_FRAME_SIZE 512
+#   endif
+#endif
+// Larger request bodies of coroutine routes are not collected, requestBody() then yields NULL
+#ifndef SAW_COROUTINE_MAX_BODY
+#   define SAW_COROUTINE_MAX_BODY 4096
+#endif
+
+namespace llc
+{
+    class SAWCoroutineContext;
+    class SAWCoroutineRoute;
+
+    class SAWCoroutinePool {
+        stxp size_t             SLOT_SIZE               = (SAW_COROUTINE_FRAME_SIZE + 15) & ~size_t(15);
+        struct FreeSlot         { FreeSlot * next; };
+        uint8_t                 * _slab                 = {};
+        FreeSlot                * _free                 = {};
+        AsyncWebLock            _lock;
+                                SAWCoroutinePool        ()  = default;
+    public:                     ~SAWCoroutinePool       ()                  { free(_slab); }
+                                SAWCoroutinePool        (const SAWCoroutinePool &) = delete;
+        SAWCoroutinePool &      operator=               (const SAWCoroutinePool &) = delete;
+        static SAWCoroutinePool&Instance                ()                  { static SAWCoroutinePool instance; return instance; }
+
+        // NULL when size exceeds SAW_COROUTINE_FRAME_SIZE or all SAW_COROUTINE_FRAMES are in use
+        void *                  acquire                 (size_t size);
+        void                    release                 (void * frame);
+    };
+
+    // What every task promise carries: the request it runs for, and who awaits it
+    struct SAWTaskPromiseBase {
+        SAWCoroutineContext     * _context              = {};
+        std::coroutine_handle<> _continuation           = {};
+
+        static  void *          operator new            (size_t size) noexcept  { return SAWCoroutinePool::Instance().acquire(size); }
+        static  void            operator delete         (void * frame)          { SAWCoroutinePool::Instance().release(frame); }
+        std::suspend_always     initial_suspend         ()  noexcept            { return {}; }
+        void                    unhandled_exception     ()                      { abort(); }
+
+        struct FinalAwaiter {
+            bool                await_ready             ()  noexcept            { return false; }
+            template<typename P>
+            std::coroutine_handle<> await_suspend       (std::coroutine_handle<P> h) noexcept {
+                // back into the awaiting task; the handler itself returns to whoever resumed it
+                return h.promise()._continuation ? h.promise()._continuation : std::noop_coroutine();
+            }
+            void                await_resume            ()  noexcept            {}
+        };
+        FinalAwaiter            final_suspend           ()  noexcept            { return {}; }
+    };
+
+    template<typename T>
+    struct SAWTaskPromise : SAWTaskPromiseBase {
+        T                       _value                  = {};
+        void                    return_value            (T value)               { _value = std::move(value); }
+        T                       _result                 ()                      { return std::move(_value); }
+    };
+    template<>
+    struct SAWTaskPromise<void> : SAWTaskPromiseBase {
+        void                    return_void             ()                      {}
+        void                    _result                 ()                      {}
+    };
+
+    // Lazily started coroutine. co_await runs it on the awaiting handler's request; a task that couldn't get a frame
+    // is empty and yields T() at once.
+    template<typename T = void>
+    class SAWTask {
+    public:
+        struct promise_type : SAWTaskPromise<T> {
+            SAWTask             get_return_object       ()                      { return SAWTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            static SAWTask      get_return_object_on_allocation_failure     ()  { return SAWTask(); }
+        };
+        using                   handle_type             = std::coroutine_handle<promise_type>;
+    private:
+        handle_type             _handle                 = {};
+        explicit                SAWTask                 (handle_type handle)    : _handle{handle} {}
+    public:                     ~SAWTask                ()                      { if(_handle) _handle.destroy(); }
+                                SAWTask                 ()  = default;
+                                SAWTask                 (SAWTask && other)      : _handle{other._handle} { other._handle = {}; }
+        SAWTask &               operator=               (SAWTask && other)      { if(this != &other){ if(_handle) _handle.destroy(); _handle = other._handle; other._handle = {}; } return *this; }
+        explicit                operator bool           ()          const       { return bool(_handle); }
+        // The caller now owns the frame
+        handle_type             release                 ()                      { handle_type h = _handle; _handle = {}; return h; }
+
+        struct Awaiter {
+            handle_type         _handle;
+            bool                await_ready             ()                      { return !_handle; }
+            template<typename P>
+            std::coroutine_handle<> await_suspend       (std::coroutine_handle<P> parent) {
+                _handle.promise()._context = parent.promise()._context;
+                _handle.promise()._continuation = parent;
+                return _handle;
+            }
+            T                   await_resume            ()                      { if(!_handle) return T(); return _handle.promise()._result(); }
+        };
+        Awaiter                 operator co_await       ()          &&          { return Awaiter{_handle}; }
+    };
+
+    using                       SAWResponseTask         = SAWTask<SAWServerResponse *>;
+
+    // Runs one handler coroutine for one request, on the network task or under the request lock. When the client
+    // disconnects while the handler waits, its frames are destroyed: right away when it waits for the body, the
+    // socket or a future not set yet, once the timer fires or the racing set() arrives otherwise.
+    class SAWCoroutineContext {
+        friend class            SAWCoroutineRoute;
+        using                   root_type               = SAWResponseTask::handle_type;
+        SAWCoroutineRoute       * _route;
+        SAWDeferredRequest      * _deferred;
+        root_type               _root;
+        String                  _body                   = {};
+        bool                    _bodyComplete           = {};
+        bool                    _bodyTooLarge           = {};
+        std::coroutine_handle<> _bodyWaiter             = {};
+        bool                    (*_cancelFn)            (void * arg)    = {};   // unhooks the awaited event, false when it fires anyway
+        void                    * _cancelArg            = {};
+                                SAWCoroutineContext     (SAWCoroutineRoute * route, SAWDeferredRequest * deferred, root_type root) : _route{route}, _deferred{deferred}, _root{root} {}
+                                ~SAWCoroutineContext    ();
+        void                    _appendBody             (const uint8_t * data, size_t len, size_t total);
+        void                    _endBody                ();
+        void                    _finish                 ();
+        static  void            _abandoned              (void * arg);
+    public:
+        inline  SAWDeferredRequest*     deferred        ()          const       { return _deferred; }
+        inline  bool            bodyComplete            ()          const       { return _bodyComplete; }
+        inline  const String *  body                    ()          const       { return _bodyTooLarge ? NULL : &_body; }
+        inline  void            _waitBody               (std::coroutine_handle<> h)     { _bodyWaiter = h; }
+        inline  void            _onCancel               (bool (*fn)(void * arg), void * arg)    { _cancelFn = fn; _cancelArg = arg; }
+        // Network task or under the request lock only
+        void                    resume                  (std::coroutine_handle<> h);
+    };
+
+    // Awaiter state shared by the events below
+    struct SAWCoroutineWaiter {
+        SAWCoroutineContext     * _context              = {};
+        std::coroutine_handle<> _handle                 = {};
+        template<typename P>
+        inline  void            _bind                   (std::coroutine_handle<P> h)    { _context = h.promise()._context; _handle = h; }
+        // Any task: resumes the waiting coroutine under the request lock
+        static  void            _post                   (SAWCoroutineWaiter * waiter)   { waiter->_context->deferred()->post(&SAWCoroutineWaiter::_resume, waiter); }
+        static  void            _resume                 (SAWServerRequest * request, void * arg)    { (void)request; SAWCoroutineWaiter * w = (SAWCoroutineWaiter *)arg; w->_context->resume(w->_handle); }
+    };
+
+    // co_await sleepFor(ms): resumes after ms milliseconds without blocking the network task
+    struct SAWSleepAwaiter : SAWCoroutineWaiter {
+        uint32_t                _ms;
+        Ticker                  _ticker;
+        explicit                SAWSleepAwaiter         (uint32_t ms)           : _ms{ms} {}
+        bool                    await_ready             ()                      { return !_ms; }
+        template<typename P>
+        void                    await_suspend           (std::coroutine_handle<P> h)    { _bind(h); _ticker.once_ms(_ms, &SAWCoroutineWaiter::_post, static_cast<SAWCoroutineWaiter *>(this)); }
+        void                    await_resume            ()                      {}
+    };
+    inline  SAWSleepAwaiter     sleepFor                (uint32_t ms)           { return SAWSleepAwaiter(ms); }
+
+    // co_await requestBody(): the whole request body once received, NULL when it exceeded SAW_COROUTINE_MAX_BODY
+    struct SAWBodyAwaiter : SAWCoroutineWaiter {
+        bool                    await_ready             ()                      { return false; }
+        template<typename P>
+        bool                    await_suspend           (std::coroutine_handle<P> h)    { _bind(h); if(_context->bodyComplete()) return false; _context->_waitBody(h); return true; }
+        const String *          await_resume            ()                      { return _context->body(); }
+    };
+    inline  SAWBodyAwaiter      requestBody             ()                      { return SAWBodyAwaiter(); }
+
+    // co_await writable(stream, n): a streaming AsyncResponseStream takes n more bytes. Not before the stream was sent.
+    struct SAWWritableAwaiter : SAWCoroutineWaiter {
+        AsyncResponseStream     & _stream;
+        size_t                  _needed;
+                                SAWWritableAwaiter      (AsyncResponseStream & stream, size_t needed)  : _stream(stream), _needed{needed} {}
+        bool                    await_ready             ()                      { return size_t(_stream.availableForWrite()) >= _needed; }
+        template<typename P>
+        void                    await_suspend           (std::coroutine_handle<P> h)    { _bind(h); _stream._onDrain(&SAWWritableAwaiter::_drained, this); _context->_onCancel(&SAWWritableAwaiter::_cancel, this); }
+        void                    await_resume            ()                      {}
+        static  void            _drained                (void * arg)            { SAWWritableAwaiter * w = (SAWWritableAwaiter *)arg; w->_context->resume(w->_handle); }
+        static  bool            _cancel                 (void * arg)            { ((SAWWritableAwaiter *)arg)->_stream._onDrain(NULL, NULL); return true; }
+    };
+    inline  SAWWritableAwaiter  writable                (AsyncResponseStream & stream, size_t needed = 1)  { return SAWWritableAwaiter(stream, needed); }
+
+    // A value produced by another task, e.g. a sensor read. Copies share one state; set() once, from any task.
+    template<typename T>
+    class SAWFuture {
+        enum Phase : uint8_t    { EMPTY, WAITING, READY };
+        struct State {
+            std::atomic<uint32_t>   refs;
+            std::atomic<uint8_t>    phase;
+            T                       value;
+            SAWCoroutineWaiter      waiter;
+        };
+        State                   * _state;
+    public:                     ~SAWFuture              ()                      { if(_state && 1 == _state->refs.fetch_sub(1, std::memory_order_acq_rel)) delete _state; }
+                                SAWFuture               ()                      : _state{new (std::nothrow) State{{1}, {EMPTY}, T(), {}}} {}
+                                SAWFuture               (const SAWFuture & other)   : _state{other._state} { if(_state) _state->refs.fetch_add(1, std::memory_order_relaxed); }
+        SAWFuture &             operator=               (const SAWFuture &) = delete;
+        inline  bool            valid                   ()          const       { return _state != NULL; }
+        inline  bool            ready                   ()          const       { return _state && _state->phase.load(std::memory_order_acquire) == READY; }
+        void                    set                     (T value)               {
+            if(!_state)
+                return;
+            _state->value = std::move(value);
+            if(_state->phase.exchange(READY, std::memory_order_acq_rel) == WAITING)
+                SAWCoroutineWaiter::_post(&_state->waiter);
+        }
+
+        struct Awaiter {
+            State               * _state;
+            bool                await_ready             ()                      { return !_state || _state->phase.load(std::memory_order_acquire) == READY; }
+            template<typename P>
+            bool                await_suspend           (std::coroutine_handle<P> h)    {
+                _state->waiter._bind(h);
+                uint8_t expected = EMPTY;
+                // false: set() came first, carry on without suspending
+                if(!_state->phase.compare_exchange_strong(expected, WAITING, std::memory_order_acq_rel))
+                    return false;
+                _state->waiter._context->_onCancel(&Awaiter::_cancel, _state);
+                return true;
+            }
+            // set() finds the future empty again and posts nothing, unless it was faster
+            static  bool        _cancel                 (void * arg)            { uint8_t expected = WAITING; return ((State *)arg)->phase.compare_exchange_strong(expected, EMPTY, std::memory_order_acq_rel); }
+            T                   await_resume            ()                      { return _state ? _state->value : T(); }
+        };
+        Awaiter                 operator co_await       ()          const       { return Awaiter{_state}; }
+    };
+
+    // Shared by the callbacks of one onAsync() route
+    class SAWCoroutineRoute {
+        friend class            SAWCoroutineContext;
+        SAWCoroutineHandler     _handler;
+        std::vector<SAWCoroutineContext *>  _active     = {};
+        SAWCoroutineContext *   _find                   (SAWServerRequest * request) const;
+        SAWCoroutineContext *   _start                  (SAWServerRequest * request);
+    public:                     SAWCoroutineRoute       (SAWCoroutineHandler handler)   : _handler{std::move(handler)} {}
+        void                    handleRequest           (SAWServerRequest * request);
+        void                    handleBody              (SAWServerRequest * request, uint8_t * data, size_t len, size_t index, size_t total);
+    };
+} // namespace
+
+#endif // ASYNCWEBSERVER_COROUTINES
+
+#endif // ASYNCWEBCOROUTINE_H_
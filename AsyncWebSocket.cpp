@@ -20,6 +20,7 @@
 */
 #include "Arduino.h"
 #include "AsyncWebSocket.h"
+#include "WebSocketMask.h"
 
 #include <libb64/cencode.h>
 
@@ -35,6 +36,8 @@
 #endif
 
 #define MAX_PRINTF_LEN 64
+// A frame header went out without its payload, the connection has to go
+#define WS_FRAME_BROKEN ((size_t)-1)
 
 static size_t webSocketSendFrameWindow (AsyncClient * client){
     if(false == client->canSend())
@@ -42,34 +45,20 @@ static size_t webSocketSendFrameWindow (AsyncClient * client){
     const size_t space = client->space();
     return (space < 9) ? 0 : space - 8;
 }
+// Adds one whole frame without pushing it out, _runQueue sends everything it added at once so small frames share
+// segments. Returns the bytes added, header included, 0 when the frame does not fit, WS_FRAME_BROKEN when lwIP took
+// the header but not the payload.
 static size_t webSocketSendFrame(AsyncClient * client, bool final, uint8_t opcode, bool mask, uint8_t *data, size_t len){
     if(false == client->canSend())
         return 0;
-    size_t space = client->space();
-    if(space < 2)
-        return 0;
-    uint8_t mbuf[4] = {0,0,0,0};
+    uint8_t buf[8];
     uint8_t headLen = 2;
-    if(len && mask){
+    if(len && mask)
         headLen += 4;
-        mbuf[0] = rand() % 0xFF;
-        mbuf[1] = rand() % 0xFF;
-        mbuf[2] = rand() % 0xFF;
-        mbuf[3] = rand() % 0xFF;
-    }
     if(len > 125)
         headLen += 2;
-    if(space < headLen)
+    if(client->space() < headLen + len)
         return 0;
-    space -= headLen;
-
-    if(len > space) len = space;
-
-    uint8_t *buf = (uint8_t*)malloc(headLen);
-    if(buf == NULL){
-        //os_printf("could not malloc %u bytes for frame header\n", headLen);
-        return 0;
-    }
 
     buf[0] = opcode & 0x0F;
     if(final)
@@ -83,31 +72,43 @@ static size_t webSocketSendFrame(AsyncClient * client, bool final, uint8_t opcod
     }
     if(len && mask){
         buf[1] |= 0x80;
-        memcpy(buf + (headLen - 4), mbuf, 4);
+        for(uint8_t i = headLen - 4; i < headLen; i++)
+            buf[i] = rand() % 0xFF;
     }
-    if(client->add((const char *)buf, headLen) != headLen){
-        //os_printf("error adding %lu header bytes\n", headLen);
-        free(buf);
+    if(client->add((const char *)buf, headLen) != headLen)
         return 0;
-    }
-    free(buf);
 
     if(len){
-        if(len && mask){
-            size_t i;
-            for(i=0;i<len;i++)
-                data[i] = data[i] ^ mbuf[i%4];
-        }
-        if(client->add((const char *)data, len) != len){
-            //os_printf("error adding %lu data bytes\n", len);
-            return 0;
+        if(mask){
+            uint8_t mbuf[4];
+            memcpy(mbuf, buf + (headLen - 4), 4);
+            llc::applyWebSocketMask(data, len, mbuf);
         }
-    }
-    if(!client->send()){
-        //os_printf("error sending frame: %lu\n", headLen+len);
-        return 0;
-    }
-    return len;
+        // not closed here, that could free the client while it is still writing
+        if(client->add((const char *)data, len) != len)
+            return WS_FRAME_BROKEN;
+    }
+    return headLen + len;
+}
+
+// One compressed message as a final frame with RSV1 set. Without a context the deflater lives for this message only.
+static llc::SAWSharedBuffer * webSocketDeflateFrame(llc::SAWDeflate * context, uint8_t windowBits, uint8_t opcode, const uint8_t * data, size_t len){
+    llc::SAWDeflate once;
+    if(context == NULL && !once.begin(llc::SAWDeflate::RAW_SYNC, windowBits))
+        return NULL;
+    llc::SAWDeflate & deflate = context ? *context : once;
+    size_t capacity;
+    uint8_t * out = llc::SAWBufferPool::Instance().acquire(len * 9 / 8 + 12 + llc::SAWDeflate::FINISH_MAX, capacity);
+    if(out == NULL)
+        return NULL;
+    size_t outLen = deflate.write(data, len, out);
+    outLen += deflate.flush(out + outLen);
+    llc::SAWSharedBuffer * frame = llc::SAWSocketSharedMessage::encode(opcode, out, outLen, true);
+    llc::SAWBufferPool::Instance().release(out, capacity);
+    // the client never sees this message, later ones must not refer back to it
+    if(frame == NULL && context != NULL)
+        context->resetWindow();
+    return frame;
 }
 
 llc::SAWSocketMessageBuffer::SAWSocketMessageBuffer(uint8_t * data, size_t size) {
@@ -169,6 +170,14 @@ bool llc::SAWSocketMessageBuffer::reserve(size_t size)
 
 
 
+uint32_t llc::SAWSocketMessage::keyOf(const char * name){
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while(name != NULL && *name)
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    return hash ? hash : 1;
+}
+
 /*
  * Control Frame
  */
@@ -202,12 +211,14 @@ class llc::SAWSocketControl {
             if(_data != NULL)
                 free(_data);
         }
+        // written, it stays queued until acked
         virtual bool finished() const { return _finished; }
         uint8_t opcode(){ return _opcode; }
         uint8_t len(){ return _len + 2; }
         size_t send(AsyncClient *client){
-            _finished = true;
-            return webSocketSendFrame(client, true, _opcode & 0x0F, _mask, _data, _len);
+            const size_t written = webSocketSendFrame(client, true, _opcode & 0x0F, _mask, _data, _len);
+            _finished = written != 0 && written != WS_FRAME_BROKEN;
+            return written;
         }
 };
 
@@ -255,47 +266,24 @@ SAWSocketBasicMessage::~SAWSocketBasicMessage() {
  void llc::SAWSocketBasicMessage::ack(size_t len, uint32_t time)    {
      (void)time;
     _acked += len;
-    if(_sent == _len && _acked == _ack){
+    if(_ack && _sent == _len && _acked >= _ack){
         _status = WS_MSG_SENT;
     }
 }
  size_t llc::SAWSocketBasicMessage::send(AsyncClient *client)    {
-    if(_status != WS_MSG_SENDING)
+    if(!readyToSend())
         return 0;
-    if(_acked < _ack){
+    const size_t toSend = std::min(_len - _sent, webSocketSendFrameWindow(client));
+    if(_len && !toSend)
         return 0;
+    // the first frame carries the opcode, an empty message still goes out as one empty frame
+    const uint8_t opCode = _ack ? (uint8_t)WS_CONTINUATION : _opcode;
+    const size_t written = webSocketSendFrame(client, _sent + toSend == _len, opCode, _mask, _data + _sent, toSend);
+    if(written && written != WS_FRAME_BROKEN){
+        _sent += toSend;
+        _ack += written;
     }
-    if(_sent == _len){
-        if(_acked == _ack)
-            _status = WS_MSG_SENT;
-        return 0;
-    }
-    if(_sent > _len){
-            _status = WS_MSG_ERROR;
-            return 0;
-    }
-
-    size_t toSend = _len - _sent;
-    size_t window = webSocketSendFrameWindow(client);
-
-    if(window < toSend) {
-            toSend = window;
-    }
-
-    _sent += toSend;
-    _ack += toSend + ((toSend < 126)?2:4) + (_mask * 4);
-
-    bool final = (_sent == _len);
-    uint8_t* dPtr = (uint8_t*)(_data + (_sent - toSend));
-    uint8_t opCode = (toSend && _sent == toSend)?_opcode:(uint8_t)WS_CONTINUATION;
-
-    size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
-    _status = WS_MSG_SENDING;
-    if(toSend && sent != toSend){
-            _sent -= (toSend - sent);
-            _ack -= (toSend - sent);
-    }
-    return sent;
+    return written;
 }
 
 // bool llc::SAWSocketBasicMessage::reserve(size_t size) { 
@@ -351,51 +339,81 @@ SAWSocketMultiMessage::~SAWSocketMultiMessage() {
  void llc::SAWSocketMultiMessage::ack(size_t len, uint32_t time)    {
      (void)time;
     _acked += len;
-    if(_sent >= _len && _acked >= _ack){
+    if(_ack && _sent == _len && _acked >= _ack){
         _status = WS_MSG_SENT;
     }
-    //ets_printf("A: %u\n", len);
 }
  size_t llc::SAWSocketMultiMessage::send(AsyncClient *client)    {
-    if(_status != WS_MSG_SENDING)
+    if(!readyToSend())
         return 0;
-    if(_acked < _ack){
+    const size_t toSend = std::min(_len - _sent, webSocketSendFrameWindow(client));
+    if(_len && !toSend)
         return 0;
+    const uint8_t opCode = _ack ? (uint8_t)WS_CONTINUATION : _opcode;
+    const size_t written = webSocketSendFrame(client, _sent + toSend == _len, opCode, _mask, _data + _sent, toSend);
+    if(written && written != WS_FRAME_BROKEN){
+        _sent += toSend;
+        _ack += written;
     }
-    if(_sent == _len){
-        _status = WS_MSG_SENT;
-        return 0;
-    }
-    if(_sent > _len){
-            _status = WS_MSG_ERROR;
-            //ets_printf("E: %u > %u\n", _sent, _len);
-            return 0;
-    }
+    return written;
+}
 
-    size_t toSend = _len - _sent;
-    size_t window = webSocketSendFrameWindow(client);
 
-    if(window < toSend) {
-            toSend = window;
-    }
+/*
+ * Shared Broadcast Frame
+ */
 
-    _sent += toSend;
-    _ack += toSend + ((toSend < 126)?2:4) + (_mask * 4);
+llc::SAWSharedBuffer * llc::SAWSocketSharedMessage::encode(uint8_t opcode, const uint8_t * data, size_t len, bool compressed){
+    const uint8_t headLen = (len < 126) ? 2 : ((len <= 0xFFFF) ? 4 : 10);
+    SAWSharedBuffer * frame = SAWSharedBuffer::create(headLen + len);
+    if(frame == NULL)
+        return NULL;
+    uint8_t * buf = frame->data();
+    buf[0] = 0x80 | (compressed ? 0x40 : 0) | (opcode & 0x0F);
+    if(len < 126){
+        buf[1] = len;
+    } else if(len <= 0xFFFF){
+        buf[1] = 126;
+        buf[2] = (uint8_t)(len >> 8);
+        buf[3] = (uint8_t)len;
+    } else {
+        buf[1] = 127;
+        for(uint8_t i = 0; i < 8; i++)
+            buf[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+    }
+    if(len)
+        memcpy(buf + headLen, data, len);
+    return frame;
+}
 
-    //ets_printf("W: %u %u\n", _sent - toSend, toSend);
+SAWSocketSharedMessage::SAWSocketSharedMessage(SAWSharedBuffer * frame)
+    :_frame(frame->retain())
+{
+    _opcode = frame->data()[0] & 0x0F;
+    _status = WS_MSG_SENDING;
+}
 
-    bool final = (_sent == _len);
-    uint8_t* dPtr = (uint8_t*)(_data + (_sent - toSend));
-    uint8_t opCode = (toSend && _sent == toSend)?_opcode:(uint8_t)WS_CONTINUATION;
+SAWSocketSharedMessage::~SAWSocketSharedMessage() {
+    _frame->release();
+}
 
-    size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
-    _status = WS_MSG_SENDING;
-    if(toSend && sent != toSend){
-            //ets_printf("E: %u != %u\n", toSend, sent);
-            _sent -= (toSend - sent);
-            _ack -= (toSend - sent);
+void llc::SAWSocketSharedMessage::ack(size_t len, uint32_t time)    {
+    (void)time;
+    _acked += len;
+    if(_acked >= _frame->length()){
+        _status = WS_MSG_SENT;
     }
-    //ets_printf("S: %u %u\n", _sent, sent);
+}
+
+size_t llc::SAWSocketSharedMessage::send(AsyncClient *client)    {
+    if(_status != WS_MSG_SENDING || !client->canSend())
+        return 0;
+    // lwIP copies the bytes, the frame may be freed while the client still has them in flight
+    const size_t toSend = std::min(_frame->length() - _sent, client->space());
+    if(!toSend)
+        return 0;
+    const size_t sent = client->add((const char *)_frame->data() + _sent, toSend);
+    _sent += sent;
     return sent;
 }
 
@@ -406,18 +424,16 @@ SAWSocketMultiMessage::~SAWSocketMultiMessage() {
  const char * AWSC_PING_PAYLOAD = "ESPAsyncWebServer-PING";
  const size_t AWSC_PING_PAYLOAD_LEN = 22;
 
-SAWSocketClient::SAWSocketClient(SAWServerRequest *request, llc::SAWSocket *server)
-    : _controlQueue(LinkedList<SAWSocketControl *>([](SAWSocketControl *c){ delete    c; }))
-    , _messageQueue(LinkedList<SAWSocketMessage *>([](SAWSocketMessage *m){ delete    m; }))
+SAWSocketClient::SAWSocketClient(SAWServerRequest *request, llc::SAWSocket *server, const SAWSocketCompression & compression)
+    : _compression(compression)
     , _tempObject(NULL)
 {
     _client = request->client();
     _server = server;
-    _clientId = _server->_getNextId();
     _status = WS_CONNECTED;
-    _pstate = 0;
     _lastMessageTime = millis();
     _keepAlivePeriod = 0;
+    _overflowPolicy = _server->overflowPolicy();
     _client->setRxTimeout(0);
     _client->onError([](void *r, AsyncClient* c, int8_t error){ (void)c; ((SAWSocketClient*)(r))->_onError(error); }, this);
     _client->onAck([](void *r, AsyncClient* c, size_t len, uint32_t time){ (void)c; ((SAWSocketClient*)(r))->_onAck(len, time); }, this);
@@ -425,61 +441,138 @@ SAWSocketClient::SAWSocketClient(SAWServerRequest *request, llc::SAWSocket *serv
     _client->onTimeout([](void *r, AsyncClient* c, uint32_t time){ (void)c; ((SAWSocketClient*)(r))->_onTimeout(time); }, this);
     _client->onData([](void *r, AsyncClient* c, void *buf, size_t len){ (void)c; ((SAWSocketClient*)(r))->_onData(buf, len); }, this);
     _client->onPoll([](void *r, AsyncClient* c){ (void)c; ((SAWSocketClient*)(r))->_onPoll(); }, this);
-    _server->_addClient(this);
-    _server->_handleEvent(this, WS_EVT_CONNECT, request, NULL, 0);
+    _clientId = _server->_addClient(this);
+    if(!_clientId){
+        // the slot table filled up since the handshake, the server deletes this on disconnect
+        _status = WS_DISCONNECTED;
+        _client->close();
+    } else
+        _server->_handleEvent(this, WS_EVT_CONNECT, request, NULL, 0);
     delete request;
 }
 
 SAWSocketClient::~SAWSocketClient(){
-    _messageQueue.free();
-    _controlQueue.free();
-    _server->_handleEvent(this, WS_EVT_DISCONNECT, NULL, NULL, 0);
+    while(!_messageQueue.empty())
+        delete _messageQueue.pop_front();
+    while(!_controlQueue.empty())
+        delete _controlQueue.pop_front();
+    delete _deflate;
+    delete _inflate;
+    _releaseAssembly();
+    free(_textCopy);
+    if(_clientId)
+        _server->_handleEvent(this, WS_EVT_DISCONNECT, NULL, NULL, 0);
+}
+
+void llc::SAWSocketClient::_written(TAWSControl * control, TAWSMessage * message, size_t len){
+    if(!_inFlight.empty()){
+        InFlight & last = _inFlight.back();
+        if(last.control == control && last.message == message){
+            last.len += len;
+            return;
+        }
+    }
+    _inFlight.push_back({control, message, len});
+}
+
+void llc::SAWSocketClient::_dropConnection(){
+    _status = WS_DISCONNECTED;
+    _closeOnPoll = true;
 }
 
 void llc::SAWSocketClient::_onAck(size_t len, uint32_t time){
+    if(_closeOnPoll){
+        _client->close(true);
+        return;
+    }
     _lastMessageTime = millis();
-    if(!_controlQueue.isEmpty()){
-        auto head = _controlQueue.front();
-        if(head->finished()){
-            len -= head->len();
-            if(_status == WS_DISCONNECTING && head->opcode() == WS_DISCONNECT){
-                _controlQueue.remove(head);
+    // acks come in the order the bytes were written, hand them out along the ledger
+    while(len && !_inFlight.empty()){
+        InFlight & head = _inFlight.front();
+        const size_t acked = std::min(len, head.len);
+        head.len -= acked;
+        len -= acked;
+        if(head.message)
+            head.message->ack(acked, time);
+        if(head.len)
+            break;
+        const InFlight done = _inFlight.pop_front();
+        // control frames go out in queue order, this is the front one
+        if(done.control && _controlQueue.front() == done.control){
+            const uint8_t opcode = done.control->opcode();
+            delete _controlQueue.pop_front();
+            if(_status == WS_DISCONNECTING && opcode == WS_DISCONNECT){
                 _status = WS_DISCONNECTED;
                 _client->close(true);
                 return;
             }
-            _controlQueue.remove(head);
         }
     }
-    if(len && !_messageQueue.isEmpty()){
-        _messageQueue.front()->ack(len, time);
-    }
     _server->_cleanBuffers(); 
     _runQueue();
 }
 
 void llc::SAWSocketClient::_onPoll(){
-    if(_client->canSend() && (!_controlQueue.isEmpty() || !_messageQueue.isEmpty())){
+    if(_closeOnPoll){
+        _client->close(true);
+        return;
+    }
+    if(_client->canSend() && (!_controlQueue.empty() || !_messageQueue.empty())){
         _runQueue();
-    } else if(_keepAlivePeriod > 0 && _controlQueue.isEmpty() && _messageQueue.isEmpty() && (millis() - _lastMessageTime) >= _keepAlivePeriod){
+    } else if(_keepAlivePeriod > 0 && _controlQueue.empty() && _messageQueue.empty() && (millis() - _lastMessageTime) >= _keepAlivePeriod){
         ping((uint8_t *)AWSC_PING_PAYLOAD, AWSC_PING_PAYLOAD_LEN);
     }
 }
 
 void llc::SAWSocketClient::_runQueue(){
-    while(!_messageQueue.isEmpty() && _messageQueue.front()->finished()){
-        _messageQueue.remove(_messageQueue.front());
-    }
-
-    if(!_controlQueue.isEmpty() && (_messageQueue.isEmpty() || _messageQueue.front()->betweenFrames()) && webSocketSendFrameWindow(_client) > (size_t)(_controlQueue.front()->len() - 1)){
-        _controlQueue.front()->send(_client);
-    } else if(!_messageQueue.isEmpty() && _messageQueue.front()->betweenFrames() && webSocketSendFrameWindow(_client)){
-        _messageQueue.front()->send(_client);
+    // messages finish once acked completely, which happens in queue order
+    while(!_messageQueue.empty() && _messageQueue.front()->finished()){
+        delete _messageQueue.pop_front();
+    }
+
+    // keep writing until the send window is full, without waiting for acks, and push it all out at once
+    bool wrote = false;
+    for(;;){
+        // messages before the first one with bytes left are written completely, the ones after it not at all
+        TAWSMessage * message = NULL;
+        for(size_t i = 0; i < _messageQueue.size(); i++){
+            if(_messageQueue[i]->readyToSend()){
+                message = _messageQueue[i];
+                break;
+            }
+        }
+        TAWSControl * control = NULL;
+        for(size_t i = 0; i < _controlQueue.size(); i++){
+            if(!_controlQueue[i]->finished()){
+                control = _controlQueue[i];
+                break;
+            }
+        }
+        if(_closeOnPoll)
+            break;
+        size_t written = 0;
+        // control frames jump ahead of messages, but not into the middle of a frame
+        if(control != NULL && (message == NULL || message->betweenFrames()) && webSocketSendFrameWindow(_client) > (size_t)(control->len() - 1)){
+            if((written = control->send(_client)) != 0)
+                _written(control, NULL, written);
+        } else if(message != NULL && webSocketSendFrameWindow(_client)){
+            if((written = message->send(_client)) != 0)
+                _written(NULL, message, written);
+        }
+        if(written == WS_FRAME_BROKEN){
+            _dropConnection();
+            break;
+        }
+        if(!written)
+            break;
+        wrote = true;
     }
+    if(wrote)
+        _client->send();
 }
 
 bool llc::SAWSocketClient::queueIsFull(){
-    if((_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES) || (_status != WS_CONNECTED) ) return true;
+    if(_messageQueue.full() || (_status != WS_CONNECTED) ) return true;
     return false;
 }
 
@@ -490,11 +583,32 @@ void llc::SAWSocketClient::_queueMessage(SAWSocketMessage *dataMessage){
         delete dataMessage;
         return;
     }
-    if(_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES){
+    const AwsOverflowPolicy policy = dataMessage->overflowPolicy(_overflowPolicy);
+    bool queued = false;
+    if(policy == WS_CONFLATE && dataMessage->key()){
+        for(size_t i = 0; i < _messageQueue.size(); ++i){
+            SAWSocketMessage *& stale = _messageQueue[i];
+            if(stale->key() == dataMessage->key() && !stale->started() && !stale->pinned()){
+                delete stale;
+                stale = dataMessage;
+                queued = true;
+                break;
+            }
+        }
+    }
+    if(!queued && _messageQueue.full() && policy != WS_DROP_NEWEST){
+        // make room by dropping the oldest message nothing was written of yet
+        for(size_t i = 0; i < _messageQueue.size(); ++i){
+            if(!_messageQueue[i]->started() && !_messageQueue[i]->pinned()){
+                delete _messageQueue[i];
+                _messageQueue.erase(i);
+                break;
+            }
+        }
+    }
+    if(!queued && !_messageQueue.push_back(dataMessage)){
             ets_printf("ERROR: Too many messages queued\n");
             delete dataMessage;
-    } else {
-            _messageQueue.add(dataMessage);
     }
     if(_client->canSend())
         _runQueue();
@@ -503,7 +617,13 @@ void llc::SAWSocketClient::_queueMessage(SAWSocketMessage *dataMessage){
 void llc::SAWSocketClient::_queueControl(SAWSocketControl *controlMessage){
     if(controlMessage == NULL)
         return;
-    _controlQueue.add(controlMessage);
+    if(!_controlQueue.push_back(controlMessage)){
+        // without room for a close frame the connection just goes
+        if(controlMessage->opcode() == WS_DISCONNECT)
+            _dropConnection();
+        delete controlMessage;
+        return;
+    }
     if(_client->canSend())
         _runQueue();
 }
@@ -552,93 +672,249 @@ void llc::SAWSocketClient::_onDisconnect(){
 
 void llc::SAWSocketClient::_onData(void *pbuf, size_t plen){
     _lastMessageTime = millis();
-    uint8_t *data = (uint8_t*)pbuf;
-    while(plen > 0){
-        if(!_pstate){
-            const uint8_t *fdata = data;
-            _pinfo.index = 0;
-            _pinfo.final = (fdata[0] & 0x80) != 0;
-            _pinfo.opcode = fdata[0] & 0x0F;
-            _pinfo.masked = (fdata[1] & 0x80) != 0;
-            _pinfo.len = fdata[1] & 0x7F;
-            data += 2;
-            plen -= 2;
-            if(_pinfo.len == 126){
-                _pinfo.len = fdata[3] | (uint16_t)(fdata[2]) << 8;
-                data += 2;
-                plen -= 2;
-            } else if(_pinfo.len == 127){
-                _pinfo.len = fdata[9] | (uint16_t)(fdata[8]) << 8 | (uint32_t)(fdata[7]) << 16 | (uint32_t)(fdata[6]) << 24 | (uint64_t)(fdata[5]) << 32 | (uint64_t)(fdata[4]) << 40 | (uint64_t)(fdata[3]) << 48 | (uint64_t)(fdata[2]) << 56;
-                data += 8;
-                plen -= 8;
-            }
+    if(!_inputFailed)
+        _decoder.decode(*this, (uint8_t*)pbuf, plen);
+}
+
+bool llc::SAWSocketClient::_frameHeader(const SAWFrameHeader & header){
+    _pinfo.index = 0;
+    _pinfo.final = header.final;
+    _pinfo.opcode = header.opcode;
+    _pinfo.masked = header.masked;
+    _pinfo.len = header.len;
+    if(header.masked)
+        memcpy(_pinfo.mask, header.mask, 4);
+    const bool control = _pinfo.opcode >= WS_DISCONNECT;
+    // RSV1 only on the first frame of a compressed message
+    if((header.rsv1 && (!_compression.enabled || _pinfo.opcode == WS_CONTINUATION || control))
+        || (control && (_pinfo.len > 125 || !_pinfo.final)) || (_pinfo.len >> 63)){
+        _inputFailed = true;
+        close(1002);
+        return false;
+    }
+    if(_pinfo.opcode == WS_TEXT || _pinfo.opcode == WS_BINARY){
+        _assembleCompressed = header.rsv1 && _compression.enabled;
+        _assembleOpcode = (_assembleCompressed || _server->wholeMessages()) ? _pinfo.opcode : 0;
+    }
+    if(!control){
+        if(_pinfo.opcode){
+            _pinfo.message_opcode = _pinfo.opcode;
+            _pinfo.num = 0;
+        } else
+            _pinfo.num += 1;
+        if(_assembleOpcode)
+            _reserveAssembly();
+    }
+    return true;
+}
 
-            if(_pinfo.masked){
-                memcpy(_pinfo.mask, data, 4);
-                data += 4;
-                plen -= 4;
+bool llc::SAWSocketClient::_framePayload(uint8_t * data, size_t len, bool last){
+    if(_pinfo.masked)
+        llc::applyWebSocketMask(data, len, _pinfo.mask, _pinfo.index);
+    if(_pinfo.opcode >= WS_DISCONNECT){
+        // at most 125 bytes, handled once all of them are in
+        memcpy(_control + _pinfo.index, data, len);
+        _pinfo.index += len;
+        if(last){
+            _control[_pinfo.len] = 0;
+            _handleControl();
+        }
+        return !_inputFailed;
+    }
+    if(_assembleOpcode){
+        //compressed messages, and all of them when asked for, are handed out whole
+        if(!_assembleFailed){
+            memcpy(_assembly + _assemblyLen, data, len);
+            _assemblyLen += len;
+        }
+        if(last && _pinfo.final){
+            const uint8_t opcode = _assembleOpcode;
+            _assembleOpcode = 0;
+            if(_assembleFailed)
+                _assembleFailed = false;
+            else if(_assembleCompressed)
+                _inflateMessage(opcode);
+            else
+                _deliverMessage(opcode);
+        }
+    } else if(len || !_pinfo.len){
+        _handleData(data, len);
+    }
+    _pinfo.index += len;
+    return !_inputFailed;
+}
+
+void llc::SAWSocketClient::_handleControl(){
+    const size_t len = _pinfo.len;
+    if(_pinfo.opcode == WS_DISCONNECT){
+        if(len >= 2){
+            uint16_t reasonCode = (uint16_t)(_control[0] << 8) + _control[1];
+            if(reasonCode > 1001){
+                _server->_handleEvent(this, WS_EVT_ERROR, (void *)&reasonCode, _control + 2, len - 2);
+            }
+        }
+        if(_status == WS_DISCONNECTING){
+            _status = WS_DISCONNECTED;
+            _client->close(true);
+        } else {
+            _status = WS_DISCONNECTING;
+            _client->ackLater();
+            _queueControl(new llc::SAWSocketControl(WS_DISCONNECT, _control, len));
+        }
+    } else if(_pinfo.opcode == WS_PING){
+        _queueControl(new llc::SAWSocketControl(WS_PONG, _control, len));
+    } else if(_pinfo.opcode == WS_PONG){
+        if(len != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, _control, AWSC_PING_PAYLOAD_LEN) != 0)
+            _server->_handleEvent(this, WS_EVT_PONG, NULL, _control, len);
+    }
+}
+
+void llc::SAWSocketClient::_handleData(const uint8_t * data, size_t len){
+    const size_t copyMax = _server->textCopy();
+    if(_pinfo.message_opcode == WS_TEXT && len <= copyMax){
+        if(_textCopyCapacity < len + 1){
+            uint8_t * grown = (uint8_t *)realloc(_textCopy, copyMax + 1);
+            if(grown != NULL){
+                _textCopy = grown;
+                _textCopyCapacity = copyMax + 1;
             }
         }
+        if(_textCopyCapacity >= len + 1){
+            memcpy(_textCopy, data, len);
+            _textCopy[len] = 0;
+            data = _textCopy;
+        }
+    }
+    // the handler gets a span of the received segment, it is not to be written to
+    _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, (uint8_t *)data, len);
+}
 
-        const size_t datalen = std::min((size_t)(_pinfo.len - _pinfo.index), plen);
-        const auto datalast = data[datalen];
+void llc::SAWSocketClient::_reserveAssembly(){
+    if(_assembleFailed)
+        return;
+    const size_t limit = _assembleCompressed ? SAW_WS_INFLATE_MAX : _server->wholeMessages();
+    if(_pinfo.len > limit - _assemblyLen){
+        _failAssembly(1009);
+        return;
+    }
+    // room for the 00 00 FF FF the sender of a compressed message left out, or for a terminator
+    const size_t needed = _assemblyLen + _pinfo.len + (_assembleCompressed ? 4 : 1);
+    if(needed <= _assemblyCapacity)
+        return;
+    size_t capacity = 0;
+    uint8_t * grown = _server->_messageBuffers().acquire(needed, capacity);
+    if(grown == NULL){
+        _failAssembly(1011);
+        return;
+    }
+    if(_assemblyLen)
+        memcpy(grown, _assembly, _assemblyLen);
+    _server->_messageBuffers().release(_assembly, _assemblyCapacity);
+    _assembly = grown;
+    _assemblyCapacity = capacity;
+}
 
-        if(_pinfo.masked){
-            for(size_t i=0;i<datalen;i++)
-                data[i] ^= _pinfo.mask[(_pinfo.index+i)%4];
-        }
+void llc::SAWSocketClient::_releaseAssembly(){
+    _server->_messageBuffers().release(_assembly, _assemblyCapacity);
+    _assembly = NULL;
+    _assemblyLen = 0;
+    _assemblyCapacity = 0;
+}
 
-        if((datalen + _pinfo.index) < _pinfo.len){
-            _pstate = 1;
+void llc::SAWSocketClient::_failAssembly(uint16_t code){
+    _releaseAssembly();
+    _assembleFailed = true;
+    close(code);
+}
 
-            if(_pinfo.index == 0){
-                if(_pinfo.opcode){
-                    _pinfo.message_opcode = _pinfo.opcode;
-                    _pinfo.num = 0;
-                } else _pinfo.num += 1;
-            }
-            _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, (uint8_t*)data, datalen);
-
-            _pinfo.index += datalen;
-        } else if((datalen + _pinfo.index) == _pinfo.len){
-            _pstate = 0;
-            if(_pinfo.opcode == WS_DISCONNECT){
-                if(datalen){
-                    uint16_t reasonCode = (uint16_t)(data[0] << 8) + data[1];
-                    char * reasonString = (char*)(data+2);
-                    if(reasonCode > 1001){
-                        _server->_handleEvent(this, WS_EVT_ERROR, (void *)&reasonCode, (uint8_t*)reasonString, strlen(reasonString));
-                    }
-                }
-                if(_status == WS_DISCONNECTING){
-                    _status = WS_DISCONNECTED;
-                    _client->close(true);
-                } else {
-                    _status = WS_DISCONNECTING;
-                    _client->ackLater();
-                    _queueControl(new llc::SAWSocketControl(WS_DISCONNECT, data, datalen));
-                }
-            } else if(_pinfo.opcode == WS_PING){
-                _queueControl(new llc::SAWSocketControl(WS_PONG, data, datalen));
-            } else if(_pinfo.opcode == WS_PONG){
-                if(datalen != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) != 0)
-                    _server->_handleEvent(this, WS_EVT_PONG, NULL, data, datalen);
-            } else if(_pinfo.opcode < 8){//continuation or text/binary frame
-                _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, data, datalen);
+void llc::SAWSocketClient::_inflateMessage(uint8_t opcode){
+    if(_inflate == NULL){
+        _inflate = new (std::nothrow) SAWInflate();
+        if(_inflate == NULL || !_inflate->begin(_compression.clientWindowBits, !_compression.clientNoContextTakeover)){
+            _failAssembly(1011);
+            _assembleFailed = false;
+            return;
+        }
+    }
+    static const uint8_t tail[4] = {0x00, 0x00, 0xFF, 0xFF};
+    memcpy(_assembly + _assemblyLen, tail, 4);
+    uint8_t * message = NULL;
+    size_t len = 0;
+    const size_t maxLen = _server->wholeMessages() ? std::min<size_t>(_server->wholeMessages(), SAW_WS_INFLATE_MAX) : SAW_WS_INFLATE_MAX;
+    const SAWInflate::Result result = _inflate->inflate(_assembly, _assemblyLen + 4, maxLen, message, len);
+    _releaseAssembly();
+    if(result != SAWInflate::DONE){
+        close(result == SAWInflate::TOO_LARGE ? 1009 : (result == SAWInflate::NO_MEMORY ? 1011 : 1007));
+        return;
+    }
+    // text handlers treat the data as a C string, as with uncompressed messages; SAWInflate left room for it
+    message[len] = 0;
+    SAWSocketFrameInfo info;
+    info.message_opcode = opcode;
+    info.opcode = opcode;
+    info.final = 1;
+    info.len = len;
+    _server->_handleEvent(this, WS_EVT_DATA, (void *)&info, message, len);
+    free(message);
+}
+
+void llc::SAWSocketClient::_deliverMessage(uint8_t opcode){
+    _assembly[_assemblyLen] = 0;
+    SAWSocketFrameInfo info;
+    info.message_opcode = opcode;
+    info.opcode = opcode;
+    info.final = 1;
+    info.len = _assemblyLen;
+    _server->_handleEvent(this, WS_EVT_DATA, (void *)&info, _assembly, _assemblyLen);
+    _releaseAssembly();
+}
+
+bool llc::SAWSocketClient::_sendCompressed(uint8_t opcode, const uint8_t * data, size_t len){
+    if(!_compression.enabled || len < SAW_WS_DEFLATE_MIN_LENGTH || queueIsFull())
+        return false;
+    SAWSharedBuffer * frame = NULL;
+    if(_compression.serverNoContextTakeover){
+        frame = webSocketDeflateFrame(NULL, _compression.serverWindowBits, opcode, data, len);
+    } else {
+        if(_deflate == NULL){
+            _deflate = new (std::nothrow) SAWDeflate();
+            if(_deflate != NULL && !_deflate->begin(SAWDeflate::RAW_SYNC, _compression.serverWindowBits)){
+                delete _deflate;
+                _deflate = NULL;
             }
-        } else {
-            //os_printf("frame error: len: %u, index: %llu, total: %llu\n", datalen, _pinfo.index, _pinfo.len);
-            //what should we do?
-            break;
         }
+        if(_deflate != NULL)
+            frame = webSocketDeflateFrame(_deflate, 0, opcode, data, len);
+    }
+    if(frame == NULL)
+        return false;
+    llc::SAWSocketSharedMessage * message = new llc::SAWSocketSharedMessage(frame);
+    frame->release();
+    // the client's window holds it now, dropping it would break every later message
+    if(!_compression.serverNoContextTakeover)
+        message->pin();
+    _queueMessage(message);
+    return true;
+}
 
-        // restore byte as _handleEvent may have added a null terminator i.e., data[len] = 0;
-        if (datalen > 0)
-            data[datalen] = datalast;
-
-        data += datalen;
-        plen -= datalen;
+void llc::SAWSocketClient::conflate(const char * key, const char * message, size_t len, AwsFrameType type){
+    llc::SAWSocketMessage * update = NULL;
+    // only stateless compression, a message that may be replaced can't go through the window
+    if(_compression.enabled && _compression.serverNoContextTakeover && len >= SAW_WS_DEFLATE_MIN_LENGTH){
+        SAWSharedBuffer * frame = webSocketDeflateFrame(NULL, _compression.serverWindowBits, type, (const uint8_t *)message, len);
+        if(frame != NULL){
+            update = new llc::SAWSocketSharedMessage(frame);
+            frame->release();
+        }
     }
+    if(update == NULL)
+        update = new llc::SAWSocketBasicMessage(message, len, type);
+    update->setOverflowPolicy(WS_CONFLATE, llc::SAWSocketMessage::keyOf(key));
+    _queueMessage(update);
+}
+
+void llc::SAWSocketClient::conflate(const char * key, const String & message, AwsFrameType type){
+    conflate(key, message.c_str(), message.length(), type);
 }
 
 size_t llc::SAWSocketClient::printf(const char *format, ...) {
@@ -704,7 +980,8 @@ size_t llc::SAWSocketClient::printf_P(PGM_P formatP, ...) {
 #endif
 
 void llc::SAWSocketClient::text(const char * message, size_t len){
-    _queueMessage(new llc::SAWSocketBasicMessage(message, len));
+    if(!_sendCompressed(WS_TEXT, (const uint8_t *)message, len))
+        _queueMessage(new llc::SAWSocketBasicMessage(message, len));
 }
 void llc::SAWSocketClient::text(const char * message){
     text(message, strlen(message));
@@ -736,11 +1013,13 @@ void llc::SAWSocketClient::text(const __FlashStringHelper *data){
 }
 void llc::SAWSocketClient::text(SAWSocketMessageBuffer * buffer)
 {
-    _queueMessage(new llc::SAWSocketMultiMessage(buffer));
+    if(buffer == NULL || !_sendCompressed(WS_TEXT, buffer->get(), buffer->length()))
+        _queueMessage(new llc::SAWSocketMultiMessage(buffer));
 }
 
 void llc::SAWSocketClient::binary(const char * message, size_t len){
-    _queueMessage(new llc::SAWSocketBasicMessage(message, len, WS_BINARY));
+    if(!_sendCompressed(WS_BINARY, (const uint8_t *)message, len))
+        _queueMessage(new llc::SAWSocketBasicMessage(message, len, WS_BINARY));
 }
 void llc::SAWSocketClient::binary(const char * message){
     binary(message, strlen(message));
@@ -767,7 +1046,8 @@ void llc::SAWSocketClient::binary(const __FlashStringHelper *data, size_t len){
 }
 void llc::SAWSocketClient::binary(SAWSocketMessageBuffer * buffer)
 {
-    _queueMessage(new llc::SAWSocketMultiMessage(buffer, WS_BINARY));
+    if(buffer == NULL || !_sendCompressed(WS_BINARY, buffer->get(), buffer->length()))
+        _queueMessage(new llc::SAWSocketMultiMessage(buffer, WS_BINARY));
 }
 
 IPAddress llc::SAWSocketClient::remoteIP() {
@@ -792,9 +1072,8 @@ uint16_t llc::SAWSocketClient::remotePort() {
 
 SAWSocket::SAWSocket(const String& url)
     :_url(url)
-    ,_clients(LinkedList<SAWSocketClient *>([](SAWSocketClient *c){ delete c; }))
-    ,_cNextId(1)
     ,_enabled(true)
+    ,_messagePool(1)
     ,_buffers(LinkedList<SAWSocketMessageBuffer *>([](SAWSocketMessageBuffer *b){ delete b; }))
 {
     _eventHandler = NULL;
@@ -808,43 +1087,68 @@ void llc::SAWSocket::_handleEvent(SAWSocketClient * client, AwsEventType type, v
     }
 }
 
-void llc::SAWSocket::_addClient(SAWSocketClient * client){
-    _clients.add(client);
+uint32_t llc::SAWSocket::_addClient(SAWSocketClient * client){
+    const uint32_t free = ~_occupied & WS_ALL_SLOTS;
+    if(!free)
+        return 0;
+    const uint8_t slot = __builtin_ctz(free);
+    _slots[slot] = client;
+    _occupied |= 1UL << slot;
+    // 0 is no client
+    _generation = (_generation + 1) & 0xFFFFFF;
+    if(!_generation)
+        _generation = 1;
+    return (_generation << WS_ID_SLOT_BITS) | slot;
 }
 
 void llc::SAWSocket::_handleDisconnect(SAWSocketClient * client){
-    
-    _clients.remove_first([=](SAWSocketClient * c){
-        return c->id() == client->id();
-    });
+    const uint8_t slot = client->slot();
+    if(slot != WS_NO_SLOT && _slots[slot] == client){
+        const uint32_t bit = 1UL << slot;
+        for(Topic & topic : _topics){
+            if((topic.subscribers & bit) && !(topic.subscribers &= ~bit))
+                topic.name = String();
+        }
+        _slots[slot] = NULL;
+        _occupied &= ~bit;
+    }
+    delete client;
+    // an idle socket holds no message memory
+    if(!_occupied)
+        _messagePool.trim();
 }
 
 bool llc::SAWSocket::availableForWriteAll(){
-    for(const auto& c: _clients){
-        if(c->queueIsFull()) return false;
+    for(const auto& c: _slots){
+        if(c != NULL && c->queueIsFull()) return false;
     }
     return true;
 }
 
 bool llc::SAWSocket::availableForWrite(uint32_t id){
-    for(const auto& c: _clients){
-        if(c->queueIsFull() && (c->id() == id )) return false;
-    }
-    return true;
+    const uint8_t slot = id & ((1UL << WS_ID_SLOT_BITS) - 1);
+    if(slot >= WS_MAX_CLIENT_SLOTS || _slots[slot] == NULL || _slots[slot]->id() != id)
+        return true;
+    return !_slots[slot]->queueIsFull();
 }
 
 size_t llc::SAWSocket::count() const {
-    return _clients.count_if([](SAWSocketClient * c){
-        return c->status() == WS_CONNECTED;
-    });
+    size_t connected = 0;
+    for(const auto& c: _slots){
+        if(c != NULL && c->status() == WS_CONNECTED)
+            ++connected;
+    }
+    return connected;
 }
 
 SAWSocketClient * llc::SAWSocket::client(uint32_t id){
-    for(const auto &c: _clients){
-        if(c->id() == id && c->status() == WS_CONNECTED){
-            return c;
-        }
-    }
+    const uint8_t slot = id & ((1UL << WS_ID_SLOT_BITS) - 1);
+    if(slot >= WS_MAX_CLIENT_SLOTS)
+        return nullptr;
+    SAWSocketClient * c = _slots[slot];
+    // a stale id has an older generation than the slot's client
+    if(c != NULL && c->id() == id && c->status() == WS_CONNECTED)
+        return c;
     return nullptr;
 }
 
@@ -856,17 +1160,30 @@ void llc::SAWSocket::close(uint32_t id, uint16_t code, const char * message){
 }
 
 void llc::SAWSocket::closeAll(uint16_t code, const char * message){
-    for(const auto& c: _clients){
-        if(c->status() == WS_CONNECTED)
+    for(const auto& c: _slots){
+        if(c != NULL && c->status() == WS_CONNECTED)
             c->close(code, message);
     }
 }
 
 void llc::SAWSocket::cleanupClients(uint16_t maxClients)
 {
-    if (count() > maxClients){
-        _clients.front()->close();
+    if (count() <= maxClients)
+        return;
+    // the oldest connection has the generation furthest behind the latest one
+    SAWSocketClient * oldest = NULL;
+    uint32_t oldestAge = 0;
+    for(const auto& c: _slots){
+        if(c == NULL || c->status() != WS_CONNECTED)
+            continue;
+        const uint32_t age = (_generation - (c->id() >> WS_ID_SLOT_BITS)) & 0xFFFFFF;
+        if(oldest == NULL || age > oldestAge){
+            oldest = c;
+            oldestAge = age;
+        }
     }
+    if(oldest != NULL)
+        oldest->close();
 }
 
 void llc::SAWSocket::ping(uint32_t id, uint8_t *data, size_t len){
@@ -876,8 +1193,8 @@ void llc::SAWSocket::ping(uint32_t id, uint8_t *data, size_t len){
 }
 
 void llc::SAWSocket::pingAll(uint8_t *data, size_t len){
-    for(const auto& c: _clients){
-        if(c->status() == WS_CONNECTED)
+    for(const auto& c: _slots){
+        if(c != NULL && c->status() == WS_CONNECTED)
             c->ping(data, len);
     }
 }
@@ -888,22 +1205,57 @@ void llc::SAWSocket::text(uint32_t id, const char * message, size_t len){
         c->text(message, len);
 }
 
+void llc::SAWSocket::_broadcast(uint8_t opcode, const uint8_t * data, size_t len, uint32_t key, const uint32_t * slots){
+    SAWSharedBuffer * frame = NULL;
+    // without server context takeover the output only depends on the window size, indexed by window bits from the
+    // smallest one a client may ask for
+    SAWSharedBuffer * compressed[SAWDeflate::MAX_WINDOW_BITS - SAWDeflate::MIN_WINDOW_BITS + 1] = {};
+    auto send = [&](SAWSocketClient * c){
+        if(c == NULL || c->status() != WS_CONNECTED)
+            return;
+        const SAWSocketCompression & compression = c->compression();
+        SAWSharedBuffer * message = NULL;
+        if(compression.enabled && len >= SAW_WS_DEFLATE_MIN_LENGTH){
+            if(!compression.serverNoContextTakeover){
+                // keyed updates may be replaced in the queue, they stay out of the client's window
+                if(!key && c->_sendCompressed(opcode, data, len))
+                    return;
+            } else {
+                SAWSharedBuffer *& shared = compressed[compression.serverWindowBits - SAWDeflate::MIN_WINDOW_BITS];
+                if(shared == NULL)
+                    shared = webSocketDeflateFrame(NULL, compression.serverWindowBits, opcode, data, len);
+                message = shared;
+            }
+        }
+        if(message == NULL){
+            if(frame == NULL && (frame = SAWSocketSharedMessage::encode(opcode, data, len)) == NULL)
+                return;
+            message = frame;
+        }
+        llc::SAWSocketSharedMessage * shared = new llc::SAWSocketSharedMessage(message);
+        if(key)
+            shared->setOverflowPolicy(WS_CONFLATE, key);
+        c->message(shared);
+    };
+    for(uint32_t bits = slots == NULL ? _occupied : *slots & _occupied; bits; bits &= bits - 1)
+        send(_slots[__builtin_ctz(bits)]);
+    if(frame != NULL)
+        frame->release();
+    for(SAWSharedBuffer * shared : compressed)
+        if(shared != NULL)
+            shared->release();
+}
+
 void llc::SAWSocket::textAll(SAWSocketMessageBuffer * buffer){
     if (!buffer) return;
-    buffer->lock(); 
-    for(const auto& c: _clients){
-        if(c->status() == WS_CONNECTED){
-                c->text(buffer);
-        }
-    }
-    buffer->unlock();
+    // the frame holds its own copy, the buffer can go right away
+    _broadcast(WS_TEXT, buffer->get(), buffer->length());
     _cleanBuffers(); 
 }
 
 
 void llc::SAWSocket::textAll(const char * message, size_t len){
-    llc::SAWSocketMessageBuffer * WSBuffer = makeBuffer((uint8_t *)message, len); 
-        textAll(WSBuffer); 
+    _broadcast(WS_TEXT, (const uint8_t *)message, len);
 }
 
 void llc::SAWSocket::binary(uint32_t id, const char * message, size_t len){
@@ -913,22 +1265,85 @@ void llc::SAWSocket::binary(uint32_t id, const char * message, size_t len){
 }
 
 void llc::SAWSocket::binaryAll(const char * message, size_t len){
-    llc::SAWSocketMessageBuffer * buffer = makeBuffer((uint8_t *)message, len); 
-    binaryAll(buffer); 
+    _broadcast(WS_BINARY, (const uint8_t *)message, len);
 }
 
 void llc::SAWSocket::binaryAll(SAWSocketMessageBuffer * buffer)
 {
     if (!buffer) return;
-    buffer->lock(); 
-        for(const auto& c: _clients){
-        if(c->status() == WS_CONNECTED)
-            c->binary(buffer);
-    }
-    buffer->unlock(); 
+    _broadcast(WS_BINARY, buffer->get(), buffer->length());
     _cleanBuffers(); 
 }
 
+void llc::SAWSocket::conflateAll(const char * key, const char * message, size_t len, AwsFrameType type){
+    _broadcast(type, (const uint8_t *)message, len, llc::SAWSocketMessage::keyOf(key));
+}
+
+void llc::SAWSocket::conflateAll(const char * key, const String &message, AwsFrameType type){
+    conflateAll(key, message.c_str(), message.length(), type);
+}
+
+llc::SAWSocket::Topic * llc::SAWSocket::_topic(const String & name){
+    for(Topic & topic : _topics){
+        if(topic.subscribers && topic.name == name)
+            return &topic;
+    }
+    return NULL;
+}
+
+bool llc::SAWSocket::subscribe(uint32_t id, const String & topic){
+    llc::SAWSocketClient * c = client(id);
+    if(c == NULL)
+        return false;
+    Topic * t = _topic(topic);
+    if(t == NULL){
+        for(Topic & free : _topics){
+            if(!free.subscribers){
+                t = &free;
+                t->name = topic;
+                break;
+            }
+        }
+        if(t == NULL)
+            return false;
+    }
+    t->subscribers |= 1UL << c->slot();
+    return true;
+}
+
+void llc::SAWSocket::unsubscribe(uint32_t id, const String & topic){
+    llc::SAWSocketClient * c = client(id);
+    Topic * t = _topic(topic);
+    if(c == NULL || t == NULL)
+        return;
+    if(!(t->subscribers &= ~(1UL << c->slot())))
+        t->name = String();
+}
+
+bool llc::SAWSocket::subscribed(uint32_t id, const String & topic){
+    llc::SAWSocketClient * c = client(id);
+    Topic * t = _topic(topic);
+    return c != NULL && t != NULL && (t->subscribers & (1UL << c->slot()));
+}
+
+size_t llc::SAWSocket::subscribers(const String & topic){
+    Topic * t = _topic(topic);
+    return t == NULL ? 0 : __builtin_popcount(t->subscribers);
+}
+
+void llc::SAWSocket::publish(const String & topic, const char * message, size_t len, AwsFrameType type){
+    Topic * t = _topic(topic);
+    if(t == NULL)
+        return;
+    // a copy, queueing may close clients
+    const uint32_t subscribers = t->subscribers;
+    _broadcast(type, (const uint8_t *)message, len, 0, &subscribers);
+}
+
+void llc::SAWSocket::publish(const String & topic, const String & message, AwsFrameType type){
+    publish(topic, message.c_str(), message.length(), type);
+}
+
 void llc::SAWSocket::message(uint32_t id, llc::SAWSocketMessage *message){
     llc::SAWSocketClient * c = client(id);
     if(c)
@@ -936,8 +1351,8 @@ void llc::SAWSocket::message(uint32_t id, llc::SAWSocketMessage *message){
 }
 
 void llc::SAWSocket::messageAll(SAWSocketMultiMessage *message){
-    for(const auto& c: _clients){
-        if(c->status() == WS_CONNECTED)
+    for(const auto& c: _slots){
+        if(c != NULL && c->status() == WS_CONNECTED)
             c->message(message);
     }
     _cleanBuffers(); 
@@ -1047,9 +1462,13 @@ void llc::SAWSocket::textAll(const String &message){
     textAll(message.c_str(), message.length());
 }
 void llc::SAWSocket::textAll(const __FlashStringHelper *message){
-    for(const auto& c: _clients){
-        if(c->status() == WS_CONNECTED)
-            c->text(message);
+    PGM_P p = reinterpret_cast<PGM_P>(message);
+    size_t n = strlen_P(p);
+    char * buf = (char*) malloc(n+1);
+    if(buf){
+        memcpy_P(buf, p, n);
+        _broadcast(WS_TEXT, (const uint8_t *)buf, n);
+        free(buf);
     }
 }
 void llc::SAWSocket::binary(uint32_t id, const char * message){
@@ -1082,9 +1501,11 @@ void llc::SAWSocket::binaryAll(const String &message){
     binaryAll(message.c_str(), message.length());
 }
 void llc::SAWSocket::binaryAll(const __FlashStringHelper *message, size_t len){
-    for(const auto& c: _clients){
-        if(c->status() == WS_CONNECTED)
-            c-> binary(message, len);
+    char * buf = (char*) malloc(len);
+    if(buf){
+        memcpy_P(buf, reinterpret_cast<PGM_P>(message), len);
+        _broadcast(WS_BINARY, (const uint8_t *)buf, len);
+        free(buf);
     }
  }
 
@@ -1094,6 +1515,7 @@ const char * WS_STR_ORIGIN = "Origin";
 const char * WS_STR_VERSION = "Sec-WebSocket-Version";
 const char * WS_STR_KEY = "Sec-WebSocket-Key";
 const char * WS_STR_PROTOCOL = "Sec-WebSocket-Protocol";
+const char * WS_STR_EXTENSIONS = "Sec-WebSocket-Extensions";
 const char * WS_STR_ACCEPT = "Sec-WebSocket-Accept";
 const char * WS_STR_UUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
@@ -1110,9 +1532,101 @@ bool llc::SAWSocket::canHandle(SAWServerRequest *request){
     request->addInterestingHeader(WS_STR_VERSION);
     request->addInterestingHeader(WS_STR_KEY);
     request->addInterestingHeader(WS_STR_PROTOCOL);
+    if(_compression.enabled)
+        request->addInterestingHeader(WS_STR_EXTENSIONS);
+    return true;
+}
+
+// Window bits parameter value, 0 when it is not a number in 8..15
+// zlib based clients can't inflate an 8 bit window, this deflater does not go beyond 14. Offers may narrow the
+// server's window down to 8 afterwards.
+static void webSocketClampWindowBits(llc::SAWSocketCompression & compression){
+    compression.serverWindowBits = std::min<uint8_t>(std::max<uint8_t>(compression.serverWindowBits, 9), llc::SAWDeflate::MAX_WINDOW_BITS);
+    compression.clientWindowBits = std::min<uint8_t>(std::max<uint8_t>(compression.clientWindowBits, 8), 15);
+}
+
+static uint8_t webSocketWindowBits(String value){
+    value.trim();
+    if(value.length() > 2 && value[0] == '"' && value[value.length() - 1] == '"')
+        value = value.substring(1, value.length() - 1);
+    if(value.length() == 0 || value.length() > 2)
+        return 0;
+    for(size_t i = 0; i < value.length(); i++)
+        if(!isDigit(value[i]))
+            return 0;
+    const long bits = value.toInt();
+    return (bits >= 8 && bits <= 15) ? (uint8_t)bits : 0;
+}
+
+// RFC 7692 7.1: accepts one permessage-deflate offer, narrowing compression to it and writing the response element.
+// Unknown, repeated or malformed parameters decline the offer.
+static bool webSocketAcceptDeflate(const String & offer, llc::SAWSocketCompression & compression, String & response){
+    int separator = offer.indexOf(';');
+    String name = offer.substring(0, separator < 0 ? offer.length() : separator);
+    name.trim();
+    if(!name.equalsIgnoreCase("permessage-deflate"))
+        return false;
+    llc::SAWSocketCompression accepted = compression;
+    bool clientBitsOffered = false;
+    uint8_t clientBitsMax = 15;
+    uint8_t seen = 0;
+    while(separator >= 0){
+        const int next = offer.indexOf(';', separator + 1);
+        const String param = offer.substring(separator + 1, next < 0 ? offer.length() : next);
+        separator = next;
+        const int equals = param.indexOf('=');
+        String key = param.substring(0, equals < 0 ? param.length() : equals);
+        key.trim();
+        const uint8_t bits = equals < 0 ? 0 : webSocketWindowBits(param.substring(equals + 1));
+        uint8_t flag;
+        if(key.equalsIgnoreCase("server_no_context_takeover") && equals < 0){
+            flag = 1;
+            accepted.serverNoContextTakeover = true;
+        } else if(key.equalsIgnoreCase("client_no_context_takeover") && equals < 0){
+            flag = 2;
+            accepted.clientNoContextTakeover = true;
+        } else if(key.equalsIgnoreCase("server_max_window_bits") && bits){
+            flag = 4;
+            accepted.serverWindowBits = std::min(accepted.serverWindowBits, bits);
+        } else if(key.equalsIgnoreCase("client_max_window_bits") && (equals < 0 || bits)){
+            flag = 8;
+            clientBitsOffered = true;
+            clientBitsMax = equals < 0 ? 15 : bits;
+        } else {
+            return false;
+        }
+        if(seen & flag)
+            return false;
+        seen |= flag;
+    }
+    if(clientBitsOffered){
+        accepted.clientWindowBits = std::min(accepted.clientWindowBits, clientBitsMax);
+    } else {
+        // the client compresses with a 32 KB window, rather than keeping that much history it drops its context
+        if(accepted.clientWindowBits < 15)
+            accepted.clientNoContextTakeover = true;
+        accepted.clientWindowBits = 15;
+    }
+    response = F("permessage-deflate");
+    if(accepted.serverNoContextTakeover)
+        response += F("; server_no_context_takeover");
+    if(accepted.clientNoContextTakeover)
+        response += F("; client_no_context_takeover");
+    response += F("; server_max_window_bits=");
+    response += accepted.serverWindowBits;
+    if(clientBitsOffered){
+        response += F("; client_max_window_bits=");
+        response += accepted.clientWindowBits;
+    }
+    compression = accepted;
     return true;
 }
 
+void llc::SAWSocket::setCompression(const SAWSocketCompression & compression){
+    _compression = compression;
+    webSocketClampWindowBits(_compression);
+}
+
 void llc::SAWSocket::handleRequest(SAWServerRequest *request){
     if(!request->hasHeader(WS_STR_VERSION) || !request->hasHeader(WS_STR_KEY)){
         request->send(400);
@@ -1128,8 +1642,33 @@ void llc::SAWSocket::handleRequest(SAWServerRequest *request){
         request->send(response);
         return;
     }
+    if(_occupied == WS_ALL_SLOTS){
+        request->send(503);
+        return;
+    }
     AsyncWebHeader* key = request->getHeader(WS_STR_KEY);
-    SAWServerResponse *response = new llc::SAWSocketResponse(key->value(), this);
+    SAWSocketCompression compression;
+    String extensions;
+    if(_compression.enabled && request->hasHeader(WS_STR_EXTENSIONS)){
+        compression = _compression;
+        if(_compressionHandler)
+            _compressionHandler(request, compression);
+        // the handler may set anything, the deflater and _broadcast() rely on the bounds
+        webSocketClampWindowBits(compression);
+        const String & offers = request->getHeader(WS_STR_EXTENSIONS)->value();
+        bool accepted = false;
+        for(int start = 0; compression.enabled && !accepted && start < (int)offers.length();){
+            int end = offers.indexOf(',', start);
+            if(end < 0)
+                end = offers.length();
+            accepted = webSocketAcceptDeflate(offers.substring(start, end), compression, extensions);
+            start = end + 1;
+        }
+        compression.enabled = accepted;
+    }
+    SAWServerResponse *response = new llc::SAWSocketResponse(key->value(), this, compression);
+    if(compression.enabled)
+        response->addHeader(WS_STR_EXTENSIONS, extensions);
     if(request->hasHeader(WS_STR_PROTOCOL)){
         AsyncWebHeader* protocol = request->getHeader(WS_STR_PROTOCOL);
         //ToDo: check protocol
@@ -1171,17 +1710,14 @@ void llc::SAWSocket::_cleanBuffers()
     }
 }
 
-SAWSocket::SAWSocketClientLinkedList llc::SAWSocket::getClients() const {
-    return _clients;
-}
-
 /*
  * Response to Web Socket request - sends the authorization and detaches the TCP Client from the web server
  * Authentication code from https://github.com/Links2004/arduinoWebSockets/blob/master/src/WebSockets.cpp#L480
  */
 
-SAWSocketResponse::SAWSocketResponse(const String& key, llc::SAWSocket *server){
+SAWSocketResponse::SAWSocketResponse(const String& key, llc::SAWSocket *server, const SAWSocketCompression & compression){
     _server = server;
+    _compression = compression;
     _code = 101;
     _sendContentLength = false;
 
@@ -1237,7 +1773,7 @@ void llc::SAWSocketResponse::_respond(SAWServerRequest *request){
 size_t llc::SAWSocketResponse::_ack(SAWServerRequest *request, size_t len, uint32_t time){
     (void)time;
     if(len){
-        new llc::SAWSocketClient(request, _server);
+        new llc::SAWSocketClient(request, _server, _compression);
     }
     return 0;
 }
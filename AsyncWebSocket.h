@@ -2,6 +2,10 @@
 
 #include <ESPAsyncWebServer.h>
 #include "AsyncWebSynchronization.h"
+#include "WebBufferPool.h"
+#include "WebDeflate.h"
+#include "WebRingQueue.h"
+#include "WebSocketFrame.h"
 
 #ifdef LLC_ESP32
 #   include <AsyncTCP.h>
@@ -36,15 +40,40 @@
 #ifndef ASYNCWEBSOCKET_H_
 #define ASYNCWEBSOCKET_H_
 
+// permessage-deflate: shorter messages go out uncompressed
+#ifndef SAW_WS_DEFLATE_MIN_LENGTH
+#   define SAW_WS_DEFLATE_MIN_LENGTH 32
+#endif
+// Largest compressed message accepted and inflated, a client sending a larger one is closed with 1009
+#ifndef SAW_WS_INFLATE_MAX
+#   ifdef LLC_ESP32
+#       define SAW_WS_INFLATE_MAX 16384
+#   else
+#       define SAW_WS_INFLATE_MAX 4096
+#   endif
+#endif
+
 namespace llc
 {
 #ifdef LLC_ESP32
-    stxp uint8_t     SSE_MAX_QUEUED_MESSAGES     = 32;
-    stxp uint8_t     DEFAULT_MAX_SSE_CLIENTS     = 8;
+    stxp uint8_t     WS_MAX_QUEUED_MESSAGES      = 32;
+    stxp uint8_t     DEFAULT_MAX_WS_CLIENTS      = 8;
+    stxp uint8_t     WS_MAX_CLIENT_SLOTS         = 32;
+    stxp uint8_t     WS_MAX_TOPICS               = 16;
 #elif defined(LLC_ESP8266)
-    stxp uint8_t     SSE_MAX_QUEUED_MESSAGES     = 8;
-    stxp uint8_t     DEFAULT_MAX_SSE_CLIENTS     = 4;
+    stxp uint8_t     WS_MAX_QUEUED_MESSAGES      = 8;
+    stxp uint8_t     DEFAULT_MAX_WS_CLIENTS      = 4;
+    stxp uint8_t     WS_MAX_CLIENT_SLOTS         = 16;
+    stxp uint8_t     WS_MAX_TOPICS               = 8;
 #endif
+    // ping, pong and close frames waiting per client
+    stxp uint8_t     WS_MAX_QUEUED_CONTROLS      = 4;
+    // A client id is a 24 bit generation above the slot, so the id of a client that left never matches the next one in its slot
+    stxp uint8_t     WS_ID_SLOT_BITS             = 8;
+    stxp uint32_t    WS_ALL_SLOTS                = WS_MAX_CLIENT_SLOTS == 32 ? 0xFFFFFFFFUL : (1UL << WS_MAX_CLIENT_SLOTS) - 1;
+    // slot of a client that was turned away, the slot table was full
+    stxp uint8_t     WS_NO_SLOT                  = 0xFF;
+    static_assert(WS_MAX_CLIENT_SLOTS <= 32, "topic subscribers are a 32 bit set of client slots");
     class SAWSocket;
     class SAWSocketResponse;
     class SAWSocketClient;
@@ -61,9 +90,24 @@ namespace llc
         uint64_t  index           = {}; // Offset of the data inside the current frame. */
     };
 
+    // permessage-deflate (RFC 7692) parameters. The server's are the most it offers, negotiation may narrow them per client.
+    // Each side's compressor needs a window of 1 << windowBits bytes: ours takes 4 << serverWindowBits plus its hash heads
+    // (see SAW_DEFLATE_MEM_LEVEL) and the client's is kept as history, unless the side drops its context after each message.
+    struct SAWSocketCompression {
+        bool        enabled                 = {};
+        uint8_t     serverWindowBits        = SAW_DEFLATE_WINDOW_BITS;  // 9..14, our compressor
+        uint8_t     clientWindowBits        = SAW_DEFLATE_WINDOW_BITS;  // 8..15, history kept of the client's messages
+        bool        serverNoContextTakeover = {};   // no compressor kept per client, broadcasts are compressed once
+        bool        clientNoContextTakeover = {};   // no history kept per client
+    };
+
     typedef enum { WS_DISCONNECTED, WS_CONNECTED, WS_DISCONNECTING } AwsClientStatus;
     typedef enum { WS_CONTINUATION, WS_TEXT, WS_BINARY, WS_DISCONNECT = 0x08, WS_PING, WS_PONG } AwsFrameType;
     typedef enum { WS_MSG_SENDING, WS_MSG_SENT, WS_MSG_ERROR } AwsMessageStatus;
+    // What a client does with a message when its queue is full. Only messages nothing was written of yet are dropped or
+    // replaced. WS_CONFLATE replaces a queued message with the same key in place, full or not, and drops the oldest one
+    // when there is none.
+    typedef enum { WS_DROP_NEWEST, WS_DROP_OLDEST, WS_CONFLATE } AwsOverflowPolicy;
     typedef enum { WS_EVT_CONNECT, WS_EVT_DISCONNECT, WS_EVT_PONG, WS_EVT_ERROR, WS_EVT_DATA } AwsEventType;
 
     class SAWSocketMessageBuffer {
@@ -92,18 +136,39 @@ namespace llc
         friend              SAWSocket;
     };
 
+    // Several messages may be in flight: send() adds bytes to the client without pushing them and returns how many
+    // it added, header included. ack() then gets exactly those bytes back, in order, once the peer acknowledged them.
     class SAWSocketMessage {
     prtctd:
         uint8_t _opcode;
         bool _mask;
         AwsMessageStatus _status;
+        uint32_t _key = 0;
+        bool _pinned = false;
+        bool _hasOverflowPolicy = false;
+        AwsOverflowPolicy _overflowPolicy = WS_DROP_NEWEST;
     public:
         SAWSocketMessage():_opcode(WS_TEXT),_mask(false),_status(WS_MSG_ERROR){}
+        // Conflation key of a name, never 0
+        static uint32_t keyOf(const char * name);
+        // Overrides the client's policy for this message, WS_CONFLATE needs a key
+        void setOverflowPolicy(AwsOverflowPolicy policy, uint32_t key = 0){ _overflowPolicy = policy; _hasOverflowPolicy = true; _key = key; }
+        AwsOverflowPolicy overflowPolicy(AwsOverflowPolicy fallback) const { return _hasOverflowPolicy ? _overflowPolicy : fallback; }
+        uint32_t key() const { return _key; }
+        // Never dropped or replaced, e.g. it went through the client's compression context
+        void pin(){ _pinned = true; }
+        bool pinned() const { return _pinned; }
+        // Part of it was written, it can't be dropped or replaced any more
+        virtual bool started() const { return true; }
         virtual ~SAWSocketMessage(){}
         virtual void ack(size_t len __attribute__((unused)), uint32_t time __attribute__((unused))){}
         virtual size_t send(AsyncClient *client __attribute__((unused))){ return 0; }
+        // Written and acked completely, or failed
         virtual bool finished(){ return _status != WS_MSG_SENDING; }
+        // No frame is written halfway, a control frame may go out now
         virtual bool betweenFrames() const { return false; }
+        // Bytes are left to write
+        virtual bool readyToSend() const { return betweenFrames(); }
     };
 
     class SAWSocketBasicMessage : public SAWSocketMessage {
@@ -115,7 +180,10 @@ namespace llc
     public: virtual                   ~SAWSocketBasicMessage () override;
                                       SAWSocketBasicMessage  (const char * data, size_t len, uint8_t opcode=WS_TEXT, bool mask=false);
                                       SAWSocketBasicMessage  (uint8_t opcode=WS_TEXT, bool mask=false);
-        virtual bool                  betweenFrames               ()                          const override { return _acked == _ack; }
+        // frames are added whole
+        virtual bool                  betweenFrames               ()                          const override { return true; }
+        virtual bool                  started                     ()                          const override { return _ack != 0; }
+        virtual bool                  readyToSend                 ()                          const override { return _status == WS_MSG_SENDING && (_sent < _len || !_ack); }
         virtual void                  ack                         (size_t len, uint32_t time)       override;
         virtual size_t                send                        (AsyncClient *client)             override;
     };
@@ -130,48 +198,114 @@ namespace llc
     public: virtual                   ~SAWSocketMultiMessage () override;
                                       SAWSocketMultiMessage  (SAWSocketMessageBuffer * buffer, uint8_t opcode=WS_TEXT, bool mask=false);
 
-        virtual bool                  betweenFrames               () const override { return _acked == _ack; }
+        virtual bool                  betweenFrames               () const override { return true; }
+        virtual bool                  started                     () const override { return _ack != 0; }
+        virtual bool                  readyToSend                 () const override { return _status == WS_MSG_SENDING && (_sent < _len || !_ack); }
         virtual void                  ack                         (size_t len, uint32_t time) override ;
         virtual size_t                send                        (AsyncClient *client) override ;
     };
 
+    // One encoded frame, header and payload, that every client of a broadcast sends from (see SAWSocket::textAll).
+    // It goes out in whatever pieces the send window allows and is never split into several frames, so control
+    // frames wait until it was sent completely. The frame is freed once the last client acked it or went away.
+    class SAWSocketSharedMessage: public SAWSocketMessage {
+        SAWSharedBuffer               * _frame                    = {};
+        size_t                        _sent                       = {};
+        size_t                        _acked                      = {};
+    public: virtual                   ~SAWSocketSharedMessage() override;
+        // Takes a new reference of frame
+                                      SAWSocketSharedMessage (SAWSharedBuffer * frame);
+        // Final, unmasked server frame, RSV1 set for a compressed payload. NULL when out of memory, the caller owns the
+        // first reference.
+        static SAWSharedBuffer *      encode                      (uint8_t opcode, const uint8_t * data, size_t len, bool compressed = false);
+
+        virtual bool                  betweenFrames               () const override { return _sent == 0 || _sent == _frame->length(); }
+        virtual bool                  started                     () const override { return _sent != 0; }
+        virtual bool                  readyToSend                 () const override { return _sent < _frame->length(); }
+        virtual void                  ack                         (size_t len, uint32_t time) override;
+        virtual size_t                send                        (AsyncClient *client) override;
+    };
+
     class SAWSocketClient {
+        friend class                  SAWFrameDecoder;
         typedef SAWSocketControl TAWSControl;
         typedef SAWSocketMessage TAWSMessage;
+        // Bytes written and not acked yet, control frame or message, in the order they went out
+        struct InFlight {
+            TAWSControl               * control;
+            TAWSMessage               * message;
+            size_t                    len;
+        };
         AsyncClient                   * _client             = {};
         SAWSocket                * _server             = {};
-        uint32_t                      _clientId             = {};
+        uint32_t                      _clientId             = {};   // 0 when turned away
         AwsClientStatus               _status               = {};
-        LinkedList<TAWSControl*>      _controlQueue         ;
-        LinkedList<TAWSMessage*>      _messageQueue         ;
-        uint8_t                       _pstate               = {};
+        SAWRingQueue<TAWSControl*, WS_MAX_QUEUED_CONTROLS>  _controlQueue;   // written ones stay until acked
+        SAWRingQueue<TAWSMessage*, WS_MAX_QUEUED_MESSAGES>  _messageQueue;
+        // one entry per control frame and at most one more per message and per control frame written between its frames
+        SAWRingQueue<InFlight, 2 * WS_MAX_QUEUED_CONTROLS + WS_MAX_QUEUED_MESSAGES + 1> _inFlight;
+        SAWFrameDecoder               _decoder;                     // frame headers, collected across segments
+        bool                          _inputFailed          = {};   // protocol error, the rest of the input is dropped
+        uint8_t                       _control  [126]       = {};   // control frame payload and a terminator
+        uint8_t                       * _textCopy           = {};   // see SAWSocket::setTextCopy()
+        size_t                        _textCopyCapacity     = {};
         SAWSocketFrameInfo                  _pinfo                = {};
         uint32_t                      _lastMessageTime      = {};
         uint32_t                      _keepAlivePeriod      = {};
+        AwsOverflowPolicy             _overflowPolicy       = {};
+        SAWSocketCompression          _compression          = {};   // as negotiated, not enabled without the extension
+        SAWDeflate                    * _deflate            = {};   // created on first use, with server context takeover only
+        SAWInflate                    * _inflate            = {};   // created on the first compressed message
+        uint8_t                       * _assembly           = {};   // message being reassembled, from the server's pool
+        size_t                        _assemblyLen          = {};
+        size_t                        _assemblyCapacity     = {};
+        uint8_t                       _assembleOpcode       = {};   // WS_TEXT or WS_BINARY while a message is reassembled
+        bool                          _assembleCompressed   = {};   // it is inflated once complete
+        bool                          _assembleFailed       = {};   // the rest of the message is dropped, the connection is closing
+        bool                          _closeOnPoll          = {};   // set by _dropConnection()
 
         void                          _queueControl         (TAWSControl * controlMessage);
         void                          _queueMessage         (TAWSMessage * dataMessage);
         void                          _runQueue             ();
+        void                          _written              (TAWSControl * control, TAWSMessage * message, size_t len);
+        // Aborts from the next ack or poll: closing while a send is on the stack could free this client under it
+        void                          _dropConnection       ();
+        // SAWFrameDecoder handler: a frame starts, a piece of its payload arrived. False once the input failed.
+        bool                          _frameHeader          (const SAWFrameHeader & header);
+        bool                          _framePayload         (uint8_t * data, size_t len, bool last);
+        void                          _handleControl        ();
+        void                          _handleData           (const uint8_t * data, size_t len);
+        // Makes room for the frame _pinfo starts, closes with 1009 when the message gets too large
+        void                          _reserveAssembly      ();
+        void                          _releaseAssembly      ();
+        void                          _failAssembly         (uint16_t code);
+        void                          _inflateMessage       (uint8_t opcode);
+        void                          _deliverMessage       (uint8_t opcode);
 
     public: void                      * _tempObject         = {};
 
                                       ~SAWSocketClient ();
-                                      SAWSocketClient  (SAWServerRequest *request, SAWSocket *server);
-        //client id increments for the given server
+                                      SAWSocketClient  (SAWServerRequest *request, SAWSocket *server, const SAWSocketCompression & compression = SAWSocketCompression());
+        //client id, its low WS_ID_SLOT_BITS are the slot in the server's table
         uint32_t                      id                    ()  const   { return _clientId; }
+        uint8_t                       slot                  ()  const   { return _clientId ? uint8_t(_clientId & ((1UL << WS_ID_SLOT_BITS) - 1)) : WS_NO_SLOT; }
         AwsClientStatus               status                ()          { return _status; }
         AsyncClient*                  client                ()          { return _client; }
         SAWSocket*               server                ()          { return _server; }
         SAWSocketFrameInfo const &          pinfo                 ()  const   { return _pinfo; }
         IPAddress                     remoteIP              ();
         uint16_t                      remotePort            ();
+        const SAWSocketCompression &  compression           ()  const   { return _compression; }
         //control frames
         void                          close                 (uint16_t code = 0, const char * message = 0);
         void                          ping                  (uint8_t * data = 0, size_t len = 0);
         //set auto-ping period in seconds. disabled if zero (default)
         inline  void                  keepAlivePeriod       (uint16_t seconds)  { _keepAlivePeriod = seconds * 1000; }
         inline  uint16_t              keepAlivePeriod       ()    const         { return (uint16_t)(_keepAlivePeriod / 1000); }
-        inline  bool                  canSend               ()    const         { return _messageQueue.length() < WS_MAX_QUEUED_MESSAGES; }
+        inline  bool                  canSend               ()    const         { return !_messageQueue.full(); }
+        // What happens to messages queued while the queue is full, starts as the server's
+        inline  void                  setOverflowPolicy     (AwsOverflowPolicy policy)  { _overflowPolicy = policy; }
+        inline  AwsOverflowPolicy     overflowPolicy        ()    const         { return _overflowPolicy; }
         //data packets
         void                          message               (SAWSocketMessage *message){ _queueMessage(message); }
         bool                          queueIsFull           ();
@@ -193,7 +327,12 @@ namespace llc
         void                          binary                (char * message);
         void                          binary                (const String &message);
         void                          binary                (SAWSocketMessageBuffer *buffer);
+        // State updates: replaces a queued message with the same key that has not started going out
+        void                          conflate              (const char * key, const char * message, size_t len, AwsFrameType type = WS_TEXT);
+        void                          conflate              (const char * key, const String & message, AwsFrameType type = WS_TEXT);
         //system callbacks (do not call)
+        // Queues data as one compressed message, false when it should go out uncompressed or the queue is full
+        bool                          _sendCompressed       (uint8_t opcode, const uint8_t * data, size_t len);
         void                          _onAck                (size_t len, uint32_t time);
         void                          _onError              (int8_t);
         void                          _onPoll               ();
@@ -203,19 +342,59 @@ namespace llc
     };
 
     typedef std::function<void(SAWSocket * server, SAWSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len)> AwsEventHandler;
+    // Adjusts the compression parameters for one connecting client before they are negotiated, enabled = false declines
+    typedef std::function<void(SAWServerRequest * request, SAWSocketCompression & compression)> AwsCompressionHandler;
 
     //WebServer Handler implementation that plays the role of a socket server
     class SAWSocket : public AsyncWebHandler {
     public:
         typedef SAWSocketClient  TAWSClient;
-        typedef LinkedList<TAWSClient*> TAWSClientList;
+        typedef TAWSClient * TAWSClientSlots[WS_MAX_CLIENT_SLOTS];
+        // The clients of the slot table in slot order, free slots skipped: iterates like the list it replaces
+        class TAWSClientRange {
+            const TAWSClientSlots & _slots;
+        public:
+            class Iterator {
+                const TAWSClientSlots * _slots;
+                size_t _slot;
+                void _skipFree() { while(_slot < WS_MAX_CLIENT_SLOTS && (*_slots)[_slot] == NULL) ++_slot; }
+            public:
+                Iterator(const TAWSClientSlots * slots, size_t slot) : _slots(slots), _slot(slot) { _skipFree(); }
+                TAWSClient * operator*() const { return (*_slots)[_slot]; }
+                Iterator & operator++() { ++_slot; _skipFree(); return *this; }
+                bool operator!=(const Iterator & other) const { return _slot != other._slot; }
+            };
+            explicit TAWSClientRange(const TAWSClientSlots & slots) : _slots(slots) {}
+            Iterator begin() const { return Iterator(&_slots, 0); }
+            Iterator end() const { return Iterator(&_slots, WS_MAX_CLIENT_SLOTS); }
+            bool isEmpty() const { return !(begin() != end()); }
+            size_t length() const { size_t n = 0; for(Iterator i = begin(); i != end(); ++i) ++n; return n; }
+        };
     privte:
         String _url;
-        TAWSClientList        _clients;
-        uint32_t _cNextId;
+        TAWSClientSlots _slots = {};
+        uint32_t _occupied = 0;     // bit per slot in use
+        uint32_t _generation = 0;   // of the latest id handed out
         AwsEventHandler _eventHandler;
         bool _enabled;
         AsyncWebLock _lock;
+        SAWSocketCompression _compression;
+        AwsCompressionHandler _compressionHandler;
+        AwsOverflowPolicy _overflowPolicy = WS_DROP_NEWEST;
+        size_t _textCopy = 0;
+        size_t _wholeMessages = 0;
+        SAWBufferPool _messagePool; // one block per class, freed when the last client leaves
+        // A topic is free while nobody subscribes to it
+        struct Topic {
+            String name;
+            uint32_t subscribers = 0;   // bit per client slot
+        };
+        Topic _topics[WS_MAX_TOPICS];
+        Topic * _topic(const String & name);
+        // Encodes the frame once and queues it to every connected client, or only to the ones in the slots set, compressed
+        // ones once per window size for clients without server context takeover and per client for the others. A keyed
+        // one conflates (WS_CONFLATE).
+        void _broadcast(uint8_t opcode, const uint8_t * data, size_t len, uint32_t key = 0, const uint32_t * slots = NULL);
 
     public:
         SAWSocket(const String& url);
@@ -263,9 +442,22 @@ namespace llc
         void binaryAll(const String &message);
         void binaryAll(SAWSocketMessageBuffer * buffer);
 
+        // Broadcast of a state update, see SAWSocketClient::conflate()
+        void conflateAll(const char * key, const char * message, size_t len, AwsFrameType type = WS_TEXT);
+        void conflateAll(const char * key, const String &message, AwsFrameType type = WS_TEXT);
+
         void message(uint32_t id, SAWSocketMessage *message);
         void messageAll(SAWSocketMultiMessage *message);
 
+        // Topics: publish() encodes the message once and queues it to the subscribed clients. Subscriptions end with
+        // the connection. subscribe() fails for an unknown client or when all WS_MAX_TOPICS are in use.
+        bool subscribe(uint32_t id, const String & topic);
+        void unsubscribe(uint32_t id, const String & topic);
+        bool subscribed(uint32_t id, const String & topic);
+        size_t subscribers(const String & topic);
+        void publish(const String & topic, const char * message, size_t len, AwsFrameType type = WS_TEXT);
+        void publish(const String & topic, const String & message, AwsFrameType type = WS_TEXT);
+
         size_t printf(uint32_t id, const char *format, ...)  __attribute__ ((format (printf, 3, 4)));
         size_t printfAll(const char *format, ...)  __attribute__ ((format (printf, 2, 3)));
 #ifndef LLC_ESP32
@@ -277,9 +469,26 @@ namespace llc
 #endif
         size_t printfAll_P(PGM_P formatP, ...)  __attribute__ ((format (printf, 2, 3)));
         void onEvent(AwsEventHandler handler){ _eventHandler = handler; }
+        // Offers permessage-deflate to clients asking for it, see SAWSocketCompression
+        void setCompression(const SAWSocketCompression & compression);
+        const SAWSocketCompression & compression() const { return _compression; }
+        void onCompression(AwsCompressionHandler handler){ _compressionHandler = handler; }
+        // Text data events are spans of the received segment that must not be written to, not even data[len]. Pieces of
+        // up to maxLen bytes are handed over as a NUL terminated copy instead, 0 (default) for none.
+        void setTextCopy(size_t maxLen){ _textCopy = maxLen; }
+        size_t textCopy() const { return _textCopy; }
+        // Hands out text and binary messages only once complete, as a single final WS_EVT_DATA with a NUL after the
+        // data. A frame that would take a message over maxLen bytes closes the connection with 1009 before it is buffered.
+        // 0 (default) hands out frames as they arrive.
+        void setWholeMessages(size_t maxLen){ _wholeMessages = maxLen; }
+        size_t wholeMessages() const { return _wholeMessages; }
+        // Policy new clients start with, WS_DROP_NEWEST by default
+        void setOverflowPolicy(AwsOverflowPolicy policy){ _overflowPolicy = policy; }
+        AwsOverflowPolicy overflowPolicy() const { return _overflowPolicy; }
         //system callbacks (do not call)
-        uint32_t _getNextId(){ return _cNextId++; }
-        void _addClient(SAWSocketClient * client);
+        SAWBufferPool & _messageBuffers(){ return _messagePool; }
+        // Returns the client's id, 0 when all slots are taken
+        uint32_t _addClient(SAWSocketClient * client);
         void _handleDisconnect(SAWSocketClient * client);
         void _handleEvent(SAWSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len);
         virtual bool canHandle(SAWServerRequest *request) override final;
@@ -292,7 +501,10 @@ namespace llc
         LinkedList<SAWSocketMessageBuffer *> _buffers;
         void _cleanBuffers();
 
-        SAWSocketClientLinkedList getClients() const;
+        // Every client, closing ones included
+        TAWSClientRange getClients() const { return TAWSClientRange(_slots); }
+        // The same as a table indexed by slot, NULL where free
+        const TAWSClientSlots & getClientSlots() const { return _slots; }
     };
 
     //WebServer response to authenticate the socket and detach the tcp client from the web server request
@@ -300,8 +512,9 @@ namespace llc
     privte:
         String _content;
         SAWSocket *_server;
+        SAWSocketCompression _compression;
     public:
-        SAWSocketResponse(const String& key, SAWSocket *server);
+        SAWSocketResponse(const String& key, SAWSocket *server, const SAWSocketCompression & compression = SAWSocketCompression());
         void _respond(SAWServerRequest *request);
         size_t _ack(SAWServerRequest *request, size_t len, uint32_t time);
         bool _sourceValid() const { return true; }
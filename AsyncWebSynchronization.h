@@ -13,6 +13,7 @@ namespace llc
     struct AsyncWebLock {
         inline  bool        lock                ()      { return false; }
         inline  void        unlock              ()      {}
+        inline  bool        tryLock             (bool & locked)     { locked = false; return true; }
     };
     struct AsyncWebLockGuard { AsyncWebLockGuard(const AsyncWebLock &){} };
 #elif defined(LLC_ESP32)
@@ -31,6 +32,18 @@ namespace llc
             _lockedBy   = pxCurrentTCB;
             return true;
         }
+        // lock() without waiting: false while another task holds it, locked tells whether to unlock() afterwards
+        bool                tryLock             (bool & locked)     {
+            extern void         * pxCurrentTCB;
+            locked      = false;
+            if(_lockedBy == pxCurrentTCB)
+                return true;
+            if(xQueueSemaphoreTake(_lock, 0) != pdTRUE)
+                return false;
+            _lockedBy   = pxCurrentTCB;
+            locked      = true;
+            return true;
+        }
     };
     class AsyncWebLockGuard {
     prtctd: AsyncWebLock    * const _lock       = 0;
@@ -39,6 +39,21 @@
 #   error Platform not supported
 #endif
 
+#include "AsyncWebSynchronization.h"
+#include "WebDeferred.h"
+
+// Coroutine handlers, see AsyncWebCoroutine.h. Needs -std=c++20 (gcc 11 or later); define as 0 to leave them out.
+#ifndef ASYNCWEBSERVER_COROUTINES
+#   if defined(__cpp_impl_coroutine) && defined(__has_include)
+#       if __has_include(<coroutine>)
+#           define ASYNCWEBSERVER_COROUTINES 1
+#       endif
+#   endif
+#endif
+#ifndef ASYNCWEBSERVER_COROUTINES
+#   define ASYNCWEBSERVER_COROUTINES 0
+#endif
+
 #ifdef ASYNCWEBSERVER_REGEX
 #   define ASYNCWEBSERVER_REGEX_ATTRIBUTE
 #else
@@ -57,6 +72,13 @@ class AsyncWebHandler;
 class AsyncStaticWebHandler;
 class AsyncCallbackWebHandler;
 class AsyncResponseStream;
+namespace llc { struct SAWEmbeddedAsset; class AsyncEmbeddedWebHandler; class SAWSharedBuffer; class AsyncCompositeResponse; class SAWCachePolicy; class SAWResponseCache; class SAWSharedBody; class SAWSingleFlight; class SAWCoroutineContext; }
+#if ASYNCWEBSERVER_COROUTINES
+namespace llc {
+  template<typename T> class SAWTask;
+  typedef std::function<SAWTask<SAWServerResponse *>(SAWServerRequest & request)> SAWCoroutineHandler;
+}
+#endif
 
 #ifndef WEBSERVER_H
 typedef enum {
@@ -75,6 +97,12 @@ typedef enum {
 #define RESPONSE_TRY_AGAIN 0xFFFFFFFF
 
 typedef uint8_t WebRequestMethodComposite;
+
+// Content codings a client listed in Accept-Encoding, see SAWServerRequest::acceptedEncodings()
+typedef enum {
+  ENCODING_GZIP     = 0b00000001,
+  ENCODING_DEFLATE  = 0b00000010,
+} ContentEncoding;
 typedef std::function<void(void)> ArDisconnectHandler;
 
 /*
@@ -131,16 +159,22 @@ typedef enum { RCT_NOT_USED = -1, RCT_DEFAULT = 0, RCT_HTTP, RCT_WS, RCT_EVENT,
 
 typedef std::function<size_t(uint8_t*, size_t, size_t)> AwsResponseFiller;
 typedef std::function<String(const String&)> AwsTemplateProcessor;
+// Prints the value of a placeholder straight into the response
+typedef std::function<void(const String&, Print&)> AwsTemplatePrinter;
 
 class SAWServerRequest {
     using                           File                            = fs::File;
     using                           FS                              = fs::FS;
     friend class                    SAWServer;
     friend class                    AsyncCallbackWebHandler;
+    friend class                    llc::SAWResponseCache;
+    friend class                    llc::SAWSingleFlight;
+    friend class                    llc::SAWCoroutineContext;
     AsyncClient                     * _client                       = {};
     SAWServer                  * _server                       = {};
     AsyncWebHandler                 * _handler                      = {};
     SAWServerResponse          * _response                     = {};
+    bool                            _cannedSent                     = {};   // _sendCanned() wrote the whole response, _response stays NULL
     LinkedList<AsyncWebHeader*>     _headers;
     LinkedList<AsyncWebParameter*>  _params;
     LinkedList<String*>             _pathParams;
@@ -161,6 +195,7 @@ class SAWServerRequest {
     bool                            _isMultipart                    = {};
     bool                            _isPlainPost                    = {};
     bool                            _expectingContinue              = {};
+    uint8_t                         _acceptedEncodings              = {};   // parsed before uninteresting headers are dropped
     size_t                          _contentLength                  = {};
     size_t                          _parsedLength                   = {};
     uint8_t                         _multiParseState                = {};
@@ -174,8 +209,18 @@ class SAWServerRequest {
     bool                            _itemIsFile                     = {};
     size_t                          _itemSize                       = {};
     uint8_t                         * _itemBuffer                   = {};
+    bool                            _acking                         = {};   // a response _ack of this request is on the stack
+    std::atomic<bool>               _dataReady                      = {};   // notifyDataReady() arrived during it, or while another callback ran
+    bool                            * _deleted                      = {};   // set by the destructor, see _callResponse()
+    llc::SAWDeferredRequest         * _deferred                     = {};
+    const llc::SAWCachePolicy       * _cachePolicy                  = {};   // the response sent is stored under _cacheKey
+    String                          _cacheKey                       = {};
+    llc::SAWSharedBody              * _flight                       = {};   // identical requests wait for the response sent
 
     void                            _removeNotInterestingHeaders    ();
+    // A response may close the connection, whose disconnect deletes this request: false when that happened
+    bool                            _callResponse                   (bool respond, size_t len, uint32_t time);
+    bool                            _ackResponse                    (size_t len, uint32_t time);
     void                            _onPoll                         ();
     void                            _onAck                          (size_t len, uint32_t time);
     void                            _onError                        (int8_t error);
@@ -193,6 +238,8 @@ class SAWServerRequest {
     void                            _handleUploadStart              ();
     void                            _handleUploadByte               (uint8_t data, bool last);
     void                            _handleUploadEnd                ();
+    bool                            _sendCanned                     (int code);
+    inline  bool                    _responded                      () const { return _response != NULL || _cannedSent; }
 
 public:
     void                            * _tempObject                   = {};
@@ -209,11 +256,19 @@ public:
     const String& contentType() const { return _contentType; }
     size_t contentLength() const { return _contentLength; }
     bool multipart() const { return _isMultipart; }
+    uint8_t acceptedEncodings() const { return _acceptedEncodings; }   // ContentEncoding bits
     const char * methodToString() const;
     const char * requestedConnTypeToString() const;
     RequestedConnectionType requestedConnType() const { return _reqconntype; }
     bool isExpectedRequestedConnType(RequestedConnectionType erct1, RequestedConnectionType erct2 = RCT_NOT_USED, RequestedConnectionType erct3 = RCT_NOT_USED);
     void onDisconnect (ArDisconnectHandler fn);
+    // A filler that returned RESPONSE_TRY_AGAIN has data again: the response is continued right away instead of on the
+    // next ack or poll. Callable from any task while the request is alive, see onDisconnect(). It never waits for the
+    // network task: when that is busy in another callback, the response continues on this request's next ack or poll.
+    void notifyDataReady();
+    // Keeps the request open after the handler returns, to be completed from any task through the returned handle.
+    // NULL once a response was sent.
+    llc::SAWDeferredRequest * defer();
 
     //hash is the string representation of:
     // base64(user:pass) for basic or
@@ -236,6 +291,8 @@ public:
     void sendChunked(const String& contentType, AwsResponseFiller callback, AwsTemplateProcessor templateCallback=nullptr);
     void send_P(int code, const String& contentType, const uint8_t * content, size_t len, AwsTemplateProcessor callback=nullptr);
     void send_P(int code, const String& contentType, PGM_P content, AwsTemplateProcessor callback=nullptr);
+    void sendTemplate(FS &fs, const String& path, AwsTemplatePrinter printer, const String& contentType=String());
+    void sendTemplate_P(int code, const String& contentType, PGM_P content, AwsTemplatePrinter printer);
 
     SAWServerResponse *beginResponse(int code, const String& contentType=String(), const String& content=String());
     SAWServerResponse *beginResponse(FS &fs, const String& path, const String& contentType=String(), bool download=false, AwsTemplateProcessor callback=nullptr);
@@ -244,8 +301,12 @@ public:
     SAWServerResponse *beginResponse(const String& contentType, size_t len, AwsResponseFiller callback, AwsTemplateProcessor templateCallback=nullptr);
     SAWServerResponse *beginChunkedResponse(const String& contentType, AwsResponseFiller callback, AwsTemplateProcessor templateCallback=nullptr);
     AsyncResponseStream *beginResponseStream(const String& contentType, size_t bufferSize=1460);
+    llc::AsyncCompositeResponse *beginCompositeResponse(int code, const String& contentType);
     SAWServerResponse *beginResponse_P(int code, const String& contentType, const uint8_t * content, size_t len, AwsTemplateProcessor callback=nullptr);
     SAWServerResponse *beginResponse_P(int code, const String& contentType, PGM_P content, AwsTemplateProcessor callback=nullptr);
+    SAWServerResponse *beginResponse(int code, const String& contentType, llc::SAWSharedBuffer * content); // takes over one reference, sent without copying
+    SAWServerResponse *beginTemplateResponse(FS &fs, const String& path, AwsTemplatePrinter printer, const String& contentType=String());
+    SAWServerResponse *beginTemplateResponse_P(int code, const String& contentType, PGM_P content, AwsTemplatePrinter printer);
 
     size_t headers() const;                     // get header count
     bool hasHeader(const String& name) const;   // check if header exists
@@ -341,8 +402,12 @@ typedef enum {
 } WebResponseState;
 
 class SAWServerResponse {
+    friend class                  SAWServerRequest;
+    friend class                  llc::SAWResponseCache;
+    friend class                  llc::SAWSingleFlight;
 prtctd:
     LinkedList<AsyncWebHeader*>   _headers;
+    SAWServerRequest              * _request              = {};   // set by SAWServerRequest::send()
     int                           _code                   = {};
     String                        _contentType            = {};
     size_t                        _contentLength          = {};
@@ -353,19 +418,34 @@ prtctd:
     size_t                        _ackedLength            = {};
     size_t                        _writtenLength          = {};
     WebResponseState              _state                  = {};
+    bool                          _borrowedRam            = {};   // RAM owned by the response was handed to lwIP without copying
+    int8_t                        _compress               = -1;   // setCompression(), -1 leaves it to the kind of body
 
     const char*                   _responseCodeToString   (int code);
 public: virtual                   ~SAWServerResponse ();
                                   SAWServerResponse  ();
+    // Complete HTTP/1.1 response without body for 400, 401, 404, 413, 431, 500, 501 and 503, NULL for other codes
+    static const char*            cannedResponse          (int code, size_t & len);
     virtual void                  setCode                 (int code);
     virtual void                  setContentLength        (size_t len);
     virtual void                  setContentType          (const String& type);
     virtual void                  addHeader               (const String& name, const String& value);
+    // Dynamic, chunked and template bodies of text types are gzipped on the fly when the client accepts it, static
+    // files and PROGMEM only when enabled here
+    inline  void                  setCompression          (bool enable)   { if(_state == RESPONSE_SETUP) _compress = enable; }
+    // Same as request->notifyDataReady(), does nothing before send()
+    void                          resume                  ();
     virtual String                _assembleHead           (uint8_t version);
     virtual bool                  _started                () const;
     virtual bool                  _finished               () const;
     virtual bool                  _failed                 () const;
     virtual bool                  _sourceValid            () const;
+    // The whole body as a new reference when it is known before sending, for SAWResponseCache
+    virtual llc::SAWSharedBuffer* _snapshot               ()        { return NULL; }
+    // Copies the body into shared while it is sent, for SAWSingleFlight. False when the response can't.
+    virtual bool                  _teeInto                (llc::SAWSharedBody * /*shared*/)   { return false; }
+    // lwIP still references memory of this response, tearing the connection down must abort it instead of closing gracefully
+    inline  bool                  _borrowsMemory          () const  { return _borrowedRam && _ackedLength < _writtenLength; }
     virtual void                  _respond                (SAWServerRequest *request);
     virtual size_t                _ack                    (SAWServerRequest *request, size_t len, uint32_t time);
 };
@@ -379,8 +459,13 @@ typedef std::function<void(SAWServerRequest * request, const String & filename,
 typedef std::function<void(SAWServerRequest * request, uint8_t * data, size_t len, size_t index, size_t total)>                          ArBodyHandlerFunction;    // handle posts with plain body content (JSON often transmitted this way as a request)
 
 class SAWServer {
+    friend class                  SAWServerRequest;
+    friend class                  SAWRequestLockGuard;
+    friend class                  llc::SAWDeferredRequest;
 prtctd:
     AsyncServer                   _server;
+    llc::AsyncWebLock             _requestLock;   // held by the request callbacks, so other tasks can continue responses safely
+    llc::SAWCompletionQueue       _completions;   // deferred requests completed by other tasks
     LinkedList<AsyncWebRewrite*>  _rewrites;
     LinkedList<AsyncWebHandler*>  _handlers;
     AsyncCallbackWebHandler*      _catchAllHandler;
@@ -392,9 +477,21 @@ public:
     AsyncCallbackWebHandler&      on                    (const char * uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest);
     AsyncCallbackWebHandler&      on                    (const char * uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload);
     AsyncCallbackWebHandler&      on                    (const char * uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody);
+#if ASYNCWEBSERVER_COROUTINES
+    // The handler is a coroutine running on the network task, it co_returns the response. See AsyncWebCoroutine.h.
+    AsyncCallbackWebHandler&      onAsync               (const char * uri, llc::SAWCoroutineHandler handler);
+    AsyncCallbackWebHandler&      onAsync               (const char * uri, WebRequestMethodComposite method, llc::SAWCoroutineHandler handler);
+#endif
     AsyncStaticWebHandler&        serveStatic           (const char* uri, fs::FS& fs, const char* path, const char* cache_control = NULL);
+    llc::AsyncEmbeddedWebHandler& serveEmbedded         (const char* uri, const llc::SAWEmbeddedAsset * assets, size_t count, const char* cache_control = NULL);
     void                          reset                 (); //remove all writers and handlers, with onNotFound/onFileUpload/onRequestBody
     void                          _attachHandler        (SAWServerRequest * request);
+    // Queues a deferred request that was sent or posted to and runs everything queued so far, unless the request lock is taken
+    void                          _completeDeferred     (llc::SAWDeferredRequest * deferred);
+    // Request lock held: runs the calls posted and sends the responses completed so far
+    void                          _drainCompleted       ();
+    // Releases the request lock taken by this task, running what other tasks completed while it was held
+    void                          _unlockRequests       ();
 #if ASYNC_TCP_SSL_ENABLED
     void                          onSslFileRequest      (AcSSlFileHandler cb, void* arg){ _server.onSslFileRequest(cb, arg); }
     void                          beginSecure           (const char *cert, const char *key, const char *password){ _server.beginSecure(cert, key, password); }
@@ -410,18 +507,39 @@ public:
     inline  bool                  removeHandler         (AsyncWebHandler * handler)           { return _handlers.remove(handler); }
     inline  void                  begin                 ()                                    { _server.setNoDelay(true); _server.begin(); }
     inline  void                  end                   ()                                    { _server.end(); }
+    // Drops the cached responses of a route set up with setCache()
+    void                          invalidate            (const String & route);
     inline  void                  _handleDisconnect     (SAWServerRequest * request)     { delete request; }
     inline  void                  _rewriteRequest       (SAWServerRequest * request)     { for(const auto & r: _rewrites){ if(r->match(request)) { request->_url = r->toUrl(); request->_addGetParams(r->params()); } } }
 
 };
 
+// The request lock as the network callbacks take it. Completions other tasks pushed meanwhile run when it is released,
+// right after the callback rather than on the next poll.
+class SAWRequestLockGuard {
+    SAWServer                     * const _server;
+    const bool                    _locked;
+public:                           ~SAWRequestLockGuard  ()                                    { if(_locked) _server->_unlockRequests(); }
+                                  SAWRequestLockGuard   (SAWServer * server)                  : _server{server}, _locked{server->_requestLock.lock()} {}
+};
+
 class DefaultHeaders {
   using               headers_t       = LinkedList<AsyncWebHeader *>;
   headers_t           _headers;
+  String              _serialized     = {};   // "Name: value\r\n" lines, appended verbatim by _assembleHead
                       DefaultHeaders  () : _headers(headers_t([](AsyncWebHeader *h){ delete h; })){}
 public:
   using ConstIterator = headers_t::ConstIterator;
-  void addHeader(const String& name, const String& value){ _headers.add(new AsyncWebHeader(name, value)); }
+  void addHeader(const String& name, const String& value){
+    _headers.add(new AsyncWebHeader(name, value));
+    _serialized.reserve(_serialized.length() + name.length() + value.length() + 4);
+    _serialized += name;
+    _serialized += ": ";
+    _serialized += value;
+    _serialized += "\r\n";
+  }
+  const String& serialized() const { return _serialized; }
+  bool isEmpty() const { return _headers.isEmpty(); }
   ConstIterator begin() const { return _headers.begin(); }
   ConstIterator end() const { return _headers.end(); }
 
@@ -437,5 +555,6 @@ public:
 #include "WebHandlerImpl.h"
 #include "AsyncWebSocket.h"
 #include "AsyncEventSource.h"
+#include "AsyncWebCoroutine.h"
 
 #endif /* _SAWServer_H_ */
@@ -497,6 +497,7 @@ void SPIFFSEditor::handleRequest(SAWServerRequest *request){
   } else if(request->method() == HTTP_DELETE){
     if(request->hasParam("path", true)){
         _fs.remove(request->getParam("path", true)->value());
+        llc::SAWTemplateCache::Instance().invalidate(request->getParam("path", true)->value());
       request->send(200, "", "DELETE: "+request->getParam("path", true)->value());
     } else
       request->send(404);
@@ -539,6 +540,7 @@ void SPIFFSEditor::handleUpload(SAWServerRequest *request, const String& filenam
     }
     if(final){
       request->_tempFile.close();
+      llc::SAWTemplateCache::Instance().invalidate(filename);
     }
   }
 }
@@ -0,0 +1,75 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebBufferPool.h"
+
+constexpr size_t llc::SAWBufferPool::CLASS_SIZES[];
+
+llc::SAWBufferPool::~SAWBufferPool(){
+  trim();
+}
+
+uint8_t * llc::SAWBufferPool::acquire(size_t minSize, size_t & capacity){
+  const size_t c = _classOf(minSize);
+  if(c == CLASS_COUNT){
+    capacity = minSize;
+    return (uint8_t *)malloc(minSize);
+  }
+  capacity = CLASS_SIZES[c];
+  {
+    AsyncWebLockGuard l(_lock);
+    FreeBlock * block = _free[c];
+    if(block){
+      _free[c] = block->next;
+      --_kept[c];
+      return (uint8_t *)block;
+    }
+  }
+  return (uint8_t *)malloc(capacity);
+}
+
+void llc::SAWBufferPool::release(uint8_t * block, size_t capacity){
+  if(!block)
+    return;
+  const size_t c = _classOf(capacity);
+  if(c < CLASS_COUNT && CLASS_SIZES[c] == capacity){
+    AsyncWebLockGuard l(_lock);
+    if(_kept[c] < _keep){
+      FreeBlock * freeBlock = (FreeBlock *)block;
+      freeBlock->next = _free[c];
+      _free[c] = freeBlock;
+      ++_kept[c];
+      return;
+    }
+  }
+  free(block);
+}
+
+void llc::SAWBufferPool::trim(){
+  AsyncWebLockGuard l(_lock);
+  for(size_t c = 0; c < CLASS_COUNT; ++c){
+    while(_free[c]){
+      FreeBlock * block = _free[c];
+      _free[c] = block->next;
+      free(block);
+    }
+    _kept[c] = 0;
+  }
+}
@@ -0,0 +1,66 @@
+#include "llc_array_pod.h"
+
+#include "AsyncWebSynchronization.h"
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBBUFFERPOOL_H_
+#define ASYNCWEBBUFFERPOOL_H_
+
+// How many released blocks of each size class are kept for reuse instead of being freed
+#ifndef SAW_BUFFER_POOL_KEEP
+#   ifdef LLC_ESP32
+#       define SAW_BUFFER_POOL_KEEP 4
+#   else
+#       define SAW_BUFFER_POOL_KEEP 2
+#   endif
+#endif
+
+namespace llc
+{
+    // Size classes follow the lwIP send window: a block is sized once per response and reused on every ack.
+    // Requests larger than the biggest class are served straight from the heap. Instance() is shared by the responses,
+    // a WebSocket server keeps its own for incoming messages.
+    class SAWBufferPool {
+        stxp size_t             CLASS_COUNT             = 5;
+        stxp size_t             CLASS_SIZES[CLASS_COUNT]= {512, 1460, 2920, 5840, 11680};
+        struct FreeBlock        { FreeBlock * next; };
+        FreeBlock               * _free     [CLASS_COUNT]   = {};
+        uint8_t                 _kept       [CLASS_COUNT]   = {};
+        uint8_t                 _keep                   = SAW_BUFFER_POOL_KEEP;   // per class
+        AsyncWebLock            _lock;
+
+        static  size_t          _classOf                (size_t size)       { size_t c = 0; while(c < CLASS_COUNT && CLASS_SIZES[c] < size) ++c; return c; }
+    public:                     ~SAWBufferPool          ();
+        explicit                SAWBufferPool           (uint8_t keep = SAW_BUFFER_POOL_KEEP)  : _keep{keep} {}
+                                SAWBufferPool           (const SAWBufferPool &) = delete;
+        SAWBufferPool &         operator=               (const SAWBufferPool &) = delete;
+        static SAWBufferPool &  Instance                ()                  { static SAWBufferPool instance; return instance; }
+
+        // Returns a block of at least minSize bytes and its real size in capacity, NULL when out of memory
+        uint8_t *               acquire                 (size_t minSize, size_t & capacity);
+        void                    release                 (uint8_t * block, size_t capacity);
+        // Frees every cached block, e.g. before a large allocation elsewhere
+        void                    trim                    ();
+    };
+} // namespace
+
+#endif // ASYNCWEBBUFFERPOOL_H_
@@ -0,0 +1,103 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "ESPAsyncWebServer.h"
+
+/*
+ * Completion Queue
+ * */
+
+void llc::SAWCompletionQueue::push(SAWDeferredRequest * deferred){
+  SAWDeferredRequest * head = _head.load(std::memory_order_relaxed);
+  do {
+    deferred->_next = head;
+  } while(!_head.compare_exchange_weak(head, deferred, std::memory_order_release, std::memory_order_relaxed));
+}
+
+llc::SAWDeferredRequest * llc::SAWCompletionQueue::take(){
+  SAWDeferredRequest * pushed = _head.exchange(NULL, std::memory_order_acquire);
+  // the stack holds the newest first
+  SAWDeferredRequest * ordered = NULL;
+  while(pushed){
+    SAWDeferredRequest * next = pushed->_next;
+    pushed->_next = ordered;
+    ordered = pushed;
+    pushed = next;
+  }
+  return ordered;
+}
+
+/*
+ * Deferred Request
+ * */
+
+bool llc::SAWDeferredRequest::send(SAWServerResponse * response){
+  if(_completed.exchange(true, std::memory_order_acq_rel)){
+    delete response;
+    release();
+    return false;
+  }
+  // the caller's reference goes with the response, the drain releases it
+  _response.store(response, std::memory_order_relaxed);
+  _schedule();
+  return true;
+}
+
+bool llc::SAWDeferredRequest::send(int code, const String & contentType, const String & content){
+  return send(new AsyncBasicResponse(code, contentType, content));
+}
+
+bool llc::SAWDeferredRequest::post(void (*fn)(SAWServerRequest * request, void * arg), void * arg){
+  SAWPostedCall * call = new (std::nothrow) SAWPostedCall{fn, arg, NULL};
+  if(!call)
+    return false;
+  SAWPostedCall * head = _posted.load(std::memory_order_relaxed);
+  do {
+    call->next = head;
+  } while(!_posted.compare_exchange_weak(head, call, std::memory_order_release, std::memory_order_relaxed));
+  _schedule();
+  return true;
+}
+
+void llc::SAWDeferredRequest::_schedule(){
+  // the drain clears the flag before it looks at the response and the posted calls, whatever was added before
+  // the exchange below found it set is still seen there
+  if(_queued.exchange(true, std::memory_order_acq_rel))
+    return;
+  retain();
+  _server->_completeDeferred(this);
+}
+
+void llc::SAWDeferredRequest::_runPosted(){
+  SAWPostedCall * pushed = _posted.exchange(NULL, std::memory_order_acquire);
+  SAWPostedCall * ordered = NULL;
+  while(pushed){
+    SAWPostedCall * next = pushed->next;
+    pushed->next = ordered;
+    ordered = pushed;
+    pushed = next;
+  }
+  while(ordered){
+    SAWPostedCall * call = ordered;
+    ordered = call->next;
+    call->fn(_request, call->arg);
+    delete call;
+  }
+}
@@ -0,0 +1,99 @@
+#include "llc_array_pod.h"
+
+#include <Arduino.h>
+#include <atomic>
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBDEFERRED_H_
+#define ASYNCWEBDEFERRED_H_
+
+class SAWServer;
+class SAWServerRequest;
+class SAWServerResponse;
+
+namespace llc
+{
+    // A call queued by SAWDeferredRequest::post()
+    struct SAWPostedCall {
+        void                    (*fn)                   (SAWServerRequest * request, void * arg);
+        void                    * arg;
+        SAWPostedCall           * next;
+    };
+
+    // Returned by request->defer(): the handler returns without sending and any task completes the request later.
+    // Call exactly one of send() or release() per reference. Once the client has disconnected the handle stays valid
+    // but inert, send() then just frees the response.
+    class SAWDeferredRequest {
+        friend class            ::SAWServer;
+        friend class            ::SAWServerRequest;
+        friend class            SAWCompletionQueue;
+        std::atomic<uint32_t>   _refs;                          // one for the request, one per handle holder
+        std::atomic<bool>       _completed;
+        std::atomic<bool>       _alive;
+        std::atomic<bool>       _queued;                        // in the server's completion queue, see _schedule()
+        SAWServer               * const _server;
+        SAWServerRequest        * _request              = {};   // only touched under the server's request lock
+        std::atomic<SAWServerResponse*> _response;              // set by send(), taken by the drain
+        std::atomic<SAWPostedCall*>     _posted;                // newest first
+        SAWDeferredRequest      * _next                 = {};   // completion queue link
+        void                    (*_abandonFn)           (void * arg)    = {};
+        void                    * _abandonArg           = {};
+                                SAWDeferredRequest      (SAWServer * server, SAWServerRequest * request) : _refs{2}, _completed{false}, _alive{true}, _queued{false}, _response{NULL}, _posted{NULL}, _server{server}, _request{request} {}
+        // Hands this to the server's completion queue unless it is there already, the queue holds a reference
+        void                    _schedule               ();
+        // Request lock held: runs the calls posted so far, oldest first
+        void                    _runPosted              ();
+    public:
+                                SAWDeferredRequest      (const SAWDeferredRequest &) = delete;
+        SAWDeferredRequest &    operator=               (const SAWDeferredRequest &) = delete;
+
+        // Takes the response and the caller's reference. False when the request was already completed,
+        // the response is deleted then.
+        bool                    send                    (SAWServerResponse * response);
+        bool                    send                    (int code, const String & contentType = String(), const String & content = String());
+        // Queues fn to run under the server's request lock, i.e. serialized with the network task. It runs before
+        // post() returns when the lock is free, otherwise once its holder lets go; posting never waits for the lock.
+        // request is NULL once the client is gone or the request was completed. False when out of memory.
+        bool                    post                    (void (*fn)(SAWServerRequest * request, void * arg), void * arg);
+        // False once the client is gone, a hint to skip slow work
+        inline  bool            alive                   ()                  const   { return _alive.load(std::memory_order_acquire); }
+        inline  SAWDeferredRequest* retain              ()                          { _refs.fetch_add(1, std::memory_order_relaxed); return this; }
+        inline  void            release                 ()                          { if(1 == _refs.fetch_sub(1, std::memory_order_acq_rel)) delete this; }
+        // Network task or inside post() only
+        inline  SAWServerRequest*   _current            ()                  const   { return _request; }
+        // fn(arg) runs on the network task when the client disconnects before the request was completed
+        inline  void            _onAbandon              (void (*fn)(void * arg), void * arg)    { _abandonFn = fn; _abandonArg = arg; }
+    };
+
+    // Lock free multi producer, single consumer: any task pushes, the holder of the server's request lock takes.
+    // A deferred request is in it at most once, see SAWDeferredRequest::_schedule().
+    class SAWCompletionQueue {
+        std::atomic<SAWDeferredRequest*>    _head;
+    public:                     SAWCompletionQueue      () : _head{NULL} {}
+        void                    push                    (SAWDeferredRequest * deferred);
+        // Everything pushed so far, oldest first
+        SAWDeferredRequest *    take                    ();
+        inline  bool            empty                   ()                  const   { return !_head.load(std::memory_order_acquire); }
+    };
+} // namespace
+
+#endif // ASYNCWEBDEFERRED_H_
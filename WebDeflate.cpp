@@ -0,0 +1,598 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebDeflate.h"
+
+constexpr size_t llc::SAWDeflate::FINISH_MAX;
+
+namespace {
+  // RFC 1951 3.2.5
+  const uint16_t LENGTH_BASE    [29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+  const uint8_t  LENGTH_EXTRA   [29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+  const uint16_t DISTANCE_BASE  [30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+  const uint8_t  DISTANCE_EXTRA [30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+  // CRC-32 a nibble at a time, 64 bytes of table instead of 1 KB
+  const uint32_t CRC32_NIBBLE   [16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+
+  // Huffman codes are defined most significant bit first, the bit stream is filled from the least significant bit
+  inline uint32_t reverseBits(uint32_t code, uint8_t count){
+    uint32_t out = 0;
+    while(count--){
+      out = (out << 1) | (code & 1);
+      code >>= 1;
+    }
+    return out;
+  }
+
+  template<size_t N>
+  inline uint8_t findBase(const uint16_t (&bases)[N], uint32_t value){
+    uint8_t index = N - 1;
+    while(bases[index] > value)
+      --index;
+    return index;
+  }
+} // namespace
+
+bool llc::SAWDeflate::begin(Format format, uint8_t windowBits, uint8_t memLevel){
+  windowBits = std::min<uint8_t>(std::max<uint8_t>(windowBits, MIN_WINDOW_BITS), MAX_WINDOW_BITS);
+  memLevel = std::min<uint8_t>(std::max<uint8_t>(memLevel, 1), 8);
+  _windowSize = 1U << windowBits;
+  _hashBits = memLevel + 7;
+  const size_t headCount = size_t(1) << _hashBits;
+  free(_window);
+  // one allocation: window, then chains, then heads
+  _window = (uint8_t *)calloc(1, 2 * _windowSize + _windowSize * sizeof(uint16_t) + headCount * sizeof(uint16_t));
+  if(!_window)
+    return false;
+  _prev = (uint16_t *)(_window + 2 * _windowSize);
+  _head = _prev + _windowSize;
+  _pos = 0;
+  _format = format;
+  _started = false;
+  _blockOpen = false;
+  _finished = false;
+  _bits = 0;
+  _bitCount = 0;
+  _check = format == ZLIB ? 1 : 0;
+  _total = 0;
+  return true;
+}
+
+void llc::SAWDeflate::_putBits(uint32_t value, uint8_t count){
+  _bits |= value << _bitCount;
+  _bitCount += count;
+  while(_bitCount >= 8){
+    _putByte(uint8_t(_bits));
+    _bits >>= 8;
+    _bitCount -= 8;
+  }
+}
+
+void llc::SAWDeflate::_putSymbol(uint16_t symbol){
+  // RFC 1951 3.2.6, fixed literal/length code
+  if(symbol < 144)
+    _putBits(reverseBits(0x30 + symbol, 8), 8);
+  else if(symbol < 256)
+    _putBits(reverseBits(0x190 + symbol - 144, 9), 9);
+  else if(symbol < 280)
+    _putBits(reverseBits(symbol - 256, 7), 7);
+  else
+    _putBits(reverseBits(0xC0 + symbol - 280, 8), 8);
+}
+
+void llc::SAWDeflate::_putMatch(uint32_t length, uint32_t distance){
+  const uint8_t lengthCode = findBase(LENGTH_BASE, length);
+  _putSymbol(257 + lengthCode);
+  if(LENGTH_EXTRA[lengthCode])
+    _putBits(length - LENGTH_BASE[lengthCode], LENGTH_EXTRA[lengthCode]);
+  const uint8_t distanceCode = findBase(DISTANCE_BASE, distance);
+  _putBits(reverseBits(distanceCode, 5), 5);
+  if(DISTANCE_EXTRA[distanceCode])
+    _putBits(distance - DISTANCE_BASE[distanceCode], DISTANCE_EXTRA[distanceCode]);
+}
+
+void llc::SAWDeflate::_flushBits(){
+  if(_bitCount)
+    _putByte(uint8_t(_bits));
+  _bits = 0;
+  _bitCount = 0;
+}
+
+void llc::SAWDeflate::_start(){
+  if(_started)
+    return;
+  _started = true;
+  if(_format == GZIP){
+    // magic, deflate, no flags, no mtime, no extra flags, unknown OS
+    static const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+    for(uint8_t b : header)
+      _putByte(b);
+  } else if(_format == ZLIB){
+    uint8_t windowBits = 8;
+    while((1U << windowBits) < _windowSize)
+      ++windowBits;
+    const uint8_t cmf = uint8_t(((windowBits - 8) << 4) | 8);
+    _putByte(cmf);
+    _putByte(uint8_t((31 - (cmf * 256U) % 31) % 31));
+  }
+}
+
+void llc::SAWDeflate::_openBlock(){
+  if(_blockOpen)
+    return;
+  _blockOpen = true;
+  // one final block with fixed codes for the whole body, or one per message
+  _putBits(_format == RAW_SYNC ? 0 : 1, 1);
+  _putBits(1, 2);
+}
+
+void llc::SAWDeflate::_updateCheck(const uint8_t * data, size_t len){
+  if(_format == GZIP){
+    uint32_t crc = ~_check;
+    for(size_t i = 0; i < len; ++i){
+      crc ^= data[i];
+      crc = (crc >> 4) ^ CRC32_NIBBLE[crc & 15];
+      crc = (crc >> 4) ^ CRC32_NIBBLE[crc & 15];
+    }
+    _check = ~crc;
+  } else if(_format == ZLIB){
+    uint32_t a = _check & 0xFFFF;
+    uint32_t b = _check >> 16;
+    while(len){
+      // largest run before b can overflow 32 bits
+      size_t run = std::min<size_t>(len, 5552);
+      len -= run;
+      while(run--){
+        a += *data++;
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+    }
+    _check = (b << 16) | a;
+  }
+}
+
+uint32_t llc::SAWDeflate::_hash(uint32_t pos) const {
+  const uint32_t key = (uint32_t(_window[pos]) << 16) | (uint32_t(_window[pos + 1]) << 8) | _window[pos + 2];
+  return (key * 2654435761U) >> (32 - _hashBits);
+}
+
+void llc::SAWDeflate::_insert(uint32_t pos, uint32_t hash){
+  _prev[pos & (_windowSize - 1)] = _head[hash];
+  _head[hash] = uint16_t(pos + 1);
+}
+
+void llc::SAWDeflate::_slide(){
+  memmove(_window, _window + _windowSize, _windowSize);
+  _pos -= _windowSize;
+  const size_t headCount = size_t(1) << _hashBits;
+  for(size_t i = 0; i < headCount; ++i)
+    _head[i] = _head[i] > _windowSize ? _head[i] - _windowSize : 0;
+  for(size_t i = 0; i < _windowSize; ++i)
+    _prev[i] = _prev[i] > _windowSize ? _prev[i] - _windowSize : 0;
+}
+
+void llc::SAWDeflate::_compress(uint32_t begin, uint32_t end){
+  uint32_t pos = begin;
+  while(pos < end){
+    uint32_t bestLength = 0;
+    uint32_t bestDistance = 0;
+    if(end - pos >= MIN_MATCH){
+      const uint32_t hash = _hash(pos);
+      const uint32_t maxLength = std::min<uint32_t>(uint32_t(MAX_MATCH), end - pos);
+      uint32_t candidate = _head[hash];
+      for(uint8_t chain = 0; candidate && chain < MAX_CHAIN; ++chain){
+        const uint32_t from = candidate - 1;
+        if(pos - from >= _windowSize)
+          break;
+        if(_window[from + bestLength] == _window[pos + bestLength]){
+          uint32_t length = 0;
+          while(length < maxLength && _window[from + length] == _window[pos + length])
+            ++length;
+          if(length > bestLength){
+            bestLength = length;
+            bestDistance = pos - from;
+            if(length == maxLength)
+              break;
+          }
+        }
+        const uint32_t next = _prev[from & (_windowSize - 1)];
+        // entries older than the window may have been overwritten by newer positions
+        if(next >= candidate)
+          break;
+        candidate = next;
+      }
+      _insert(pos, hash);
+    }
+    if(bestLength >= MIN_MATCH){
+      _putMatch(bestLength, bestDistance);
+      for(uint32_t i = 1; i < bestLength; ++i)
+        if(end - (pos + i) >= MIN_MATCH)
+          _insert(pos + i, _hash(pos + i));
+      pos += bestLength;
+    } else {
+      _putLiteral(_window[pos]);
+      ++pos;
+    }
+  }
+}
+
+size_t llc::SAWDeflate::write(const uint8_t * data, size_t len, uint8_t * out){
+  if(_finished || !_window)
+    return 0;
+  _out = out;
+  _outLen = 0;
+  _start();
+  _openBlock();
+  _updateCheck(data, len);
+  _total += len;
+  while(len){
+    if(_pos == 2 * _windowSize)
+      _slide();
+    const size_t chunk = std::min<size_t>(len, 2 * _windowSize - _pos);
+    memcpy(_window + _pos, data, chunk);
+    _compress(_pos, _pos + chunk);
+    _pos += chunk;
+    data += chunk;
+    len -= chunk;
+  }
+  return _outLen;
+}
+
+size_t llc::SAWDeflate::finish(uint8_t * out){
+  if(_finished || !_window)
+    return 0;
+  _out = out;
+  _outLen = 0;
+  _start();
+  if(_format == RAW_SYNC && _blockOpen){
+    _putSymbol(256);
+    _blockOpen = false;
+  }
+  // a RAW_SYNC stream ends with an empty final block
+  if(!_blockOpen){
+    _putBits(1, 1);
+    _putBits(1, 2);
+  }
+  _putSymbol(256);
+  _flushBits();
+  if(_format == GZIP){
+    for(uint8_t shift = 0; shift < 32; shift += 8)
+      _putByte(uint8_t(_check >> shift));
+    for(uint8_t shift = 0; shift < 32; shift += 8)
+      _putByte(uint8_t(_total >> shift));
+  } else if(_format == ZLIB){
+    for(int shift = 24; shift >= 0; shift -= 8)
+      _putByte(uint8_t(_check >> shift));
+  }
+  _finished = true;
+  free(_window);
+  _window = NULL;
+  return _outLen;
+}
+
+size_t llc::SAWDeflate::flush(uint8_t * out){
+  if(_finished || !_window)
+    return 0;
+  _out = out;
+  _outLen = 0;
+  _start();
+  if(_blockOpen){
+    _putSymbol(256);
+    _blockOpen = false;
+  }
+  // BFINAL 0, BTYPE 00, then padding to the byte boundary where LEN and NLEN would start
+  _putBits(0, 3);
+  _flushBits();
+  return _outLen;
+}
+
+void llc::SAWDeflate::resetWindow(){
+  if(!_window)
+    return;
+  _pos = 0;
+  memset(_prev, 0, (_windowSize + (size_t(1) << _hashBits)) * sizeof(uint16_t));
+}
+
+/*
+ * Inflate
+ * */
+
+bool llc::SAWInflate::begin(uint8_t windowBits, bool keepContext){
+  free(_history);
+  _history = NULL;
+  _historySize = 0;
+  _historyLen = 0;
+  if(!keepContext)
+    return true;
+  windowBits = std::min<uint8_t>(std::max<uint8_t>(windowBits, 8), 15);
+  _history = (uint8_t *)malloc(size_t(1) << windowBits);
+  if(!_history)
+    return false;
+  _historySize = size_t(1) << windowBits;
+  return true;
+}
+
+bool llc::SAWInflate::_bits(uint8_t count, uint32_t & value){
+  while(_bitCount < count){
+    if(_inPos == _inLen)
+      return false;
+    _bitBuf |= uint32_t(_in[_inPos++]) << _bitCount;
+    _bitCount += 8;
+  }
+  value = _bitBuf & ((uint32_t(1) << count) - 1);
+  _bitBuf >>= count;
+  _bitCount -= count;
+  return true;
+}
+
+int llc::SAWInflate::_decode(const uint16_t * count, const uint16_t * symbol){
+  // canonical codes of one length are consecutive, walk them a bit at a time
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  for(uint8_t len = 1; len <= MAX_BITS; ++len){
+    uint32_t bit;
+    if(!_bits(1, bit))
+      return -1;
+    code |= bit;
+    const int n = count[len];
+    if(code - n < first)
+      return symbol[index + (code - first)];
+    index += n;
+    first = (first + n) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+bool llc::SAWInflate::_build(uint16_t * count, uint16_t * symbol, const uint8_t * lengths, uint16_t n){
+  memset(count, 0, (MAX_BITS + 1) * sizeof(uint16_t));
+  for(uint16_t i = 0; i < n; ++i)
+    count[lengths[i]]++;
+  count[0] = 0;
+  int left = 1;
+  for(uint8_t len = 1; len <= MAX_BITS; ++len){
+    left = (left << 1) - count[len];
+    // over-subscribed, incomplete codes fail when an unused code shows up
+    if(left < 0)
+      return false;
+  }
+  uint16_t offsets[MAX_BITS + 1];
+  offsets[1] = 0;
+  for(uint8_t len = 1; len < MAX_BITS; ++len)
+    offsets[len + 1] = offsets[len] + count[len];
+  for(uint16_t i = 0; i < n; ++i)
+    if(lengths[i])
+      symbol[offsets[lengths[i]]++] = i;
+  return true;
+}
+
+llc::SAWInflate::Result llc::SAWInflate::_reserve(size_t len){
+  if(_outLen + len > _outMax)
+    return TOO_LARGE;
+  // one spare byte for the terminator the WebSocket event handlers may write
+  if(_outLen + len < _outCapacity)
+    return DONE;
+  size_t capacity = _outCapacity ? _outCapacity : 256;
+  while(capacity <= _outLen + len)
+    capacity *= 2;
+  capacity = std::min(capacity, _outMax + 1);
+  uint8_t * grown = (uint8_t *)realloc(_out, capacity);
+  if(!grown)
+    return NO_MEMORY;
+  _out = grown;
+  _outCapacity = capacity;
+  return DONE;
+}
+
+llc::SAWInflate::Result llc::SAWInflate::_stored(){
+  // the rest of the current byte is padding
+  _bitBuf = 0;
+  _bitCount = 0;
+  if(_inLen - _inPos < 4)
+    return CORRUPT;
+  const size_t len = _in[_inPos] | (size_t(_in[_inPos + 1]) << 8);
+  const size_t nlen = _in[_inPos + 2] | (size_t(_in[_inPos + 3]) << 8);
+  _inPos += 4;
+  if(len != (~nlen & 0xFFFF) || _inLen - _inPos < len)
+    return CORRUPT;
+  const Result result = _reserve(len);
+  if(result != DONE)
+    return result;
+  memcpy(_out + _outLen, _in + _inPos, len);
+  _outLen += len;
+  _inPos += len;
+  return DONE;
+}
+
+llc::SAWInflate::Result llc::SAWInflate::_codes(const Tables & tables){
+  for(;;){
+    int symbol = _decode(tables.lengthCount, tables.lengthSymbol);
+    if(symbol < 0)
+      return CORRUPT;
+    if(symbol < 256){
+      const Result result = _reserve(1);
+      if(result != DONE)
+        return result;
+      _out[_outLen++] = uint8_t(symbol);
+      continue;
+    }
+    if(symbol == 256)
+      return DONE;
+    symbol -= 257;
+    if(symbol >= 29)
+      return CORRUPT;
+    uint32_t extra;
+    if(!_bits(LENGTH_EXTRA[symbol], extra))
+      return CORRUPT;
+    size_t length = LENGTH_BASE[symbol] + extra;
+    symbol = _decode(tables.distanceCount, tables.distanceSymbol);
+    if(symbol < 0 || symbol >= 30 || !_bits(DISTANCE_EXTRA[symbol], extra))
+      return CORRUPT;
+    const size_t distance = DISTANCE_BASE[symbol] + extra;
+    if(distance > _outLen + _historyLen)
+      return CORRUPT;
+    const Result result = _reserve(length);
+    if(result != DONE)
+      return result;
+    // byte by byte, the match may overlap what it produces
+    for(; length; --length){
+      _out[_outLen] = distance <= _outLen ? _out[_outLen - distance] : _history[_historyLen - (distance - _outLen)];
+      ++_outLen;
+    }
+  }
+}
+
+llc::SAWInflate::Result llc::SAWInflate::_fixed(Tables & tables){
+  // RFC 1951 3.2.6
+  uint16_t i = 0;
+  for(; i < 144; ++i) tables.lengths[i] = 8;
+  for(; i < 256; ++i) tables.lengths[i] = 9;
+  for(; i < 280; ++i) tables.lengths[i] = 7;
+  for(; i < 288; ++i) tables.lengths[i] = 8;
+  _build(tables.lengthCount, tables.lengthSymbol, tables.lengths, 288);
+  for(i = 0; i < 30; ++i)
+    tables.lengths[i] = 5;
+  _build(tables.distanceCount, tables.distanceSymbol, tables.lengths, 30);
+  return _codes(tables);
+}
+
+llc::SAWInflate::Result llc::SAWInflate::_dynamic(Tables & tables){
+  // RFC 1951 3.2.7
+  static const uint8_t ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+  uint32_t nlen, ndist, ncode;
+  if(!_bits(5, nlen) || !_bits(5, ndist) || !_bits(4, ncode))
+    return CORRUPT;
+  nlen += 257;
+  ndist += 1;
+  ncode += 4;
+  if(nlen > 286 || ndist > 30)
+    return CORRUPT;
+  memset(tables.lengths, 0, 19);
+  for(uint8_t i = 0; i < ncode; ++i){
+    uint32_t len;
+    if(!_bits(3, len))
+      return CORRUPT;
+    tables.lengths[ORDER[i]] = uint8_t(len);
+  }
+  // the code length code goes into the literal/length table for the moment
+  if(!_build(tables.lengthCount, tables.lengthSymbol, tables.lengths, 19))
+    return CORRUPT;
+  uint16_t index = 0;
+  while(index < nlen + ndist){
+    int symbol = _decode(tables.lengthCount, tables.lengthSymbol);
+    if(symbol < 0)
+      return CORRUPT;
+    if(symbol < 16){
+      tables.lengths[index++] = uint8_t(symbol);
+      continue;
+    }
+    uint8_t len = 0;
+    uint32_t repeat;
+    if(symbol == 16){
+      if(!index || !_bits(2, repeat))
+        return CORRUPT;
+      len = tables.lengths[index - 1];
+      repeat += 3;
+    } else if(symbol == 17){
+      if(!_bits(3, repeat))
+        return CORRUPT;
+      repeat += 3;
+    } else {
+      if(!_bits(7, repeat))
+        return CORRUPT;
+      repeat += 11;
+    }
+    if(index + repeat > nlen + ndist)
+      return CORRUPT;
+    while(repeat--)
+      tables.lengths[index++] = len;
+  }
+  // a block without end-of-block code could never end
+  if(!tables.lengths[256])
+    return CORRUPT;
+  if(!_build(tables.lengthCount, tables.lengthSymbol, tables.lengths, nlen) ||
+     !_build(tables.distanceCount, tables.distanceSymbol, tables.lengths + nlen, ndist))
+    return CORRUPT;
+  return _codes(tables);
+}
+
+void llc::SAWInflate::_remember(){
+  if(_outLen >= _historySize){
+    memcpy(_history, _out + _outLen - _historySize, _historySize);
+    _historyLen = _historySize;
+    return;
+  }
+  const size_t keep = std::min(_historyLen, _historySize - _outLen);
+  memmove(_history, _history + _historyLen - keep, keep);
+  memcpy(_history + keep, _out, _outLen);
+  _historyLen = keep + _outLen;
+}
+
+llc::SAWInflate::Result llc::SAWInflate::inflate(const uint8_t * in, size_t len, size_t maxLen, uint8_t *& out, size_t & outLen){
+  _in = in;
+  _inLen = len;
+  _inPos = 0;
+  _bitBuf = 0;
+  _bitCount = 0;
+  _out = NULL;
+  _outLen = 0;
+  _outCapacity = 0;
+  _outMax = maxLen;
+  Tables * tables = (Tables *)malloc(sizeof(Tables));
+  Result result = tables ? _reserve(0) : NO_MEMORY;
+  uint32_t last = 0;
+  while(result == DONE){
+    uint32_t type;
+    if(!_bits(1, last) || !_bits(2, type)){
+      result = CORRUPT;
+      break;
+    }
+    if(type == 0)
+      result = _stored();
+    else if(type == 1)
+      result = _fixed(*tables);
+    else if(type == 2)
+      result = _dynamic(*tables);
+    else
+      result = CORRUPT;
+    // the appended tail ends the message with an empty stored block
+    if(last || _inPos == _inLen)
+      break;
+  }
+  free(tables);
+  if(result != DONE){
+    free(_out);
+    _out = NULL;
+    return result;
+  }
+  if(_historySize)
+    _remember();
+  out = _out;
+  outLen = _outLen;
+  _out = NULL;
+  return DONE;
+}
@@ -0,0 +1,173 @@
+#include "llc_array_pod.h"
+
+#include <Arduino.h>
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBDEFLATE_H_
+#define ASYNCWEBDEFLATE_H_
+
+// Set to 0 to never compress responses on the fly
+#ifndef SAW_DEFLATE_RESPONSES
+#   define SAW_DEFLATE_RESPONSES 1
+#endif
+// The encoder needs 4 << windowBits bytes for the window and its match chains plus 2 << (memLevel + 7) for the hash heads:
+// 12 KB with the ESP32 defaults, 6 KB with the ESP8266 ones
+#ifndef SAW_DEFLATE_WINDOW_BITS
+#   ifdef LLC_ESP32
+#       define SAW_DEFLATE_WINDOW_BITS 11
+#   else
+#       define SAW_DEFLATE_WINDOW_BITS 10
+#   endif
+#endif
+#ifndef SAW_DEFLATE_MEM_LEVEL
+#   ifdef LLC_ESP32
+#       define SAW_DEFLATE_MEM_LEVEL 4
+#   else
+#       define SAW_DEFLATE_MEM_LEVEL 3
+#   endif
+#endif
+// Bodies with a known length below this are sent as they are
+#ifndef SAW_DEFLATE_MIN_LENGTH
+#   define SAW_DEFLATE_MIN_LENGTH 256
+#endif
+
+namespace llc
+{
+    // Streaming deflate encoder for response bodies: LZ77 over a small sliding window with short hash chains,
+    // coded with the fixed Huffman tables in a single block. Every write() codes all of its input, nothing is held back
+    // except for the last few bits of a byte, so the output can go out in the same packet.
+    class SAWDeflate {
+    public:
+        // RAW_SYNC: raw blocks that are never final, each WebSocket message ends with flush() (RFC 7692)
+        enum Format : uint8_t   { RAW, ZLIB, GZIP, RAW_SYNC };
+        // Space finish() needs at most: stream header when nothing was written, end of block, pending bits and trailer
+        stxp size_t             FINISH_MAX              = 24;
+        stxp uint8_t            MIN_WINDOW_BITS         = 8;
+        stxp uint8_t            MAX_WINDOW_BITS         = 14;
+    private:
+        stxp size_t             MAX_MATCH               = 258;
+        stxp size_t             MIN_MATCH               = 3;
+        stxp uint8_t            MAX_CHAIN               = 8;
+
+        uint8_t                 * _window               = {};   // 2 << windowBits bytes, slides by half when full
+        uint16_t                * _prev                 = {};   // previous position + 1 with the same hash, indexed by position & mask
+        uint16_t                * _head                 = {};   // latest position + 1 per hash
+        uint32_t                _windowSize             = {};
+        uint32_t                _pos                    = {};
+        uint8_t                 _hashBits               = {};
+        Format                  _format                 = RAW;
+        bool                    _started                = {};
+        bool                    _blockOpen              = {};
+        bool                    _finished               = {};
+        uint32_t                _bits                   = {};
+        uint8_t                 _bitCount               = {};
+        uint32_t                _check                  = {};   // CRC-32 for gzip, Adler-32 for zlib
+        uint32_t                _total                  = {};
+        uint8_t                 * _out                  = {};
+        size_t                  _outLen                 = {};
+
+        void                    _putBits                (uint32_t value, uint8_t count);
+        void                    _putByte                (uint8_t value)     { _out[_outLen++] = value; }
+        void                    _putSymbol              (uint16_t symbol);
+        void                    _putLiteral             (uint8_t value)     { _putSymbol(value); }
+        void                    _putMatch               (uint32_t length, uint32_t distance);
+        void                    _flushBits              ();
+        void                    _start                  ();
+        void                    _openBlock              ();
+        void                    _slide                  ();
+        void                    _insert                 (uint32_t pos, uint32_t hash);
+        uint32_t                _hash                   (uint32_t pos)  const;
+        void                    _compress               (uint32_t begin, uint32_t end);
+        void                    _updateCheck            (const uint8_t * data, size_t len);
+    public:                     ~SAWDeflate             ()                  { free(_window); }
+                                SAWDeflate              ()  = default;
+                                SAWDeflate              (const SAWDeflate &) = delete;
+        SAWDeflate &            operator=               (const SAWDeflate &) = delete;
+
+        // windowBits MIN_WINDOW_BITS..MAX_WINDOW_BITS, memLevel 1..8. False when out of memory.
+        bool                    begin                   (Format format, uint8_t windowBits = SAW_DEFLATE_WINDOW_BITS, uint8_t memLevel = SAW_DEFLATE_MEM_LEVEL);
+        // Most input that codes into outMax bytes, fixed Huffman literals take up to 9 bits
+        static  size_t          inputFor                (size_t outMax)     { return outMax > 12 ? (outMax - 12) * 8 / 9 : 0; }
+        // Codes all of data into out, which must hold at least len * 9 / 8 + 12 bytes. Returns the bytes written,
+        // at least one for any non-empty input.
+        size_t                  write                   (const uint8_t * data, size_t len, uint8_t * out);
+        // Ends the stream, out must hold FINISH_MAX bytes
+        size_t                  finish                  (uint8_t * out);
+        // RAW_SYNC: ends the current message on a byte boundary with an empty stored block whose 00 00 FF FF tail is
+        // left out, as permessage-deflate sends it. out must hold FINISH_MAX bytes.
+        size_t                  flush                   (uint8_t * out);
+        // Forgets the window, the next message does not refer back to earlier ones (no_context_takeover)
+        void                    resetWindow             ();
+        inline  bool            finished                ()          const   { return _finished; }
+    };
+
+    // Raw deflate decoder for permessage-deflate (RFC 7692): stored, fixed and dynamic Huffman blocks. A message is
+    // inflated in one go into a buffer that grows up to a limit. With context takeover the last 1 << windowBits bytes
+    // are kept for the next message to refer back to.
+    class SAWInflate {
+    public:
+        enum Result : uint8_t   { DONE, CORRUPT, TOO_LARGE, NO_MEMORY };
+    private:
+        stxp uint8_t            MAX_BITS                = 15;
+        struct Tables {
+            uint16_t            lengthCount     [MAX_BITS + 1];
+            uint16_t            lengthSymbol    [288];
+            uint16_t            distanceCount   [MAX_BITS + 1];
+            uint16_t            distanceSymbol  [30];
+            uint8_t             lengths         [288 + 32];
+        };
+        uint8_t                 * _history              = {};   // last bytes of earlier messages, oldest first
+        size_t                  _historySize            = {};
+        size_t                  _historyLen             = {};
+        const uint8_t           * _in                   = {};
+        size_t                  _inLen                  = {};
+        size_t                  _inPos                  = {};
+        uint32_t                _bitBuf                 = {};
+        uint8_t                 _bitCount               = {};
+        uint8_t                 * _out                  = {};
+        size_t                  _outLen                 = {};
+        size_t                  _outCapacity            = {};
+        size_t                  _outMax                 = {};
+
+        bool                    _bits                   (uint8_t count, uint32_t & value);
+        int                     _decode                 (const uint16_t * count, const uint16_t * symbol);
+        static  bool            _build                  (uint16_t * count, uint16_t * symbol, const uint8_t * lengths, uint16_t n);
+        Result                  _reserve                (size_t len);
+        Result                  _stored                 ();
+        Result                  _fixed                  (Tables & tables);
+        Result                  _dynamic                (Tables & tables);
+        Result                  _codes                  (const Tables & tables);
+        void                    _remember               ();
+    public:                     ~SAWInflate             ()                  { free(_history); }
+                                SAWInflate              ()  = default;
+                                SAWInflate              (const SAWInflate &) = delete;
+        SAWInflate &            operator=               (const SAWInflate &) = delete;
+
+        // windowBits 8..15 as negotiated for the peer. False when out of memory.
+        bool                    begin                   (uint8_t windowBits, bool keepContext);
+        // Inflates one message. The 00 00 FF FF its sender left out must have been appended to in. On DONE out is a
+        // malloc()ed buffer with room for a terminating byte after outLen, the caller frees it.
+        Result                  inflate                 (const uint8_t * in, size_t len, size_t maxLen, uint8_t *& out, size_t & outLen);
+    };
+} // namespace
+
+#endif // ASYNCWEBDEFLATE_H_
@@ -1,5 +1,8 @@
 #include "llc_array_pod.h"
 
+#include "WebResponseCache.h"
+#include "WebSingleFlight.h"
+
 #include <string>
 #include <time.h>
 #include "stddef.h"
@@ -44,6 +47,7 @@ namespace llc
         String                  _cache_control          = {};
         String                  _last_modified          = {};
         AwsTemplateProcessor    _callback               = {};
+        AwsTemplatePrinter      _printer                = {};
         bool                    _isDir                  = {};
         bool                    _gzipFirst              = {};
         uint8_t                 _gzipStats              = {};
@@ -52,6 +56,7 @@ namespace llc
         uint8_t                 _countBits              (const uint8_t value) const;
     public:                     SAWHStatic              (const char * uri, FS & fs, const char * path, const char * cache_control);
         inline SAWHStatic&      setTemplateProcessor    (AwsTemplateProcessor newCallback) { _callback = newCallback; return *this; }
+        inline SAWHStatic&      setTemplatePrinter      (AwsTemplatePrinter newPrinter)    { _printer = newPrinter; return *this; }
         virtual bool            canHandle               (SAWServerRequest * request) override final;
         virtual void            handleRequest           (SAWServerRequest * request) override final;
         SAWHStatic&             setIsDir                (bool isDir);
@@ -65,6 +70,33 @@ namespace llc
 #endif
     };
 
+    // One file of a web directory compiled into the firmware by tools/embed_web_assets.py
+    struct SAWEmbeddedAsset {
+        const char              * path;                 // URL path, tables are sorted by it
+        const uint8_t           * data;                 // PROGMEM bytes, already encoded
+        size_t                  len;
+        const char              * mime;
+        const char              * etag;                 // quoted, derived from the encoded bytes
+        const char              * encoding;             // "gzip" or ""
+    };
+    const SAWEmbeddedAsset *    findEmbeddedAsset       (const SAWEmbeddedAsset * assets, size_t count, const char * path);
+
+    class AsyncEmbeddedWebHandler : public AsyncWebHandler {
+    prtctd: const SAWEmbeddedAsset  * _assets           = {};
+        size_t                  _count                  = {};
+        String                  _uri                    = {};
+        String                  _default_file           = {};
+        String                  _cache_control          = {};
+        String                  _last_modified          = {};
+        const SAWEmbeddedAsset* _getAsset               (SAWServerRequest * request) const;
+    public:                     AsyncEmbeddedWebHandler (const char * uri, const SAWEmbeddedAsset * assets, size_t count, const char * cache_control);
+        virtual bool            canHandle               (SAWServerRequest * request) override final;
+        virtual void            handleRequest           (SAWServerRequest * request) override final;
+        AsyncEmbeddedWebHandler&    setDefaultFile      (const char * filename)         { _default_file   = String(filename);       return *this; }
+        AsyncEmbeddedWebHandler&    setCacheControl     (const char * cache_control)    { _cache_control  = String(cache_control);  return *this; }
+        AsyncEmbeddedWebHandler&    setLastModified     (const char * last_modified)    { _last_modified  = String(last_modified);  return *this; }
+    };
+
     class SAWHCallback : public AsyncWebHandler {
     prtctd: String                  _uri                    = {};
         WebRequestMethodComposite   _method                 = HTTP_ANY;
@@ -72,11 +104,17 @@ namespace llc
         ArUploadHandlerFunction     _onUpload               = {};
         ArBodyHandlerFunction       _onBody                 = {};
         bool                        _isRegex                = {};
-    public: inline  void            setUri                  (const String & uri)                          { _uri = uri; _isRegex = uri.startsWith("^") && uri.endsWith("$"); }
+        SAWCachePolicy              * _cache                = {};
+    public:                         ~SAWHCallback           ()                                            { delete _cache; }
+        inline  void                setUri                  (const String & uri)                          { _uri = uri; _isRegex = uri.startsWith("^") && uri.endsWith("$"); }
         inline  void                setMethod               (WebRequestMethodComposite method)            { _method = method; }
         inline  void                onRequest               (const ArRequestHandlerFunction & fn)         { _onRequest  = fn; }
         inline  void                onUpload                (const ArUploadHandlerFunction  & fn)         { _onUpload   = fn; }
         inline  void                onBody                  (const ArBodyHandlerFunction    & fn)         { _onBody     = fn; }
+        // GET responses are kept for ttl ms and served stale for another stale ms while one request regenerates them
+        inline  SAWCachePolicy &    setCache                (uint32_t ttl, uint32_t stale = 0)            { const bool flight = _cache && _cache->singleFlight(); delete _cache; _cache = new SAWCachePolicy(_uri, ttl, stale); return _cache->setSingleFlight(flight); }
+        // GET requests arriving while an identical one is being answered get the same response instead of running the handler again
+        inline  SAWCachePolicy &    setSingleFlight         ()                                            { if(!_cache) _cache = new SAWCachePolicy(_uri, 0, 0); return _cache->setSingleFlight(true); }
         virtual bool                canHandle               (SAWServerRequest * request)  override final  {
             if(!_onRequest)
                 return false;
@@ -131,6 +169,10 @@ namespace llc
         virtual void handleRequest(SAWServerRequest * request) override final {
             if((_username.length() && _password.length()) && false == request->authenticate(_username.c_str(), _password.c_str()))
                 request->requestAuthentication();
+            else if(_cache && _onRequest && _cache->stores() && SAWResponseCache::Instance().serve(request, *_cache))
+                return;
+            else if(_cache && _onRequest && _cache->singleFlight() && SAWSingleFlight::Instance().join(request, *_cache))
+                return;
             if(_onRequest)
                 _onRequest(request);
             else
@@ -205,7 +205,9 @@ void AsyncStaticWebHandler::handleRequest(SAWServerRequest *request)
       response->addHeader("ETag", etag);
       request->send(response);
     } else {
-      SAWServerResponse * response = new AsyncFileResponse(request->_tempFile, filename, String(), false, _callback);
+      AsyncFileResponse * response = new AsyncFileResponse(request->_tempFile, filename, String(), false, _callback);
+      if (_printer)
+        response->setTemplatePrinter(_printer);
       if (_last_modified.length())
         response->addHeader("Last-Modified", _last_modified);
       if (_cache_control.length()){
@@ -218,3 +220,91 @@ void AsyncStaticWebHandler::handleRequest(SAWServerRequest *request)
     request->send(404);
   }
 }
+
+/*
+ * Embedded Assets
+ * */
+
+const llc::SAWEmbeddedAsset * llc::findEmbeddedAsset(const SAWEmbeddedAsset * assets, size_t count, const char * path)
+{
+  size_t lo = 0;
+  size_t hi = count;
+  while(lo < hi){
+    const size_t mid = lo + (hi - lo) / 2;
+    const int cmp = strcmp(assets[mid].path, path);
+    if(cmp == 0)
+      return &assets[mid];
+    if(cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return nullptr;
+}
+
+llc::AsyncEmbeddedWebHandler::AsyncEmbeddedWebHandler(const char* uri, const SAWEmbeddedAsset * assets, size_t count, const char* cache_control)
+  : _assets(assets), _count(count), _uri(uri), _default_file("index.htm"), _cache_control(cache_control), _last_modified("")
+{
+  if (_uri.length() == 0 || _uri[0] != '/') _uri = "/" + _uri;
+  // Notice that root will be "" not "/"
+  if (_uri[_uri.length()-1] == '/') _uri = _uri.substring(0, _uri.length()-1);
+}
+
+const llc::SAWEmbeddedAsset * llc::AsyncEmbeddedWebHandler::_getAsset(SAWServerRequest *request) const
+{
+  String path = request->url().substring(_uri.length());
+  if (path.length() && path[0] != '/')
+    return nullptr; // "/appx" must not match a handler mounted at "/app"
+
+  const SAWEmbeddedAsset * asset = nullptr;
+  if (path.length() && path[path.length()-1] != '/')
+    asset = findEmbeddedAsset(_assets, _count, path.c_str());
+  if (asset || _default_file.length() == 0)
+    return asset;
+
+  if (path.length() == 0 || path[path.length()-1] != '/')
+    path += "/";
+  path += _default_file;
+  return findEmbeddedAsset(_assets, _count, path.c_str());
+}
+
+bool llc::AsyncEmbeddedWebHandler::canHandle(SAWServerRequest *request){
+  if(request->method() != HTTP_GET
+    || !request->url().startsWith(_uri)
+    || !request->isExpectedRequestedConnType(RCT_DEFAULT, RCT_HTTP)
+    || !_getAsset(request)
+  ){
+    return false;
+  }
+  if (_last_modified.length())
+    request->addInterestingHeader("If-Modified-Since");
+  request->addInterestingHeader("If-None-Match");
+  return true;
+}
+
+void llc::AsyncEmbeddedWebHandler::handleRequest(SAWServerRequest *request)
+{
+  if((_username != "" && _password != "") && !request->authenticate(_username.c_str(), _password.c_str()))
+      return request->requestAuthentication();
+
+  // The table is constant, so looking the asset up again is cheaper than keeping it in _tempObject
+  const SAWEmbeddedAsset * asset = _getAsset(request);
+  if (!asset)
+    return request->send(404);
+
+  SAWServerResponse * response;
+  if ((_last_modified.length() && _last_modified == request->header("If-Modified-Since"))
+    || (request->hasHeader("If-None-Match") && request->header("If-None-Match").equals(asset->etag))) {
+    response = new AsyncBasicResponse(304); // Not modified
+  } else {
+    response = new AsyncProgmemResponse(200, asset->mime, asset->data, asset->len);
+    if (asset->encoding[0])
+      response->addHeader("Content-Encoding", asset->encoding);
+    if (_last_modified.length())
+      response->addHeader("Last-Modified", _last_modified);
+  }
+  response->addHeader("ETag", asset->etag);
+  if (_cache_control.length())
+    response->addHeader("Cache-Control", _cache_control);
+  request->send(response);
+}
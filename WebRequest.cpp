@@ -32,6 +32,35 @@ static const String SharedEmptyString = String();
 
 enum { PARSE_REQ_START, PARSE_REQ_HEADERS, PARSE_REQ_BODY, PARSE_REQ_END, PARSE_REQ_FAIL };
 
+// "gzip, deflate;q=0.5, br" -> ENCODING_GZIP | ENCODING_DEFLATE, codings with q=0 are refused
+static uint8_t parseAcceptEncoding(const String& value){
+  uint8_t accepted = 0;
+  int start = 0;
+  while(start < (int)value.length()){
+    int end = value.indexOf(',', start);
+    if(end < 0)
+      end = value.length();
+    String coding = value.substring(start, end);
+    start = end + 1;
+    float q = 1;
+    const int params = coding.indexOf(';');
+    if(params >= 0){
+      const int qIndex = coding.indexOf("q=", params);
+      if(qIndex >= 0)
+        q = atof(coding.c_str() + qIndex + 2);
+      coding = coding.substring(0, params);
+    }
+    coding.trim();
+    if(q <= 0)
+      continue;
+    if(coding.equalsIgnoreCase("gzip") || coding.equalsIgnoreCase("x-gzip") || coding == "*")
+      accepted |= ENCODING_GZIP;
+    if(coding.equalsIgnoreCase("deflate") || coding == "*")
+      accepted |= ENCODING_DEFLATE;
+  }
+  return accepted;
+}
+
 SAWServerRequest::SAWServerRequest(SAWServer* s, AsyncClient* c)
   : _client(c)
   , _server(s)
@@ -78,6 +107,8 @@ SAWServerRequest::SAWServerRequest(SAWServer* s, AsyncClient* c)
 }
 
 SAWServerRequest::~SAWServerRequest(){
+  if(_deleted)
+    *_deleted = true;
   _headers.free();
 
   _params.free();
@@ -85,7 +116,29 @@ SAWServerRequest::~SAWServerRequest(){
 
   _interestingHeaders.free();
 
+  if(_cachePolicy != NULL){
+    // the handler never answered, let the next request regenerate the entry
+    llc::SAWResponseCache::Instance()._store(_cacheKey, *_cachePolicy, NULL);
+  }
+
+  if(_flight != NULL){
+    // the requests waiting for this one get a 503
+    llc::SAWSingleFlight::Instance()._lead(_flight, NULL);
+  }
+
+  if(_deferred != NULL){
+    // a handle still out there becomes inert
+    _deferred->_request = NULL;
+    _deferred->_alive.store(false, std::memory_order_release);
+    if(_deferred->_abandonFn)
+      _deferred->_abandonFn(_deferred->_abandonArg);
+    _deferred->release();
+  }
+
   if(_response != NULL){
+    // segments that reference the response's memory must not outlive it in lwIP
+    if(_response->_borrowsMemory() && _client)
+      _client->abort();
     delete _response;
   }
 
@@ -99,6 +152,7 @@ SAWServerRequest::~SAWServerRequest(){
 }
 
 void SAWServerRequest::_onData(void *buf, size_t len){
+  SAWRequestLockGuard l(_server);
   size_t i = 0;
   while (true) {
 
@@ -187,18 +241,85 @@ void SAWServerRequest::_removeNotInterestingHeaders(){
   }
 }
 
+bool SAWServerRequest::_callResponse(bool respond, size_t len, uint32_t time){
+  bool deleted = false;
+  bool * outer = _deleted;
+  _deleted = &deleted;
+  if(respond)
+    _response->_respond(this);
+  else
+    _response->_ack(this, len, time);
+  if(deleted){
+    if(outer)
+      *outer = true;
+    return false;
+  }
+  _deleted = outer;
+  return true;
+}
+
+bool SAWServerRequest::_ackResponse(size_t len, uint32_t time){
+  if(_acking){
+    // resumed from inside the filler, continue once the running pass has returned
+    _dataReady = true;
+    return true;
+  }
+  _acking = true;
+  _dataReady = false;
+  if(!_callResponse(false, len, time))
+    return false;
+  while(_dataReady && _response != NULL && !_response->_finished() && _client->canSend()){
+    _dataReady = false;
+    if(!_callResponse(false, 0, 0))
+      return false;
+  }
+  _acking = false;
+  return true;
+}
+
+void SAWServerRequest::notifyDataReady(){
+  // Producers tend to hold their own mutex here, which callbacks running under the request lock may want as well.
+  // Waiting for the lock could deadlock, so a busy network task finds the flag on the next ack or poll instead.
+  _dataReady = true;
+  SAWServer * server = _server;
+  bool locked;
+  if(!server->_requestLock.tryLock(locked))
+    return;
+  if(_response != NULL && _client != NULL && _client->canSend() && !_response->_finished()){
+    _ackResponse(0, 0);
+  }
+  if(locked)
+    server->_unlockRequests();
+}
+
+llc::SAWDeferredRequest * SAWServerRequest::defer(){
+  if(_responded())
+    return NULL;
+  if(_deferred == NULL){
+    _deferred = new (std::nothrow) llc::SAWDeferredRequest(_server, this);
+    if(_deferred == NULL)
+      return NULL;
+    // waiting for the application now, not for the client
+    _client->setRxTimeout(0);
+    return _deferred;
+  }
+  return _deferred->retain();
+}
+
 void SAWServerRequest::_onPoll(){
   //os_printf("p\n");
+  SAWRequestLockGuard l(_server);
   if(_response != NULL && _client != NULL && _client->canSend() && !_response->_finished()){
-    _response->_ack(this, 0, 0);
+    _ackResponse(0, 0);
   }
 }
 
 void SAWServerRequest::_onAck(size_t len, uint32_t time){
   //os_printf("a:%u:%u\n", len, time);
+  SAWRequestLockGuard l(_server);
   if(_response != NULL){
     if(!_response->_finished()){
-      _response->_ack(this, len, time);
+      _ackResponse(len, time);
     } else {
       SAWServerResponse* r = _response;
       _response = NULL;
@@ -213,8 +334,9 @@ void SAWServerRequest::_onError(int8_t error){
 
 void SAWServerRequest::_onTimeout(uint32_t time){
   (void)time;
+  SAWRequestLockGuard l(_server);
   //os_printf("TIMEOUT: %u, state: %s\n", time, _client->stateToString());
-  _client->close();
+  _client->close(_response != NULL && _response->_borrowsMemory());
 }
 
 void SAWServerRequest::onDisconnect (ArDisconnectHandler fn){
@@ -223,6 +345,7 @@ void SAWServerRequest::onDisconnect (ArDisconnectHandler fn){
 
 void SAWServerRequest::_onDisconnect(){
   //os_printf("d\n");
+  SAWRequestLockGuard l(_server);
   if(_onDisconnectfn) {
       _onDisconnectfn();
     }
@@ -325,6 +448,8 @@ bool SAWServerRequest::_parseReqHeader(){
       }
     } else if(name.equalsIgnoreCase("Content-Length")){
       _contentLength = atoi(value.c_str());
+    } else if(name.equalsIgnoreCase("Accept-Encoding")){
+      _acceptedEncodings = parseAcceptEncoding(value);
     } else if(name.equalsIgnoreCase("Expect") && value == "100-continue"){
       _expectingContinue = true;
     } else if(name.equalsIgnoreCase("Authorization")){
@@ -709,12 +834,25 @@ void SAWServerRequest::addInterestingHeader(const String& name){
 }
 
 void SAWServerRequest::send(SAWServerResponse *response){
+  if(_responded()){
+    // one response per request, a second one would be written after or into the first
+    delete response;
+    return;
+  }
   _response = response;
   if(_response == NULL){
     _client->close(true);
     _onDisconnect();
     return;
   }
+  if(_cachePolicy != NULL){
+    llc::SAWResponseCache::Instance()._store(_cacheKey, *_cachePolicy, _response);
+    _cachePolicy = NULL;
+  }
+  if(_flight != NULL){
+    llc::SAWSingleFlight::Instance()._lead(_flight, _response);
+    _flight = NULL;
+  }
   if(!_response->_sourceValid()){
     delete response;
     _response = NULL;
@@ -722,7 +860,15 @@ void SAWServerRequest::send(SAWServerResponse *response){
   }
   else {
     _client->setRxTimeout(0);
-    _response->_respond(this);
+    _response->_request = this;
+    _acking = true;
+    _dataReady = false;
+    if(!_callResponse(true, 0, 0))
+      return;
+    _acking = false;
+    if(_dataReady && _response != NULL && !_response->_finished() && _client->canSend()){
+      _ackResponse(0, 0);
+    }
   }
 }
 
@@ -760,6 +906,10 @@ AsyncResponseStream * SAWServerRequest::beginResponseStream(const String& conten
   return new AsyncResponseStream(contentType, bufferSize);
 }
 
+llc::AsyncCompositeResponse * SAWServerRequest::beginCompositeResponse(int code, const String& contentType){
+  return new llc::AsyncCompositeResponse(code, contentType);
+}
+
 SAWServerResponse * SAWServerRequest::beginResponse_P(int code, const String& contentType, const uint8_t * content, size_t len, AwsTemplateProcessor callback){
   return new AsyncProgmemResponse(code, contentType, content, len, callback);
 }
@@ -768,10 +918,48 @@ SAWServerResponse * SAWServerRequest::beginResponse_P(int code, const String& co
   return beginResponse_P(code, contentType, (const uint8_t *)content, strlen_P(content), callback);
 }
 
+SAWServerResponse * SAWServerRequest::beginResponse(int code, const String& contentType, llc::SAWSharedBuffer * content){
+  if(content)
+    return new llc::AsyncSharedBufferResponse(code, contentType, content);
+  return NULL;
+}
+
+SAWServerResponse * SAWServerRequest::beginTemplateResponse(FS &fs, const String& path, AwsTemplatePrinter printer, const String& contentType){
+  if(!fs.exists(path))
+    return NULL;
+  AsyncFileResponse * response = new AsyncFileResponse(fs, path, contentType);
+  response->setTemplatePrinter(printer);
+  return response;
+}
+
+SAWServerResponse * SAWServerRequest::beginTemplateResponse_P(int code, const String& contentType, PGM_P content, AwsTemplatePrinter printer){
+  AsyncProgmemResponse * response = new AsyncProgmemResponse(code, contentType, (const uint8_t *)content, strlen_P(content));
+  response->setTemplatePrinter(printer);
+  return response;
+}
+
 void SAWServerRequest::send(int code, const String& contentType, const String& content){
+  // Bodyless errors go out as constant bytes unless default headers have to be added to them
+  if(!contentType.length() && !content.length() && _sendCanned(code))
+    return;
   send(beginResponse(code, contentType, content));
 }
 
+bool SAWServerRequest::_sendCanned(int code){
+  // a cached or shared request has to pass through send(response), which hands the result to the waiting requests
+  if(!_version || _responded() || _flight != NULL || _cachePolicy != NULL || !DefaultHeaders::Instance().isEmpty())
+    return false;
+  size_t len;
+  const char * canned = SAWServerResponse::cannedResponse(code, len);
+  if(!canned || _client->space() < len)
+    return false;
+  _client->setRxTimeout(0);
+  // The bytes are constants, lwIP may reference them instead of copying
+  _client->write(canned, len, 0);
+  _cannedSent = true;
+  return true;
+}
+
 void SAWServerRequest::send(FS &fs, const String& path, const String& contentType, bool download, AwsTemplateProcessor callback){
   if(fs.exists(path) || (!download && fs.exists(path+".gz"))){
     send(beginResponse(fs, path, contentType, download, callback));
@@ -804,6 +992,16 @@ void SAWServerRequest::send_P(int code, const String& contentType, PGM_P content
   send(beginResponse_P(code, contentType, content, callback));
 }
 
+void SAWServerRequest::sendTemplate(FS &fs, const String& path, AwsTemplatePrinter printer, const String& contentType){
+  if(fs.exists(path)){
+    send(beginTemplateResponse(fs, path, printer, contentType));
+  } else send(404);
+}
+
+void SAWServerRequest::sendTemplate_P(int code, const String& contentType, PGM_P content, AwsTemplatePrinter printer){
+  send(beginTemplateResponse_P(code, contentType, content, printer));
+}
+
 void SAWServerRequest::redirect(const String& url){
   SAWServerResponse * response = beginResponse(302);
   response->addHeader("Location",url);
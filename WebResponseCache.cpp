@@ -0,0 +1,205 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebResponseImpl.h"
+
+namespace {
+  // FNV-1a, the ETag only has to change with the body
+  uint32_t hashBody(const uint8_t * data, size_t len){
+    uint32_t hash = 2166136261U;
+    for(size_t i = 0; i < len; ++i){
+      hash ^= data[i];
+      hash *= 16777619U;
+    }
+    return hash;
+  }
+} // namespace
+
+/*
+ * Cache Policy
+ * */
+
+String llc::SAWCachePolicy::key(SAWServerRequest * request) const {
+  String key = request->url();
+  for(const String & name : _params){
+    AsyncWebParameter * p = request->getParam(name);
+    key += '\n';
+    key += name;
+    key += '=';
+    if(p)
+      key += p->value();
+  }
+  for(const String & name : _headers){
+    key += '\n';
+    key += name;
+    key += ':';
+    key += request->header(name.c_str());
+  }
+  return key;
+}
+
+/*
+ * Response Cache
+ * */
+
+llc::SAWResponseCache::~SAWResponseCache(){
+  clear();
+}
+
+llc::SAWResponseCache::Entry * llc::SAWResponseCache::_find(const String & key){
+  for(size_t i = 0; i < _entries.size(); ++i){
+    if(_entries[i].key != key)
+      continue;
+    // move to the most recently used end
+    if(i + 1 < _entries.size()){
+      Entry hit = std::move(_entries[i]);
+      _entries.erase(_entries.begin() + i);
+      _entries.push_back(std::move(hit));
+    }
+    return &_entries.back();
+  }
+  return NULL;
+}
+
+void llc::SAWResponseCache::_erase(size_t index){
+  Entry & e = _entries[index];
+  _bytes -= e.body->length();
+  e.body->release();
+  _entries.erase(_entries.begin() + index);
+}
+
+void llc::SAWResponseCache::_evict(size_t needed){
+  while(!_entries.empty() && _bytes + needed > SAW_RESPONSE_CACHE_BUDGET)
+    _erase(0);
+}
+
+bool llc::SAWResponseCache::serve(SAWServerRequest * request, const SAWCachePolicy & policy){
+  if(request->method() != HTTP_GET)
+    return false;
+  String key = policy.key(request);
+  SAWSharedBuffer * body = NULL;
+  String contentType;
+  String etag;
+  std::vector<AsyncWebHeader> headers;
+  uint16_t code = 0;
+  {
+    AsyncWebLockGuard l(_lock);
+    Entry * e = _find(key);
+    if(e){
+      const uint32_t age = millis() - e->stored;
+      if(age >= e->ttl + e->stale){
+        _erase(_entries.size() - 1);
+        e = NULL;
+      } else if(age >= e->ttl && !e->revalidating){
+        // this request regenerates the entry, the ones arriving meanwhile still get the stale copy
+        e->revalidating = true;
+        e = NULL;
+      }
+    }
+    if(e){
+      body = e->body->retain();
+      contentType = e->contentType;
+      etag = e->etag;
+      headers = e->headers;
+      code = e->code;
+    }
+  }
+  if(!body){
+    request->_cachePolicy = &policy;
+    request->_cacheKey = key;
+    return false;
+  }
+  SAWServerResponse * response;
+  if(request->hasHeader("If-None-Match") && request->header("If-None-Match").equals(etag)){
+    body->release();
+    response = new AsyncBasicResponse(304); // Not modified
+  } else {
+    response = new AsyncSharedBufferResponse(code, contentType, body);
+    // compressing would take the bytes through the send buffer again
+    response->setCompression(false);
+  }
+  for(const AsyncWebHeader & header : headers)
+    response->addHeader(header.name(), header.value());
+  response->addHeader("ETag", etag);
+  request->send(response);
+  return true;
+}
+
+void llc::SAWResponseCache::_store(const String & key, const SAWCachePolicy & policy, SAWServerResponse * response){
+  SAWSharedBuffer * body = NULL;
+  if(response && response->_code == 200 && response->_sourceValid())
+    body = response->_snapshot();
+  if(body && body->length() > SAW_RESPONSE_CACHE_BUDGET / 4){
+    body->release();
+    body = NULL;
+  }
+  String etag;
+  if(body){
+    char tag[24];
+    snprintf(tag, sizeof(tag), "\"%08x-%x\"", (unsigned)hashBody(body->data(), body->length()), (unsigned)body->length());
+    etag = tag;
+    response->addHeader("ETag", etag);
+  }
+
+  AsyncWebLockGuard l(_lock);
+  for(size_t i = 0; i < _entries.size(); ++i){
+    if(_entries[i].key != key)
+      continue;
+    if(!body){
+      // the handler failed or sent something that can't be stored, the next request tries again
+      _entries[i].revalidating = false;
+      return;
+    }
+    _erase(i);
+    break;
+  }
+  if(!body)
+    return;
+  _evict(body->length());
+  _entries.emplace_back();
+  Entry & e = _entries.back();
+  e.key = key;
+  e.route = policy.route();
+  e.contentType = response->_contentType;
+  e.etag = etag;
+  for(const auto & header : response->_headers)
+    // the hit adds its own
+    if(!header->name().equalsIgnoreCase("Connection") && !header->name().equalsIgnoreCase("ETag"))
+      e.headers.emplace_back(header->name(), header->value());
+  e.body = body;
+  e.code = response->_code;
+  e.stored = millis();
+  e.ttl = policy.ttl();
+  e.stale = policy.stale();
+  _bytes += body->length();
+}
+
+void llc::SAWResponseCache::invalidate(const String & route){
+  AsyncWebLockGuard l(_lock);
+  for(size_t i = _entries.size(); i--; )
+    if(_entries[i].route == route)
+      _erase(i);
+}
+
+void llc::SAWResponseCache::clear(){
+  AsyncWebLockGuard l(_lock);
+  while(!_entries.empty())
+    _erase(_entries.size() - 1);
+}
@@ -0,0 +1,105 @@
+#include "llc_array_pod.h"
+
+#include "AsyncWebSynchronization.h"
+
+#include <vector>
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBRESPONSECACHE_H_
+#define ASYNCWEBRESPONSECACHE_H_
+
+// Bytes of cached bodies kept across all routes, least recently used entries are dropped first
+#ifndef SAW_RESPONSE_CACHE_BUDGET
+#   ifdef LLC_ESP32
+#       define SAW_RESPONSE_CACHE_BUDGET 32768
+#   else
+#       define SAW_RESPONSE_CACHE_BUDGET 8192
+#   endif
+#endif
+
+namespace llc
+{
+    class SAWSharedBuffer;
+
+    // Cache settings of one route, see SAWHCallback::setCache() and setSingleFlight(). Requests share an entry, or a
+    // response in flight, when their URL, the listed parameters and the listed headers are equal.
+    class SAWCachePolicy {
+        String                  _route                  = {};
+        uint32_t                _ttl                    = {};   // ms a stored response is fresh
+        uint32_t                _stale                  = {};   // ms after that it is still served while one request regenerates it
+        std::vector<String>     _params                 = {};
+        std::vector<String>     _headers                = {};
+        bool                    _singleFlight           = {};
+    public:                     SAWCachePolicy          (const String & route, uint32_t ttl, uint32_t stale)    : _route{route}, _ttl{ttl}, _stale{stale} {}
+        inline  SAWCachePolicy& varyByParam             (const String & name)   { _params.push_back(name); return *this; }
+        inline  SAWCachePolicy& varyByHeader            (const String & name)   { _headers.push_back(name); return *this; }
+        inline  const String &  route                   ()          const       { return _route; }
+        inline  uint32_t        ttl                     ()          const       { return _ttl; }
+        inline  uint32_t        stale                   ()          const       { return _stale; }
+        inline  bool            stores                  ()          const       { return _ttl || _stale; }
+        inline  bool            singleFlight            ()          const       { return _singleFlight; }
+        inline  SAWCachePolicy& setSingleFlight         (bool enable)           { _singleFlight = enable; return *this; }
+        String                  key                     (SAWServerRequest * request)    const;
+    };
+
+    // 200 responses of GET requests whose body is known before sending (String, shared buffer, non-streaming
+    // AsyncResponseStream). Hits go out from the stored buffer without copying, with an ETag derived from the body.
+    class SAWResponseCache {
+        struct Entry {
+            String              key                     = {};
+            String              route                   = {};
+            String              contentType             = {};
+            String              etag                    = {};
+            SAWSharedBuffer     * body                  = {};
+            std::vector<AsyncWebHeader> headers         = {};   // added by the handler, sent again with every hit
+            uint16_t            code                    = {};
+            uint32_t            stored                  = {};   // millis()
+            uint32_t            ttl                     = {};
+            uint32_t            stale                   = {};
+            bool                revalidating            = {};
+        };
+        std::vector<Entry>      _entries                = {};   // least recently used first
+        size_t                  _bytes                  = {};
+        AsyncWebLock            _lock;
+
+        Entry *                 _find                   (const String & key);
+        void                    _erase                  (size_t index);
+        void                    _evict                  (size_t needed);
+                                SAWResponseCache        ()  = default;
+    public:                     ~SAWResponseCache       ();
+                                SAWResponseCache        (const SAWResponseCache &) = delete;
+        SAWResponseCache &      operator=               (const SAWResponseCache &) = delete;
+        static SAWResponseCache&Instance                ()                  { static SAWResponseCache instance; return instance; }
+
+        // Sends the stored response and returns true. Otherwise the request is marked, so the response its handler
+        // sends is stored: on a miss, or for the first request after the entry went stale.
+        bool                    serve                   (SAWServerRequest * request, const SAWCachePolicy & policy);
+        // From SAWServerRequest::send() and the destructor of a marked request, response NULL when none was sent
+        void                    _store                  (const String & key, const SAWCachePolicy & policy, SAWServerResponse * response);
+        // Drops every entry of the route passed to server.on()
+        void                    invalidate              (const String & route);
+        void                    clear                   ();
+        inline  size_t          bytes                   ()          const       { return _bytes; }
+    };
+} // namespace
+
+#endif // ASYNCWEBRESPONSECACHE_H_
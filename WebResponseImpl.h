@@ -1,6 +1,14 @@
 #include "llc_array_pod.h"
 
 #include "ESPAsyncWebServer.h"
+#include "WebBufferPool.h"
+#include "WebTemplate.h"
+#include "WebDeflate.h"
+#include "WebSingleFlight.h"
+
+#include <atomic>
+#include <new>
+#include <vector>
 
 /*
   Asynchronous WebServer library for Espressif MCUs
@@ -25,28 +33,94 @@
 #ifndef ASYNCWEBSERVERRESPONSEIMPL_H_
 #define ASYNCWEBSERVERRESPONSEIMPL_H_
 
+// SAWBufferPool block size AsyncResponseStream buffers in
+#ifndef SAW_RESPONSE_STREAM_BLOCK
+#   define SAW_RESPONSE_STREAM_BLOCK 1460
+#endif
+
 // It is possible to restore these defines, but one can use _min and _max instead. Or std::min, std::max.
 namespace llc
 {
+    // Immutable, reference counted block of bytes. Holders keep a reference until lwIP acked everything they sent from it,
+    // so the bytes can be passed to AsyncClient::add without copying.
+    class SAWSharedBuffer {
+        std::atomic<uint32_t>   _refs;
+        size_t                  _len;
+                                SAWSharedBuffer         (size_t len)                : _refs{1}, _len{len} {}
+    public:
+        // One allocation for the counter and the data, the caller owns the first reference
+        static SAWSharedBuffer* create                  (size_t len)                { void * mem = malloc(sizeof(SAWSharedBuffer) + len); return mem ? new (mem) SAWSharedBuffer(len) : nullptr; }
+        static SAWSharedBuffer* create                  (const uint8_t * data, size_t len)  { SAWSharedBuffer * b = create(len); if(b && len) memcpy(b->data(), data, len); return b; }
+        inline  uint8_t *       data                    ()                          { return (uint8_t *)(this + 1); }
+        inline  const uint8_t * data                    ()                  const   { return (const uint8_t *)(this + 1); }
+        inline  size_t          length                  ()                  const   { return _len; }
+        inline  SAWSharedBuffer*retain                  ()                          { _refs.fetch_add(1, std::memory_order_relaxed); return this; }
+        inline  void            release                 ()                          { if(1 == _refs.fetch_sub(1, std::memory_order_acq_rel)) { this->~SAWSharedBuffer(); free(this); } }
+    };
+
     class AsyncBasicResponse : public SAWServerResponse {
-    prtctd: String              _content                = {};
+    prtctd: String              _head                   = {};
+        String                  _content                = {};   // head and content stay untouched while sending, _sentLength is the offset into both
+        size_t                  _sendSlices             (SAWServerRequest * request);
     public:                     AsyncBasicResponse      (int code, const String & contentType = {}, const String & content = {});
         void                    _respond                (SAWServerRequest * request);
         size_t                  _ack                    (SAWServerRequest * request, size_t len, uint32_t time);
         inline  bool            _sourceValid            ()  const   { return true; }
+        SAWSharedBuffer *       _snapshot               ()  override    { return SAWSharedBuffer::create((const uint8_t *)_content.c_str(), _content.length()); }
     };
     class AsyncAbstractResponse : public SAWServerResponse {
     prtctd: String              _head;
         au0_t                     _cache; // Data is inserted into cache at begin(). This is inefficient with vector, but if we use some other container, we won't be able to access it as contiguous array of bytes when reading from it, so by gaining performance in one place, we'll lose it in another.
         AwsTemplateProcessor    _callback;
+        SAWCompiledTemplate     * _template             = {};   // takes over from _callback when the content could be compiled
+        AwsTemplatePrinter      _printer                = {};
+        size_t                  _templateSegment        = {};
+        size_t                  _templateOffset         = {};
+        SAWTemplateOutput       _rendered;                      // output of the current placeholder, copied into the send buffer
+        size_t                  _renderedSent           = {};
+        bool                    _encoded                = {};   // content carries a Content-Encoding, templates don't apply
+        bool                    _static                 = {};   // fixed content of known length, compressed only after setCompression(true)
+        SAWDeflate              * _deflate              = {};   // set in _respond when the client accepts gzip or deflate
+        uint8_t                 * _deflateInput         = {};   // raw content waiting to be compressed, from SAWBufferPool
+        size_t                  _deflateInputSize       = {};
+        uint8_t                 * _sendBuffer           = {};   // from SAWBufferPool, sized to the send window once and reused on every ack
+        size_t                  _sendBufferSize         = {};
+        size_t                  _chunkRest              = {};   // what the open chunk of a view still owes, its data and the closing CRLF
+        SAWSharedBody           * _tee                  = {};   // leads a single flight, content goes there as well
+        inline  void            _teeContent             (const uint8_t * data, size_t len)    { if(_tee && len && len != RESPONSE_TRY_AGAIN) _tee->append(data, len); }
+        void                    _finishContent          ();
         size_t                  _fillBufferAndProcessTemplates  (uint8_t * buf, size_t maxLen);
         size_t                  _readDataFromCacheOrContent     (uint8_t * data, const size_t len);
-    public:
+        size_t                  _fillBufferAndCompress  (uint8_t * buf, size_t maxLen);
+        bool                    _beginCompression       (SAWServerRequest * request);
+        bool                    _acquireSendBuffer      (size_t size);
+        void                    _releaseSendBuffer      ();
+        size_t                  _contentRoom            (size_t space)                        const;
+        size_t                  _sendContentCopy        (SAWServerRequest * request, size_t outLen);
+        size_t                  _sendContentView        (SAWServerRequest * request, const uint8_t * data, size_t len, size_t space);
+        size_t                  _nextView               (const uint8_t *& data);
+        void                    _advanceView            (size_t len);
+        // Content views go to lwIP as they are, no template or compression stage in between
+        inline  bool            _sendsViews             ()                                    const { return !_deflate && !_template && !_callback; }
+        // Contiguous content that stays valid until the response is destroyed. Returning bytes here sends them without copying,
+        // _contentAdvance then consumes what was sent. Set _borrowedRam in the constructor when the bytes live in RAM.
+        virtual size_t          _contentView            (const uint8_t *& /*data*/)                 { return 0; }
+        virtual void            _contentAdvance         (size_t /*len*/)                            {}
+        // Whole content as a template source, see SAWTemplateCache. Returns a new reference or NULL to keep scanning the content.
+        virtual SAWCompiledTemplate*_compileTemplate    ()                                          { return NULL; }
+        bool                    _precompileTemplate     ();
+        size_t                  _templateView           (const uint8_t *& data);
+        void                    _templateAdvance        (size_t len);
+        size_t                  _renderTemplate         (uint8_t * buf, size_t maxLen);
+    public:                     ~AsyncAbstractResponse  ();
                                 AsyncAbstractResponse   (AwsTemplateProcessor callback = 0);
+        // Replaces placeholders through printer, which writes the values into the response without building a String each
+        bool                    setTemplatePrinter      (AwsTemplatePrinter printer);
         void                    _respond                (SAWServerRequest * request);
         size_t                  _ack                    (SAWServerRequest * request, size_t len, uint32_t time);
         inline  bool            _sourceValid            ()                                    const { return false; }
         virtual size_t          _fillBuffer             (uint8_t * /*buf*/, size_t /*maxLen*/)      { return 0; }
+        bool                    _teeInto                (SAWSharedBody * shared)              override;
     };
     class AsyncFileResponse : public AsyncAbstractResponse {
     prtctd: void                _setContentType         (const String& path);
@@ -54,6 +128,7 @@ namespace llc
         using FS                = fs::FS;
         File                    _content;
         String                  _path;
+        virtual SAWCompiledTemplate*_compileTemplate    ()                                      override { return SAWTemplateCache::Instance().acquire(_content, _path); }
     public:                     ~AsyncFileResponse      ();
                                 AsyncFileResponse       (FS &fs, const String& path, const String& contentType=String(), bool download=false, AwsTemplateProcessor callback=nullptr);
                                 AsyncFileResponse       (File content, const String& path, const String& contentType=String(), bool download=false, AwsTemplateProcessor callback=nullptr);
@@ -84,20 +159,124 @@ namespace llc
     prtctd:
         const uint8_t           * _content              = {};
         size_t                  _readLength             = {};
+        virtual SAWCompiledTemplate*_compileTemplate    ()                                      override { return SAWTemplateCache::Instance().acquire_P(_content, _contentLength); }
+#ifdef LLC_ESP32
+        // Flash is memory mapped on the ESP32, on the ESP8266 lwIP could not read it byte by byte
+        virtual size_t          _contentView            (const uint8_t *& data)                 override { data = _content + _readLength; return _contentLength - _readLength; }
+        virtual void            _contentAdvance         (size_t len)                            override { _readLength += len; }
+#endif
     public:                     AsyncProgmemResponse    (int code, const String& contentType, const uint8_t * content, size_t len, AwsTemplateProcessor callback=nullptr);
         inline  bool            _sourceValid            ()                                      const { return !!(_content); }
         virtual size_t          _fillBuffer             (uint8_t * buf, size_t maxLen) override;
     };
-    class cbuf;
+    class AsyncSharedBufferResponse: public AsyncAbstractResponse {
+    prtctd: SAWSharedBuffer     * _content              = {};
+        size_t                  _readLength             = {};
+        virtual size_t          _contentView            (const uint8_t *& data)                 override { data = _content->data() + _readLength; return _contentLength - _readLength; }
+        virtual void            _contentAdvance         (size_t len)                            override { _readLength += len; }
+    public:                     ~AsyncSharedBufferResponse  ()                                  { if(_content) _content->release(); }
+        // Takes over one reference of content
+                                AsyncSharedBufferResponse   (int code, const String& contentType, SAWSharedBuffer * content);
+        inline  bool            _sourceValid            ()                                      const { return !!(_content); }
+        virtual size_t          _fillBuffer             (uint8_t * buf, size_t maxLen) override;
+        SAWSharedBuffer *       _snapshot               ()                                      override { return _content->retain(); }
+    };
+    // Response another request is producing, see SAWSingleFlight. Sent from the shared blocks without copying, with a
+    // Content-Length when the body was complete before the head went out and chunked otherwise.
+    class AsyncSharedBodyResponse: public AsyncAbstractResponse {
+    prtctd: SAWSharedBody       * _body                 = {};
+        size_t                  _readLength             = {};
+        void                    _begin                  (SAWServerRequest * request);
+        virtual size_t          _contentView            (const uint8_t *& data)                 override { return _body->view(_readLength, data); }
+        virtual void            _contentAdvance         (size_t len)                            override { _readLength += len; }
+    public:                     ~AsyncSharedBodyResponse    ()                                  { _body->unsubscribe(this); _body->release(); }
+        // Takes over one reference of body
+                                AsyncSharedBodyResponse     (SAWSharedBody * body);
+        void                    _respond                (SAWServerRequest * request);
+        size_t                  _ack                    (SAWServerRequest * request, size_t len, uint32_t time);
+        inline  bool            _sourceValid            ()                                      const { return !_body->failed(); }
+        virtual size_t          _fillBuffer             (uint8_t * buf, size_t maxLen) override;
+    };
+    // Body sent as an ordered list of parts without joining them first. Memory parts go to lwIP without copying,
+    // files and fillers are read into the send buffer. Sent chunked when a filler of unknown length is part of it.
+    class AsyncCompositeResponse: public AsyncAbstractResponse {
+    prtctd:
+        enum PartKind : uint8_t { PART_BYTES, PART_PROGMEM, PART_FILE, PART_STRING, PART_FILLER };
+        struct Part {
+            PartKind            kind                    = PART_BYTES;
+            const uint8_t       * data                  = {};
+            size_t              offset                  = {};   // into file
+            size_t              len                     = {};   // 0 for a filler that ends by returning 0
+            String              string                  = {};
+            fs::File            file                    = {};
+            AwsResponseFiller   filler                  = {};
+        };
+        std::vector<Part>       _parts                  = {};
+        size_t                  _part                   = {};   // current part and the bytes already sent from it
+        size_t                  _partOffset             = {};
+        bool                    _partFailed             = {};
+        Part *                  _addPart                (PartKind kind, size_t len);
+        void                    _nextPart               ()                                      { ++_part; _partOffset = 0; }
+        virtual size_t          _contentView            (const uint8_t *& data)                 override;
+        virtual void            _contentAdvance         (size_t len)                            override;
+    public:                     AsyncCompositeResponse  (int code, const String& contentType);
+        // The bytes must stay valid until the response is destroyed
+        AsyncCompositeResponse& addBytes                (const uint8_t * data, size_t len);
+        AsyncCompositeResponse& addBytes                (const char * text)                     { return addBytes((const uint8_t *)text, strlen(text)); }
+        AsyncCompositeResponse& addBytes_P              (const uint8_t * data, size_t len);
+        AsyncCompositeResponse& addBytes_P              (PGM_P text)                            { return addBytes_P((const uint8_t *)text, strlen_P(text)); }
+        // len 0 sends the rest of the file from offset
+        AsyncCompositeResponse& addFile                 (fs::File file, size_t offset = 0, size_t len = 0);
+        AsyncCompositeResponse& addString               (String && text);
+        // filler gets the index within its own part. len 0: unknown, the part ends when filler returns 0.
+        AsyncCompositeResponse& addFiller               (AwsResponseFiller filler, size_t len = 0);
+        void                    _respond                (SAWServerRequest * request);
+        inline  bool            _sourceValid            ()                                      const { return !_partFailed; }
+        virtual size_t          _fillBuffer             (uint8_t * buf, size_t maxLen) override;
+    };
+    // Written with print()/printf() into a chain of SAWBufferPool blocks, so growing never copies what is already buffered.
+    // In streaming mode the handler keeps writing after send(): full blocks go out as chunks until end(), and
+    // availableForWrite() tells the producer how much more the stream takes before the socket catches up.
+    // Writes after send() must be serialized with the network task: from its callbacks (async_tcp on the ESP32, loop() on
+    // the ESP8266), from SAWDeferredRequest::post() or from a coroutine handler.
     class AsyncResponseStream: public AsyncAbstractResponse, public Print {
-    prtctd:     cbuf            * _content              = {};
+    prtctd:
+        struct Block {
+            Block               * next;
+            size_t              capacity;               // of the data following this header
+            size_t              begin;                  // next byte to send
+            size_t              end;                    // next byte to write
+            inline  uint8_t *   data                    ()                                      { return (uint8_t *)(this + 1); }
+        };
+        Block                   * _first                = {};
+        Block                   * _last                 = {};
+        size_t                  _buffered               = {};
+        size_t                  _limit                  = {};   // streaming mode, most bytes buffered at once
+        bool                    _streaming              = {};
+        bool                    _ended                  = {};
+        bool                    _flushing               = {};
+        void                    (*_drainFn)             (void * arg)    = {};
+        void                    * _drainArg             = {};
+        Block *                 _appendBlock            ();
+        void                    _notifyDrain            ();
     public:                     ~AsyncResponseStream    ();
                                 AsyncResponseStream     (const String& contentType, size_t bufferSize);
         using   Print           ::write;
+        // Before send(): the body is sent chunked while it is written, instead of with a Content-Length once complete
+        void                    setStreaming            (bool streaming);
+        // Streaming mode: send what is buffered without waiting for a full block, and end the body
+        void                    flush                   ();
+        void                    end                     ();
+        inline  size_t          buffered                ()                                const { return _buffered; }
+        int                     availableForWrite       ();
+        void                    _respond                (SAWServerRequest * request);
         virtual size_t          _fillBuffer             (uint8_t *buf, size_t maxLen) override;
         size_t                  write                   (const uint8_t *data, size_t len);
         size_t                  write                   (uint8_t data);
         inline bool             _sourceValid            () const { return (_state < RESPONSE_END); }
+        SAWSharedBuffer *       _snapshot               () override;
+        // fn(arg) runs once after sent bytes were taken out of the buffer, or when the stream is deleted
+        inline  void            _onDrain                (void (*fn)(void * arg), void * arg)    { _drainFn = fn; _drainArg = arg; }
     };
 } // namespace
 
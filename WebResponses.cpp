@@ -19,10 +19,12 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include "WebResponseImpl.h"
-#include "cbuf.h"
+#include "StreamString.h"
 
-stxp char            TEMPLATE_PLACEHOLDER        = '%';
-stxp uint8_t         TEMPLATE_PARAM_NAME_LENGTH  = 32;
+#include <climits>
+
+using llc::TEMPLATE_PLACEHOLDER;
+using llc::TEMPLATE_PARAM_NAME_LENGTH;
 
 // Since ESP8266 does not link memchr by default, here's its implementation.
 void* memchr(void* ptr, int ch, size_t count)
@@ -33,51 +35,156 @@ void* memchr(void* ptr, int ch, size_t count)
       return --p;
   return nullptr;
 }
+namespace {
+  struct StatusReason {
+    uint16_t      code;
+    uint8_t       len;
+    const char  * text;
+  };
+#define STATUS_REASON(code, text) { code, sizeof(text) - 1, text }
+  // Sorted by code, looked up with a binary search
+  constexpr StatusReason STATUS_REASONS[] = {
+    STATUS_REASON(100, "Continue"),
+    STATUS_REASON(101, "Switching Protocols"),
+    STATUS_REASON(200, "OK"),
+    STATUS_REASON(201, "Created"),
+    STATUS_REASON(202, "Accepted"),
+    STATUS_REASON(203, "Non-Authoritative Information"),
+    STATUS_REASON(204, "No Content"),
+    STATUS_REASON(205, "Reset Content"),
+    STATUS_REASON(206, "Partial Content"),
+    STATUS_REASON(300, "Multiple Choices"),
+    STATUS_REASON(301, "Moved Permanently"),
+    STATUS_REASON(302, "Found"),
+    STATUS_REASON(303, "See Other"),
+    STATUS_REASON(304, "Not Modified"),
+    STATUS_REASON(305, "Use Proxy"),
+    STATUS_REASON(307, "Temporary Redirect"),
+    STATUS_REASON(400, "Bad Request"),
+    STATUS_REASON(401, "Unauthorized"),
+    STATUS_REASON(402, "Payment Required"),
+    STATUS_REASON(403, "Forbidden"),
+    STATUS_REASON(404, "Not Found"),
+    STATUS_REASON(405, "Method Not Allowed"),
+    STATUS_REASON(406, "Not Acceptable"),
+    STATUS_REASON(407, "Proxy Authentication Required"),
+    STATUS_REASON(408, "Request Time-out"),
+    STATUS_REASON(409, "Conflict"),
+    STATUS_REASON(410, "Gone"),
+    STATUS_REASON(411, "Length Required"),
+    STATUS_REASON(412, "Precondition Failed"),
+    STATUS_REASON(413, "Request Entity Too Large"),
+    STATUS_REASON(414, "Request-URI Too Large"),
+    STATUS_REASON(415, "Unsupported Media Type"),
+    STATUS_REASON(416, "Requested range not satisfiable"),
+    STATUS_REASON(417, "Expectation Failed"),
+    STATUS_REASON(431, "Request Header Fields Too Large"),
+    STATUS_REASON(500, "Internal Server Error"),
+    STATUS_REASON(501, "Not Implemented"),
+    STATUS_REASON(502, "Bad Gateway"),
+    STATUS_REASON(503, "Service Unavailable"),
+    STATUS_REASON(504, "Gateway Time-out"),
+    STATUS_REASON(505, "HTTP Version not supported"),
+  };
+#undef STATUS_REASON
+  constexpr size_t      STATUS_REASON_COUNT = sizeof(STATUS_REASONS) / sizeof(STATUS_REASONS[0]);
+  constexpr StatusReason STATUS_REASON_NONE = { 0, 0, "" };
+
+  constexpr const StatusReason & findStatusReason(int code, size_t lo = 0, size_t hi = STATUS_REASON_COUNT){
+    return (lo >= hi) ? STATUS_REASON_NONE
+      : (STATUS_REASONS[lo + (hi - lo) / 2].code == code) ? STATUS_REASONS[lo + (hi - lo) / 2]
+      : (STATUS_REASONS[lo + (hi - lo) / 2].code < code) ? findStatusReason(code, lo + (hi - lo) / 2 + 1, hi)
+      : findStatusReason(code, lo, lo + (hi - lo) / 2);
+  }
+  static_assert(findStatusReason(404).len == 9, "STATUS_REASONS must stay sorted by code");
+  static_assert(findStatusReason(101).len == 19, "STATUS_REASONS must stay sorted by code");
+
+  // Writes value in decimal plus a terminating zero into buf (at least 21 bytes), returns the digit count
+  size_t formatDecimal(char * buf, size_t value){
+    char tmp[20];
+    size_t n = 0;
+    do {
+      tmp[n++] = '0' + (value % 10);
+      value /= 10;
+    } while(value);
+    for(size_t i = 0; i < n; ++i)
+      buf[i] = tmp[n - 1 - i];
+    buf[n] = 0;
+    return n;
+  }
+  size_t decimalLength(size_t value){
+    size_t n = 1;
+    while(value >= 10){
+      value /= 10;
+      ++n;
+    }
+    return n;
+  }
+
+  // Writes value in lower case hex without terminating zero, returns the digit count
+  size_t formatHex(char * buf, size_t value){
+    size_t n = 0;
+    for(size_t v = value; v; v >>= 4)
+      ++n;
+    if(!n)
+      n = 1;
+    for(size_t i = n; i; --i, value >>= 4)
+      buf[i - 1] = "0123456789abcdef"[value & 0xF];
+    return n;
+  }
+
+  // Exactly digits characters, zero padded
+  void formatHexFixed(char * buf, size_t value, uint8_t digits){
+    for(uint8_t i = digits; i; --i, value >>= 4)
+      buf[i - 1] = "0123456789abcdef"[value & 0xF];
+  }
+
+  // Memory views sent in one go by _sendContentView, one chunk frame each
+  constexpr size_t  MAX_GATHERED_VIEWS        = 8;
+
+  constexpr char    HEAD_ACCEPT_RANGES[]      = "Accept-Ranges: none\r\n";
+  constexpr char    HEAD_CHUNKED[]            = "Transfer-Encoding: chunked\r\n";
+  constexpr char    HEAD_CONTENT_LENGTH[]     = "Content-Length: ";
+  constexpr char    HEAD_CONTENT_TYPE[]       = "Content-Type: ";
+} // namespace
+
+namespace {
+  struct CannedResponse {
+    uint16_t      code;
+    uint8_t       len;
+    const char  * text;
+  };
+  // Same bytes AsyncBasicResponse produces for send(code) on an HTTP/1.1 request
+#define CANNED_RESPONSE(code, reason) { code, sizeof("HTTP/1.1 " #code " " reason CANNED_TAIL) - 1, "HTTP/1.1 " #code " " reason CANNED_TAIL }
+#define CANNED_TAIL "\r\nAccept-Ranges: none\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+  constexpr CannedResponse CANNED_RESPONSES[] = {
+    CANNED_RESPONSE(400, "Bad Request"),
+    CANNED_RESPONSE(401, "Unauthorized"),
+    CANNED_RESPONSE(404, "Not Found"),
+    CANNED_RESPONSE(413, "Request Entity Too Large"),
+    CANNED_RESPONSE(431, "Request Header Fields Too Large"),
+    CANNED_RESPONSE(500, "Internal Server Error"),
+    CANNED_RESPONSE(501, "Not Implemented"),
+    CANNED_RESPONSE(503, "Service Unavailable"),
+  };
+#undef CANNED_TAIL
+#undef CANNED_RESPONSE
+} // namespace
+
+const char* llc::SAWServerResponse::cannedResponse(int code, size_t & len){
+  for(const auto & canned: CANNED_RESPONSES){
+    if(canned.code == code){
+      len = canned.len;
+      return canned.text;
+    }
+  }
+  len = 0;
+  return nullptr;
+}
+
 // Abstract Response
 const char* llc::SAWServerResponse::_responseCodeToString(int code) {
-  switch (code) {
-    case 100: return "Continue";
-    case 101: return "Switching Protocols";
-    case 200: return "OK";
-    case 201: return "Created";
-    case 202: return "Accepted";
-    case 203: return "Non-Authoritative Information";
-    case 204: return "No Content";
-    case 205: return "Reset Content";
-    case 206: return "Partial Content";
-    case 300: return "Multiple Choices";
-    case 301: return "Moved Permanently";
-    case 302: return "Found";
-    case 303: return "See Other";
-    case 304: return "Not Modified";
-    case 305: return "Use Proxy";
-    case 307: return "Temporary Redirect";
-    case 400: return "Bad Request";
-    case 401: return "Unauthorized";
-    case 402: return "Payment Required";
-    case 403: return "Forbidden";
-    case 404: return "Not Found";
-    case 405: return "Method Not Allowed";
-    case 406: return "Not Acceptable";
-    case 407: return "Proxy Authentication Required";
-    case 408: return "Request Time-out";
-    case 409: return "Conflict";
-    case 410: return "Gone";
-    case 411: return "Length Required";
-    case 412: return "Precondition Failed";
-    case 413: return "Request Entity Too Large";
-    case 414: return "Request-URI Too Large";
-    case 415: return "Unsupported Media Type";
-    case 416: return "Requested range not satisfiable";
-    case 417: return "Expectation Failed";
-    case 500: return "Internal Server Error";
-    case 501: return "Not Implemented";
-    case 502: return "Bad Gateway";
-    case 503: return "Service Unavailable";
-    case 504: return "Gateway Time-out";
-    case 505: return "HTTP Version not supported";
-    default:  return "";
-  }
+  return findStatusReason(code).text;
 }
 
 SAWServerResponse::SAWServerResponse()
@@ -93,9 +200,7 @@ SAWServerResponse::SAWServerResponse()
   , _writtenLength(0)
   , _state(RESPONSE_SETUP)
 {
-  for(auto header: DefaultHeaders::Instance()) {
-    _headers.add(new AsyncWebHeader(header->name(), header->value()));
-  }
+  // Default headers are not copied per response, _assembleHead appends their serialized form
 }
 
 SAWServerResponse::~SAWServerResponse(){
@@ -122,34 +227,67 @@ void llc::SAWServerResponse::addHeader(const String& name, const String& value){
 }
 
 String llc::SAWServerResponse::_assembleHead(uint8_t version){
+  // Measure first, so the head is written into one exactly sized buffer without reallocations or truncation
+  const StatusReason & reason = findStatusReason(_code);
+  size_t size = (sizeof("HTTP/1.x  \r\n") - 1) + decimalLength(_code) + reason.len;
   if(version){
-    addHeader("Accept-Ranges","none");
+    size += sizeof(HEAD_ACCEPT_RANGES) - 1;
     if(_chunked)
-      addHeader("Transfer-Encoding","chunked");
+      size += sizeof(HEAD_CHUNKED) - 1;
+  }
+  if(_sendContentLength)
+    size += (sizeof(HEAD_CONTENT_LENGTH) - 1) + decimalLength(_contentLength) + 2;
+  if(_contentType.length())
+    size += (sizeof(HEAD_CONTENT_TYPE) - 1) + _contentType.length() + 2;
+  const String & defaultHeaders = DefaultHeaders::Instance().serialized();
+  size += defaultHeaders.length();
+  for(const auto& header: _headers)
+    size += header->name().length() + header->value().length() + 4;
+  size += 2;
+
+  String out;
+  if(!out.reserve(size)){
+    _headers.free();
+    _headLength = 0;
+    return out;
   }
-  String out = String();
-  int bufSize = 300;
-  char buf[bufSize];
 
-  snprintf(buf, bufSize, "HTTP/1.%d %d %s\r\n", version, _code, _responseCodeToString(_code));
-  out.concat(buf);
+  char num[21];
+  out += "HTTP/1.";
+  out += (char)('0' + (version ? 1 : 0));
+  out += ' ';
+  formatDecimal(num, _code);
+  out += num;
+  out += ' ';
+  out += reason.text;
+  out += "\r\n";
 
-  if(_sendContentLength) {
-    snprintf(buf, bufSize, "Content-Length: %d\r\n", _contentLength);
-    out.concat(buf);
+  if(version){
+    out += HEAD_ACCEPT_RANGES;
+    if(_chunked)
+      out += HEAD_CHUNKED;
   }
-  if(_contentType.length()) {
-    snprintf(buf, bufSize, "Content-Type: %s\r\n", _contentType.c_str());
-    out.concat(buf);
+  if(_sendContentLength){
+    formatDecimal(num, _contentLength);
+    out += HEAD_CONTENT_LENGTH;
+    out += num;
+    out += "\r\n";
   }
-
+  if(_contentType.length()){
+    out += HEAD_CONTENT_TYPE;
+    out += _contentType;
+    out += "\r\n";
+  }
+  out += defaultHeaders;
   for(const auto& header: _headers){
-    snprintf(buf, bufSize, "%s: %s\r\n", header->name().c_str(), header->value().c_str());
-    out.concat(buf);
+    out += header->name();
+    out += ": ";
+    out += header->value();
+    out += "\r\n";
   }
   _headers.free();
 
-  out.concat("\r\n");
+  out += "\r\n";
   _headLength = out.length();
   return out;
 }
@@ -160,6 +298,7 @@ bool llc::SAWServerResponse::_failed() const { return _state == RESPONSE_FAILED;
 bool llc::SAWServerResponse::_sourceValid() const { return false; }
 void llc::SAWServerResponse::_respond(SAWServerRequest *request){ _state = RESPONSE_END; request->client()->close(); }
 size_t llc::SAWServerResponse::_ack(SAWServerRequest *request, size_t len, uint32_t time){ (void)request; (void)len; (void)time; return 0; }
+void llc::SAWServerResponse::resume(){ if(_request) _request->notifyDataReady(); }
 
 /*
  * String/Code Response
@@ -178,57 +317,44 @@ AsyncBasicResponse::AsyncBasicResponse(int code, const String& contentType, cons
 
 void AsyncBasicResponse::_respond(SAWServerRequest *request){
   _state = RESPONSE_HEADERS;
-  String out = _assembleHead(request->version());
-  size_t outLen = out.length();
-  size_t space = request->client()->space();
-  if(!_contentLength && space >= outLen){
-    _writtenLength += request->client()->write(out.c_str(), outLen);
-    _state = RESPONSE_WAIT_ACK;
-  } else if(_contentLength && space >= outLen + _contentLength){
-    out += _content;
-    outLen += _contentLength;
-    _writtenLength += request->client()->write(out.c_str(), outLen);
-    _state = RESPONSE_WAIT_ACK;
-  } else if(space && space < outLen){
-    String partial = out.substring(0, space);
-    _content = out.substring(space) + _content;
-    _contentLength += outLen - space;
-    _writtenLength += request->client()->write(partial.c_str(), partial.length());
-    _state = RESPONSE_CONTENT;
-  } else if(space > outLen && space < (outLen + _contentLength)){
-    size_t shift = space - outLen;
-    outLen += shift;
-    _sentLength += shift;
-    out += _content.substring(0, shift);
-    _content = _content.substring(shift);
-    _writtenLength += request->client()->write(out.c_str(), outLen);
-    _state = RESPONSE_CONTENT;
-  } else {
-    _content = out + _content;
-    _contentLength += outLen;
-    _state = RESPONSE_CONTENT;
+  _head = _assembleHead(request->version());
+  _state = RESPONSE_CONTENT;
+  // Neither String changes until the response is destroyed, so lwIP references slices of them instead of copies
+  _borrowedRam = true;
+  _sendSlices(request);
+}
+
+size_t AsyncBasicResponse::_sendSlices(SAWServerRequest *request){
+  AsyncClient * client = request->client();
+  const size_t headLen = _head.length();
+  const size_t total = headLen + _contentLength;
+  size_t space = client->space();
+  size_t written = 0;
+  // at most two rounds: the rest of the head, then the rest of the content
+  while(space && _sentLength < total){
+    const bool inHead = _sentLength < headLen;
+    const char * slice = inHead ? _head.c_str() + _sentLength : _content.c_str() + (_sentLength - headLen);
+    const size_t left = inHead ? headLen - _sentLength : total - _sentLength;
+    const size_t added = client->add(slice, std::min(left, space), 0);
+    if(!added)
+      break;
+    written += added;
+    _sentLength += added;
+    space -= added;
   }
+  if(written)
+    client->send();
+  _writtenLength += written;
+  if(_sentLength == total)
+    _state = RESPONSE_WAIT_ACK;
+  return written;
 }
 
 size_t AsyncBasicResponse::_ack(SAWServerRequest *request, size_t len, uint32_t time){
   (void)time;
   _ackedLength += len;
   if(_state == RESPONSE_CONTENT){
-    size_t available = _contentLength - _sentLength;
-    size_t space = request->client()->space();
-    //we can fit in this packet
-    if(space > available){
-      _writtenLength += request->client()->write(_content.c_str(), available);
-      _content = String();
-      _state = RESPONSE_WAIT_ACK;
-      return available;
-    }
-    //send some data, the rest on ack
-    String out = _content.substring(0, space);
-    _content = _content.substring(space);
-    _sentLength += space;
-    _writtenLength += request->client()->write(out.c_str(), space);
-    return space;
+    return _sendSlices(request);
   } else if(_state == RESPONSE_WAIT_ACK){
     if(_ackedLength >= _writtenLength){
       _state = RESPONSE_END;
@@ -252,18 +378,69 @@ AsyncAbstractResponse::AsyncAbstractResponse(AwsTemplateProcessor callback): _ca
   }
 }
 
+AsyncAbstractResponse::~AsyncAbstractResponse(){
+  _releaseSendBuffer();
+  if(_template)
+    _template->release();
+  delete _deflate;
+  SAWBufferPool::Instance().release(_deflateInput, _deflateInputSize);
+  if(_tee){
+    // readers of a body that never completed are cut off
+    _tee->fail();
+    _tee->release();
+  }
+}
+
 void AsyncAbstractResponse::_respond(SAWServerRequest *request){
   addHeader("Connection","close");
+  _beginCompression(request);
   _head = _assembleHead(request->version());
   _state = RESPONSE_HEADERS;
+  // The window is at its widest before anything was written, so one buffer of this size serves every ack
+  _acquireSendBuffer(request->client()->space());
   _ack(request, 0, 0);
 }
 
+bool AsyncAbstractResponse::_acquireSendBuffer(size_t size){
+  if(_sendBuffer)
+    return true;
+  if(!size)
+    return false;
+  _sendBuffer = SAWBufferPool::Instance().acquire(size, _sendBufferSize);
+  if(!_sendBuffer)
+    _sendBufferSize = 0;
+  return _sendBuffer != NULL;
+}
+
+void AsyncAbstractResponse::_releaseSendBuffer(){
+  SAWBufferPool::Instance().release(_sendBuffer, _sendBufferSize);
+  _sendBuffer = NULL;
+  _sendBufferSize = 0;
+}
+
+bool AsyncAbstractResponse::_teeInto(SAWSharedBody * shared){
+  if(_started() || _tee)
+    return false;
+  _tee = shared->retain();
+  return true;
+}
+
+void AsyncAbstractResponse::_finishContent(){
+  _state = RESPONSE_WAIT_ACK;
+  _releaseSendBuffer();
+  if(_tee){
+    _tee->finish();
+    _tee->release();
+    _tee = NULL;
+  }
+}
+
 size_t AsyncAbstractResponse::_ack(SAWServerRequest *request, size_t len, uint32_t time){
   (void)time;
   if(!_sourceValid()){
     _state = RESPONSE_FAILED;
-    request->client()->close();
+    // lwIP may still hold no-copy pbufs into memory that goes with the response, abort instead of draining them
+    request->client()->close(_borrowsMemory());
     return 0;
   }
   _ackedLength += len;
@@ -283,83 +460,185 @@ size_t AsyncAbstractResponse::_ack(SAWServerRequest *request, size_t len, uint32
   }
 
   if(_state == RESPONSE_CONTENT){
-    size_t outLen;
-    if(_chunked){
-      if(space <= 8){
-        return 0;
-      }
-      outLen = space;
-    } else if(!_sendContentLength){
-      outLen = space;
-    } else {
-      outLen = ((_contentLength - _sentLength) > space)?space:(_contentLength - _sentLength);
-    }
-
-    uint8_t *buf = (uint8_t *)malloc(outLen+headLen);
-    if (!buf) {
-      // os_printf("_ack malloc %d failed\n", outLen+headLen);
-      return 0;
+    // Views and copied content take turns (templates, memory followed by a callback), keep going until the window is full
+    size_t written = 0;
+    for(size_t room = _contentRoom(space);;){
+      const uint8_t * view = NULL;
+      const size_t viewLen = _nextView(view);
+      // an open chunk is finished from its view before anything is copied after it
+      const size_t sent = ((viewLen || _chunkRest) && room) ? _sendContentView(request, view, viewLen, room) : _sendContentCopy(request, room);
+      written += sent;
+      if(!sent || _state != RESPONSE_CONTENT)
+        break;
+      room = _contentRoom(request->client()->space());
+      if(!room)
+        break;
     }
+    return written;
 
-    if(headLen){
-      memcpy(buf, _head.c_str(), _head.length());
+  } else if(_state == RESPONSE_WAIT_ACK){
+    if(!_sendContentLength || _ackedLength >= _writtenLength){
+      _state = RESPONSE_END;
+      if(!_chunked && !_sendContentLength)
+        request->client()->close(true);
     }
+  }
+  return 0;
+}
 
-    size_t readLen = 0;
+size_t AsyncAbstractResponse::_contentRoom(size_t space) const {
+  if(_chunked){
+    // four hex digits of chunk size are reserved in front of the data
+    return space <= 8 ? 0 : std::min<size_t>(space, 0xFFFF);
+  }
+  if(!_sendContentLength)
+    return space;
+  return std::min(space, _contentLength - _sentLength);
+}
 
-    if(_chunked){
-      // HTTP 1.1 allows leading zeros in chunk length. Or spaces may be added.
-      // See RFC2616 sections 2, 3.6.1.
-      readLen = _fillBufferAndProcessTemplates(buf+headLen+6, outLen - 8);
-      if(readLen == RESPONSE_TRY_AGAIN){
-          free(buf);
-          return 0;
-      }
-      outLen = sprintf((char*)buf+headLen, "%x", readLen) + headLen;
-      while(outLen < headLen + 4) buf[outLen++] = ' ';
-      buf[outLen++] = '\r';
-      buf[outLen++] = '\n';
-      outLen += readLen;
-      buf[outLen++] = '\r';
-      buf[outLen++] = '\n';
+size_t AsyncAbstractResponse::_sendContentCopy(SAWServerRequest *request, size_t outLen){
+  if(_chunked && !outLen)
+    return 0;
+  const size_t headLen = _head.length();
+  if(!_acquireSendBuffer(outLen + headLen)){
+    // os_printf("_ack buffer %d failed\n", outLen+headLen);
+    return 0;
+  }
+  if(outLen + headLen > _sendBufferSize){
+    if(_sendBufferSize <= headLen + 8){
+      // sized while the window was nearly full, too small to carry the head
+      _releaseSendBuffer();
+      if(!_acquireSendBuffer(outLen + headLen))
+        return 0;
     } else {
-      readLen = _fillBufferAndProcessTemplates(buf+headLen, outLen);
-      if(readLen == RESPONSE_TRY_AGAIN){
-          free(buf);
-          return 0;
-      }
-      outLen = readLen + headLen;
+      // the window grew after the buffer was sized, the rest goes out on the next ack
+      outLen = _sendBufferSize - headLen;
     }
+  }
+  uint8_t *buf = _sendBuffer;
 
-    if(headLen){
-        _head = String();
-    }
+  if(headLen){
+    memcpy(buf, _head.c_str(), _head.length());
+  }
 
-    if(outLen){
-        _writtenLength += request->client()->write((const char*)buf, outLen);
-    }
+  size_t readLen = 0;
 
-    if(_chunked){
-        _sentLength += readLen;
-    } else {
-        _sentLength += outLen - headLen;
+  if(_chunked){
+    readLen = _fillBufferAndCompress(buf+headLen+6, outLen - 8);
+    if(readLen == RESPONSE_TRY_AGAIN){
+        return 0;
+    }
+    // HTTP 1.1 allows leading zeros in chunk length, see RFC7230 section 4.1
+    formatHexFixed((char*)buf+headLen, readLen, 4);
+    buf[headLen+4] = '\r';
+    buf[headLen+5] = '\n';
+    outLen = headLen + 6 + readLen;
+    buf[outLen++] = '\r';
+    buf[outLen++] = '\n';
+  } else {
+    readLen = _fillBufferAndCompress(buf+headLen, outLen);
+    if(readLen == RESPONSE_TRY_AGAIN){
+        return 0;
     }
+    outLen = readLen + headLen;
+  }
 
-    free(buf);
+  if(headLen){
+      _head = String();
+  }
 
-    if((_chunked && readLen == 0) || (!_sendContentLength && outLen == 0) || (!_chunked && _sentLength == _contentLength)){
-      _state = RESPONSE_WAIT_ACK;
-    }
-    return outLen;
+  if(outLen){
+      _writtenLength += request->client()->write((const char*)buf, outLen);
+  }
 
-  } else if(_state == RESPONSE_WAIT_ACK){
-    if(!_sendContentLength || _ackedLength >= _writtenLength){
-      _state = RESPONSE_END;
-      if(!_chunked && !_sendContentLength)
-        request->client()->close(true);
+  if(_chunked){
+      _sentLength += readLen;
+  } else {
+      _sentLength += outLen - headLen;
+  }
+
+  if((_chunked && readLen == 0) || (!_sendContentLength && outLen == 0) || (!_chunked && _sendContentLength && _sentLength == _contentLength)){
+    _finishContent();
+  }
+  return outLen;
+}
+
+size_t AsyncAbstractResponse::_nextView(const uint8_t *& data){
+  if(_deflate)
+    return 0;
+  if(_template)
+    return _templateView(data);
+  return _callback ? 0 : _contentView(data);
+}
+
+void AsyncAbstractResponse::_advanceView(size_t len){
+  if(_template)
+    _templateAdvance(len);
+  else
+    _contentAdvance(len);
+}
+
+size_t AsyncAbstractResponse::_sendContentView(SAWServerRequest *request, const uint8_t * data, size_t len, size_t space){
+  AsyncClient * client = request->client();
+  // Head and framing are small and get copied, the content itself is only referenced by lwIP
+  size_t written = 0;
+  if(_head.length()){
+    written = client->add(_head.c_str(), _head.length());
+    _head = _head.substring(written);
+    if(_head.length()){
+      client->send();
+      _writtenLength += written;
+      return written;
     }
   }
-  return 0;
+  // Consecutive views go out in one go, so many small parts still fill the window. A view only advances by what lwIP
+  // took, the rest goes out from there on the next ack. A chunk is sized when its size line goes in and _chunkRest
+  // keeps what it still owes, so a short add resumes the same chunk instead of breaking the framing.
+  size_t used = 0;
+  for(size_t count = 0; (len || _chunkRest) && count < MAX_GATHERED_VIEWS && used < space; ++count){
+    if(_chunked && !_chunkRest){
+      if(used + 8 >= space)
+        break;
+      len = std::min<size_t>(std::min(len, space - used - 8), 0xFFFF);
+      char frame[8];
+      size_t frameLen = formatHex(frame, len);
+      frame[frameLen++] = '\r';
+      frame[frameLen++] = '\n';
+      // add() only falls short when the queue is out of room, it is checked first so the size line goes in whole or not at all
+      if(client->space() < frameLen || client->add(frame, frameLen) != frameLen)
+        break;
+      written += frameLen;
+      used += frameLen;
+      _chunkRest = len + 2;
+    }
+    len = std::min(_chunked ? _chunkRest - 2 : len, space - used);
+    if(len){
+      const size_t added = client->add((const char*)data, len, 0);
+      written += added;
+      used += added;
+      _teeContent(data, added);
+      _advanceView(added);
+      _sentLength += added;
+      if(_chunked)
+        _chunkRest -= added;
+      if(added != len)
+        break;
+    }
+    if(_chunked){
+      if(_chunkRest != 2 || client->space() < 2 || client->add("\r\n", 2, 0) != 2)
+        break;
+      written += 2;
+      used += 2;
+      _chunkRest = 0;
+    }
+    len = _nextView(data);
+  }
+  client->send();
+  _writtenLength += written;
+
+  if(!_chunked && _sendContentLength && _sentLength == _contentLength)
+    _finishContent();
+  return written;
 }
 
 size_t AsyncAbstractResponse::_readDataFromCacheOrContent(uint8_t* data, const size_t len)
@@ -376,8 +655,155 @@ size_t AsyncAbstractResponse::_readDataFromCacheOrContent(uint8_t* data, const s
     return readFromCache + readFromContent;
 }
 
+bool AsyncAbstractResponse::_beginCompression(SAWServerRequest *request){
+#if SAW_DEFLATE_RESPONSES
+  if(!_compress || (_compress < 0 && _static && !_callback) || _encoded || _code < 200 || _code == 204 || _code == 304 || (request->method() & HTTP_HEAD))
+    return false;
+  if(_sendContentLength && _contentLength < SAW_DEFLATE_MIN_LENGTH)
+    return false;
+  if(!_contentType.startsWith("text/") && _contentType.indexOf("json") < 0 && _contentType.indexOf("javascript") < 0 && _contentType.indexOf("xml") < 0)
+    return false;
+  for(const auto& header: _headers)
+    if(header->name().equalsIgnoreCase("Content-Encoding"))
+      return false;
+
+  const uint8_t accepted = request->acceptedEncodings();
+  if(!(accepted & (ENCODING_GZIP | ENCODING_DEFLATE)))
+    return false;
+  const bool gzip = accepted & ENCODING_GZIP;
+  _deflate = new (std::nothrow) SAWDeflate();
+  if(!_deflate || !_deflate->begin(gzip ? SAWDeflate::GZIP : SAWDeflate::ZLIB)){
+    delete _deflate;
+    _deflate = NULL;
+    return false;
+  }
+  addHeader("Content-Encoding", gzip ? "gzip" : "deflate");
+  addHeader("Vary", "Accept-Encoding");
+  // The compressed length is unknown, HTTP/1.0 clients read until the connection closes
+  _sendContentLength = false;
+  _chunked = request->version() != 0;
+  return true;
+#else
+  (void)request;
+  return false;
+#endif
+}
+
+size_t AsyncAbstractResponse::_fillBufferAndCompress(uint8_t* data, size_t len){
+  if(!_deflate){
+    const size_t readLen = _fillBufferAndProcessTemplates(data, len);
+    _teeContent(data, readLen);
+    return readLen;
+  }
+  if(_deflate->finished())
+    return 0;
+  // 0 would end the body, wait for the window to open instead
+  if(len < SAWDeflate::FINISH_MAX)
+    return RESPONSE_TRY_AGAIN;
+  if(!_deflateInput){
+    _deflateInput = SAWBufferPool::Instance().acquire(SAWDeflate::inputFor(len), _deflateInputSize);
+    if(!_deflateInput){
+      _deflateInputSize = 0;
+      return RESPONSE_TRY_AGAIN;
+    }
+  }
+  const size_t readLen = _fillBufferAndProcessTemplates(_deflateInput, std::min(SAWDeflate::inputFor(len), _deflateInputSize));
+  if(readLen == RESPONSE_TRY_AGAIN)
+    return RESPONSE_TRY_AGAIN;
+  if(readLen){
+    // single-flight readers compress on their own, if at all
+    _teeContent(_deflateInput, readLen);
+    return _deflate->write(_deflateInput, readLen, data);
+  }
+  return _deflate->finish(data);
+}
+
+bool AsyncAbstractResponse::setTemplatePrinter(AwsTemplatePrinter printer){
+  if(_started() || _encoded || !printer)
+    return false;
+  _printer = printer;
+  if(_template || _precompileTemplate())
+    return true;
+  // Content that can't be compiled still goes through the scanning path
+  _callback = [printer](const String& name){ StreamString value; printer(name, value); return String(value); };
+  _sendContentLength = false;
+  _chunked = true;
+  return true;
+}
+
+bool AsyncAbstractResponse::_precompileTemplate(){
+  SAWCompiledTemplate * compiled = _compileTemplate();
+  if(!compiled)
+    return false;
+  if(_template)
+    _template->release();
+  _template = compiled;
+  if(!_printer){
+    AwsTemplateProcessor callback = _callback;
+    _printer = [callback](const String& name, Print& out){ out.print(callback(name)); };
+  }
+  _callback = nullptr;
+  _sendContentLength = false;
+  _chunked = true;
+  // lwIP references the literal runs, they must not be freed with the response while still in flight
+  if(compiled->inRam())
+    _borrowedRam = true;
+  return true;
+}
+
+size_t AsyncAbstractResponse::_templateView(const uint8_t *& data){
+  if(_renderedSent < _rendered.length() || _templateSegment >= _template->segments())
+    return 0;
+  const SAWCompiledTemplate::Segment & segment = _template->segment(_templateSegment);
+  if(segment.name.length())
+    return 0;
+  data = _template->source() + segment.offset + _templateOffset;
+  return segment.length - _templateOffset;
+}
+
+void AsyncAbstractResponse::_templateAdvance(size_t len){
+  _templateOffset += len;
+  if(_templateOffset == _template->segment(_templateSegment).length){
+    ++_templateSegment;
+    _templateOffset = 0;
+  }
+}
+
+size_t AsyncAbstractResponse::_renderTemplate(uint8_t * buf, size_t maxLen){
+  size_t filled = 0;
+  while(filled < maxLen){
+    if(_renderedSent < _rendered.length()){
+      const size_t len = std::min(maxLen - filled, _rendered.length() - _renderedSent);
+      memcpy(buf + filled, _rendered.data() + _renderedSent, len);
+      _renderedSent += len;
+      filled += len;
+      continue;
+    }
+    if(_templateSegment >= _template->segments())
+      break;
+    const SAWCompiledTemplate::Segment & segment = _template->segment(_templateSegment);
+    if(segment.name.length()){
+      _rendered.clear();
+      _renderedSent = 0;
+      _printer(segment.name, _rendered);
+      ++_templateSegment;
+      continue;
+    }
+    // without compression a literal goes out by reference from _ack, only what a placeholder left empty is copied
+    if(filled && !_deflate)
+      break;
+    const size_t len = std::min(maxLen - filled, (size_t)segment.length - _templateOffset);
+    memcpy(buf + filled, _template->source() + segment.offset + _templateOffset, len);
+    filled += len;
+    _templateAdvance(len);
+  }
+  return filled;
+}
+
 size_t AsyncAbstractResponse::_fillBufferAndProcessTemplates(uint8_t* data, size_t len)
 {
+  if(_template)
+    return _renderTemplate(data, len);
   if(!_callback)
     return _fillBuffer(data, len);
 
@@ -505,11 +931,13 @@ void AsyncFileResponse::_setContentType(const String& path){
 AsyncFileResponse::AsyncFileResponse(FS &fs, const String& path, const String& contentType, bool download, AwsTemplateProcessor callback): AsyncAbstractResponse(callback){
   _code = 200;
   _path = path;
+  _static = true;
 
   if(!download && !fs.exists(_path) && fs.exists(_path+".gz")){
     _path = _path+".gz";
     addHeader("Content-Encoding", "gzip");
     _callback = nullptr; // Unable to process zipped templates
+    _encoded = true;
     _sendContentLength = true;
     _chunked = false;
   }
@@ -534,15 +962,19 @@ AsyncFileResponse::AsyncFileResponse(FS &fs, const String& path, const String& c
     snprintf(buf, sizeof (buf), "inline; filename=\"%s\"", filename);
   }
   addHeader("Content-Disposition", buf);
+  if(_callback)
+    _precompileTemplate();
 }
 
 AsyncFileResponse::AsyncFileResponse(File content, const String& path, const String& contentType, bool download, AwsTemplateProcessor callback): AsyncAbstractResponse(callback){
   _code = 200;
   _path = path;
+  _static = true;
 
   if(!download && String(content.name()).endsWith(".gz") && !path.endsWith(".gz")){
     addHeader("Content-Encoding", "gzip");
     _callback = nullptr; // Unable to process gzipped templates
+    _encoded = true;
     _sendContentLength = true;
     _chunked = false;
   }
@@ -565,6 +997,8 @@ AsyncFileResponse::AsyncFileResponse(File content, const String& path, const Str
     snprintf(buf, sizeof (buf), "inline; filename=\"%s\"", filename);
   }
   addHeader("Content-Disposition", buf);
+  if(_callback)
+    _precompileTemplate();
 }
 
 size_t AsyncFileResponse::_fillBuffer(uint8_t *data, size_t len){
@@ -645,6 +1079,9 @@ AsyncProgmemResponse::AsyncProgmemResponse(int code, const String& contentType,
   _contentType = contentType;
   _contentLength = len;
   _readLength = 0;
+  _static = true;
+  if(_callback)
+    _precompileTemplate();
 }
 
 size_t AsyncProgmemResponse::_fillBuffer(uint8_t *data, size_t len){
@@ -660,6 +1097,236 @@ size_t AsyncProgmemResponse::_fillBuffer(uint8_t *data, size_t len){
 }
 
 
+/*
+ * Shared Buffer Response
+ * */
+
+AsyncSharedBufferResponse::AsyncSharedBufferResponse(int code, const String& contentType, SAWSharedBuffer * content): AsyncAbstractResponse() {
+  _code = code;
+  _content = content;
+  _contentType = contentType;
+  _contentLength = content ? content->length() : 0;
+  _borrowedRam = true;
+  _static = true;
+}
+
+size_t AsyncSharedBufferResponse::_fillBuffer(uint8_t *data, size_t len){
+  const size_t left = std::min(len, _contentLength - _readLength);
+  memcpy(data, _content->data() + _readLength, left);
+  _readLength += left;
+  return left;
+}
+
+
+/*
+ * Shared Body Response
+ * */
+
+AsyncSharedBodyResponse::AsyncSharedBodyResponse(SAWSharedBody * body): AsyncAbstractResponse() {
+  _body = body;
+  _borrowedRam = true;
+}
+
+void AsyncSharedBodyResponse::_begin(SAWServerRequest *request){
+  _code = _body->code();
+  _contentType = _body->contentType();
+  for(const auto& header: _body->headers())
+    addHeader(header.name(), header.value());
+  if(_body->finished()){
+    _contentLength = _body->length();
+  } else {
+    // the leader is still producing it
+    _sendContentLength = false;
+    _chunked = request->version() != 0;
+  }
+  AsyncAbstractResponse::_respond(request);
+}
+
+void AsyncSharedBodyResponse::_respond(SAWServerRequest *request){
+  if(!_body->started()){
+    // the leader has not sent its response yet, _ack begins once it did
+    _body->subscribe(this);
+    return;
+  }
+  _begin(request);
+}
+
+size_t AsyncSharedBodyResponse::_ack(SAWServerRequest *request, size_t len, uint32_t time){
+  if(_state == RESPONSE_SETUP){
+    _respond(request);
+    return 0;
+  }
+  return AsyncAbstractResponse::_ack(request, len, time);
+}
+
+size_t AsyncSharedBodyResponse::_fillBuffer(uint8_t *data, size_t len){
+  const size_t read = _body->read(_readLength, data, len);
+  _readLength += read;
+  if(read || _body->finished())
+    return read;
+  // caught up with the leader
+  _body->subscribe(this);
+  return RESPONSE_TRY_AGAIN;
+}
+
+
+/*
+ * Composite Response
+ * */
+
+AsyncCompositeResponse::AsyncCompositeResponse(int code, const String& contentType): AsyncAbstractResponse() {
+  _code = code;
+  _contentType = contentType;
+  _contentLength = 0;
+}
+
+AsyncCompositeResponse::Part * AsyncCompositeResponse::_addPart(PartKind kind, size_t len){
+  if(_started())
+    return NULL;
+  _parts.emplace_back();
+  Part & part = _parts.back();
+  part.kind = kind;
+  part.len = len;
+  return &part;
+}
+
+AsyncCompositeResponse& AsyncCompositeResponse::addBytes(const uint8_t * data, size_t len){
+  Part * part = (data && len) ? _addPart(PART_BYTES, len) : NULL;
+  if(part){
+    part->data = data;
+    _borrowedRam = true;
+  }
+  return *this;
+}
+
+AsyncCompositeResponse& AsyncCompositeResponse::addBytes_P(const uint8_t * data, size_t len){
+  Part * part = (data && len) ? _addPart(PART_PROGMEM, len) : NULL;
+  if(part)
+    part->data = data;
+  return *this;
+}
+
+AsyncCompositeResponse& AsyncCompositeResponse::addFile(fs::File file, size_t offset, size_t len){
+  if(!file || offset >= file.size())
+    return *this;
+  if(!len || len > file.size() - offset)
+    len = file.size() - offset;
+  Part * part = _addPart(PART_FILE, len);
+  if(part){
+    part->file = file;
+    part->offset = offset;
+  }
+  return *this;
+}
+
+AsyncCompositeResponse& AsyncCompositeResponse::addString(String && text){
+  Part * part = text.length() ? _addPart(PART_STRING, text.length()) : NULL;
+  if(part){
+    part->string = std::move(text);
+    _borrowedRam = true;
+  }
+  return *this;
+}
+
+AsyncCompositeResponse& AsyncCompositeResponse::addFiller(AwsResponseFiller filler, size_t len){
+  Part * part = filler ? _addPart(PART_FILLER, len) : NULL;
+  if(part)
+    part->filler = filler;
+  return *this;
+}
+
+void AsyncCompositeResponse::_respond(SAWServerRequest *request){
+  _contentLength = 0;
+  _sendContentLength = true;
+  for(const Part & part : _parts){
+    if(!part.len)
+      _sendContentLength = false;
+    _contentLength += part.len;
+  }
+  if(!_sendContentLength)
+    _chunked = request->version() != 0;
+  AsyncAbstractResponse::_respond(request);
+}
+
+size_t AsyncCompositeResponse::_contentView(const uint8_t *& data){
+  if(_part >= _parts.size())
+    return 0;
+  const Part & part = _parts[_part];
+  switch(part.kind){
+    case PART_STRING:
+      data = (const uint8_t *)part.string.c_str() + _partOffset;
+      return part.len - _partOffset;
+#ifdef LLC_ESP32
+    case PART_PROGMEM:  // flash is memory mapped
+#endif
+    case PART_BYTES:
+      data = part.data + _partOffset;
+      return part.len - _partOffset;
+    default:
+      return 0;
+  }
+}
+
+void AsyncCompositeResponse::_contentAdvance(size_t len){
+  _partOffset += len;
+  if(_partOffset == _parts[_part].len)
+    _nextPart();
+}
+
+size_t AsyncCompositeResponse::_fillBuffer(uint8_t *data, size_t len){
+  size_t filled = 0;
+  while(filled < len && _part < _parts.size()){
+    Part & part = _parts[_part];
+    const uint8_t * view = NULL;
+    // memory parts are left for _sendContentView unless a later stage has to see the bytes
+    if(filled && _sendsViews() && _contentView(view))
+      break;
+    size_t room = len - filled;
+    if(part.len)
+      room = std::min(room, part.len - _partOffset);
+    size_t got = 0;
+    switch(part.kind){
+      case PART_BYTES:
+        memcpy(data + filled, part.data + _partOffset, room);
+        got = room;
+        break;
+      case PART_PROGMEM:
+        memcpy_P(data + filled, part.data + _partOffset, room);
+        got = room;
+        break;
+      case PART_STRING:
+        memcpy(data + filled, part.string.c_str() + _partOffset, room);
+        got = room;
+        break;
+      case PART_FILE:
+        if(part.file.position() != part.offset + _partOffset)
+          part.file.seek(part.offset + _partOffset);
+        got = part.file.read(data + filled, room);
+        break;
+      case PART_FILLER:
+        got = part.filler(data + filled, room, _partOffset);
+        if(got == RESPONSE_TRY_AGAIN)
+          return filled ? filled : RESPONSE_TRY_AGAIN;
+        break;
+    }
+    if(!got){
+      // a file or filler ended before its announced length, the body can't be completed
+      if(part.len){
+        _partFailed = true;
+        return filled;
+      }
+      _nextPart();
+      continue;
+    }
+    filled += got;
+    _partOffset += got;
+    if(part.len && _partOffset == part.len)
+      _nextPart();
+  }
+  return filled;
+}
+
+
 /*
  * Response Stream (You can print/write/printf to it, up to the contentLen bytes)
  * */
@@ -668,27 +1335,142 @@ AsyncResponseStream::AsyncResponseStream(const String& contentType, size_t buffe
   _code = 200;
   _contentLength = 0;
   _contentType = contentType;
-  _content = new cbuf(bufferSize);
+  // one block in flight while the producer fills the next
+  _limit = std::max<size_t>(bufferSize, 2 * SAW_RESPONSE_STREAM_BLOCK);
 }
 
 AsyncResponseStream::~AsyncResponseStream(){
-  delete _content;
+  while(_first){
+    Block * block = _first;
+    _first = block->next;
+    SAWBufferPool::Instance().release((uint8_t *)block, sizeof(Block) + block->capacity);
+  }
+  _notifyDrain();
 }
 
-size_t AsyncResponseStream::_fillBuffer(uint8_t *buf, size_t maxLen){
-  return _content->read((char*)buf, maxLen);
+llc::SAWSharedBuffer * AsyncResponseStream::_snapshot(){
+  if(_streaming)
+    return NULL;
+  SAWSharedBuffer * body = SAWSharedBuffer::create(_buffered);
+  if(!body)
+    return NULL;
+  size_t offset = 0;
+  for(Block * block = _first; block; block = block->next){
+    memcpy(body->data() + offset, block->data() + block->begin, block->end - block->begin);
+    offset += block->end - block->begin;
+  }
+  return body;
 }
 
-size_t AsyncResponseStream::write(const uint8_t *data, size_t len){
+void AsyncResponseStream::_notifyDrain(){
+  void (*fn)(void *) = _drainFn;
+  _drainFn = NULL;
+  if(fn)
+    fn(_drainArg);
+}
+
+AsyncResponseStream::Block * AsyncResponseStream::_appendBlock(){
+  size_t capacity = 0;
+  Block * block = (Block *)SAWBufferPool::Instance().acquire(SAW_RESPONSE_STREAM_BLOCK, capacity);
+  if(!block)
+    return NULL;
+  block->next = NULL;
+  block->capacity = capacity - sizeof(Block);
+  block->begin = 0;
+  block->end = 0;
+  if(_last)
+    _last->next = block;
+  else
+    _first = block;
+  _last = block;
+  return block;
+}
+
+void AsyncResponseStream::setStreaming(bool streaming){
   if(_started())
+    return;
+  _streaming = streaming;
+  _sendContentLength = !streaming;
+  _chunked = streaming;
+}
+
+void AsyncResponseStream::_respond(SAWServerRequest *request){
+  if(_streaming && !request->version())
+    _chunked = false;   // HTTP/1.0 reads until the connection closes
+  AsyncAbstractResponse::_respond(request);
+}
+
+void AsyncResponseStream::flush(){
+  if(!_streaming)
+    return;
+  _flushing = _buffered > 0;
+  resume();
+}
+
+void AsyncResponseStream::end(){
+  if(!_streaming || _ended)
+    return;
+  _ended = true;
+  resume();
+}
+
+int AsyncResponseStream::availableForWrite(){
+  if(_ended || (_started() && !_streaming))
     return 0;
+  if(!_streaming)
+    return INT_MAX;
+  return _limit > _buffered ? int(_limit - _buffered) : 0;
+}
 
-  if(len > _content->room()){
-    size_t needed = len - _content->room();
-    _content->resizeAdd(needed);
+size_t AsyncResponseStream::_fillBuffer(uint8_t *buf, size_t maxLen){
+  // Streaming sends whole blocks until flush() or end()
+  if(_streaming && !_ended && !_flushing && (!_first || _first->end < _first->capacity))
+    return RESPONSE_TRY_AGAIN;
+  size_t filled = 0;
+  while(filled < maxLen && _first){
+    Block * block = _first;
+    const size_t len = std::min(maxLen - filled, block->end - block->begin);
+    memcpy(buf + filled, block->data() + block->begin, len);
+    block->begin += len;
+    filled += len;
+    if(block->begin < block->end)
+      break;
+    _first = block->next;
+    if(!_first)
+      _last = NULL;
+    SAWBufferPool::Instance().release((uint8_t *)block, sizeof(Block) + block->capacity);
+  }
+  _buffered -= filled;
+  if(!_buffered)
+    _flushing = false;
+  if(!filled && _streaming && !_ended)
+    return RESPONSE_TRY_AGAIN;
+  if(filled)
+    _notifyDrain();
+  return filled;
+}
+
+size_t AsyncResponseStream::write(const uint8_t *data, size_t len){
+  if(_ended || (_started() && !_streaming))
+    return 0;
+  if(_streaming)
+    len = std::min(len, (size_t)availableForWrite());
+
+  size_t written = 0;
+  while(written < len){
+    Block * block = (_last && _last->end < _last->capacity) ? _last : _appendBlock();
+    if(!block)
+      break;
+    const size_t chunk = std::min(len - written, block->capacity - block->end);
+    memcpy(block->data() + block->end, data + written, chunk);
+    block->end += chunk;
+    written += chunk;
   }
-  size_t written = _content->write((const char*)data, len);
-  _contentLength += written;
+  _buffered += written;
+  if(!_streaming)
+    _contentLength += written;
+  else if(_first && _first->end == _first->capacity)
+    resume();
   return written;
 }
 
@@ -0,0 +1,74 @@
+#include "llc_array_pod.h"
+
+#include <stddef.h>
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBRINGQUEUE_H_
+#define ASYNCWEBRINGQUEUE_H_
+
+namespace llc
+{
+    // FIFO of at most N items in a fixed array: push, pop and size are O(1) and nothing is allocated per item.
+    // Items are copied in and out, so queues of pointers leave freeing them to the owner.
+    template<typename T, size_t N>
+    class SAWRingQueue {
+        static_assert(N > 0, "a ring queue needs room for one item");
+        T                       _items  [N]             = {};
+        size_t                  _head                   = {};
+        size_t                  _count                  = {};
+
+        inline  size_t          _slot                   (size_t index)      const   { index += _head; return index >= N ? index - N : index; }
+    public:
+        inline  size_t          size                    ()                  const   { return _count; }
+        inline  bool            empty                   ()                  const   { return _count == 0; }
+        inline  bool            full                    ()                  const   { return _count == N; }
+        // index counts from the front, 0 is the oldest item
+        inline  T &             operator[]              (size_t index)              { return _items[_slot(index)]; }
+        inline  const T &       operator[]              (size_t index)      const   { return _items[_slot(index)]; }
+        inline  T &             front                   ()                          { return _items[_head]; }
+        inline  T &             back                    ()                          { return _items[_slot(_count - 1)]; }
+        // False when full, the item was not queued
+        bool                    push_back               (const T & item)            {
+            if(full())
+                return false;
+            _items[_slot(_count)] = item;
+            ++_count;
+            return true;
+        }
+        T                       pop_front               ()                          {
+            T item = _items[_head];
+            _items[_head] = T();
+            _head = _slot(1);
+            --_count;
+            return item;
+        }
+        // Removes the item at index, the ones behind it move up by one
+        void                    erase                   (size_t index)              {
+            for(; index + 1 < _count; ++index)
+                _items[_slot(index)] = _items[_slot(index + 1)];
+            _items[_slot(_count - 1)] = T();
+            --_count;
+        }
+    };
+} // namespace
+
+#endif // ASYNCWEBRINGQUEUE_H_
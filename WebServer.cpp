@@ -67,6 +67,65 @@ void              SAWServer::_attachHandler    (SAWServerRequest * request)
     request->setHandler(_catchAllHandler);
 }
 
+void              SAWServer::_completeDeferred (llc::SAWDeferredRequest * deferred)     {
+    _completions.push(deferred);
+    // AsyncTCP can't be asked to run something on its task, so whoever completes drains the queue while holding
+    // the lock every request callback takes. The completing task may hold a mutex of its own that a callback waits
+    // for, so it doesn't wait for the lock: the holder finds the queue when it lets go, see _unlockRequests().
+    bool locked;
+    if(!_requestLock.tryLock(locked))
+        return;
+    if(locked)
+        _unlockRequests();
+    else
+        _drainCompleted();
+}
+
+void              SAWServer::_unlockRequests   ()     {
+    // A completion pushed after the last drain found the lock taken and left. Checking once more after the release
+    // catches it, or whoever took the lock in between does.
+    bool locked = true;
+    while(locked){
+        _drainCompleted();
+        _requestLock.unlock();
+        if(_completions.empty() || !_requestLock.tryLock(locked))
+            return;
+    }
+}
+
+void              SAWServer::_drainCompleted   ()     {
+    if(_completions.empty())
+        return;
+    llc::SAWDeferredRequest * next = _completions.take();
+    while(next){
+        llc::SAWDeferredRequest * d = next;
+        next = d->_next;
+        // anything sent or posted from here on queues d again
+        d->_queued.exchange(false, std::memory_order_acq_rel);
+        d->_runPosted();
+        SAWServerResponse * response = d->_response.exchange(NULL, std::memory_order_acq_rel);
+        if(response){
+            SAWServerRequest * request = d->_request;
+            if(request){
+                request->_deferred = NULL;
+                d->_request = NULL;
+                d->release();
+                if(!request->_responded())
+                    request->send(response);
+                else
+                    delete response;    // a coroutine handler sent its own response already
+            } else
+                delete response;
+            d->release();               // the sender's
+        }
+        d->release();                   // the queue's
+    }
+}
+
+void              SAWServer::invalidate        (const String & route)     {
+    llc::SAWResponseCache::Instance().invalidate(route);
+}
+
 
 AsyncCallbackWebHandler& SAWServer::on(const char* uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody){
   AsyncCallbackWebHandler* handler = new AsyncCallbackWebHandler();
@@ -111,6 +170,11 @@ AsyncStaticWebHandler& SAWServer::serveStatic(const char* uri, fs::FS& fs, const
   addHandler(handler);
   return *handler;
 }
+llc::AsyncEmbeddedWebHandler& SAWServer::serveEmbedded(const char* uri, const llc::SAWEmbeddedAsset * assets, size_t count, const char* cache_control){
+  llc::AsyncEmbeddedWebHandler* handler = new llc::AsyncEmbeddedWebHandler(uri, assets, count, cache_control);
+  addHandler(handler);
+  return *handler;
+}
 void SAWServer::reset            (){
   _rewrites.free();
   _handlers.free();
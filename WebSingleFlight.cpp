@@ -0,0 +1,231 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebResponseImpl.h"
+
+/*
+ * Shared Body
+ * */
+
+llc::SAWSharedBody::~SAWSharedBody(){
+  for(Segment & segment : _segments)
+    segment.buffer->release();
+}
+
+size_t llc::SAWSharedBody::_segmentAt(size_t & offset) const {
+  size_t index = 0;
+  while(index < _segments.size() && offset >= _segments[index].length){
+    offset -= _segments[index].length;
+    ++index;
+  }
+  return index;
+}
+
+void llc::SAWSharedBody::_wake(){
+  if(_waiting.empty())
+    return;
+  // readers may subscribe again, or go away, while the others are resumed
+  retain();
+  std::vector<SAWServerResponse *> waking;
+  waking.swap(_waiting);
+  std::vector<SAWServerResponse *> * outer = _waking;
+  _waking = &waking;
+  while(!waking.empty()){
+    SAWServerResponse * response = waking.back();
+    waking.pop_back();
+    response->resume();
+  }
+  _waking = outer;
+  release();
+}
+
+void llc::SAWSharedBody::start(int code, const String & contentType, const LinkedList<AsyncWebHeader *> & headers){
+  if(_started)
+    return;
+  _code = code;
+  _contentType = contentType;
+  for(const auto & header : headers)
+    // every reader adds its own
+    if(!header->name().equalsIgnoreCase("Connection"))
+      _headers.emplace_back(header->name(), header->value());
+  _started = true;
+  _wake();
+}
+
+void llc::SAWSharedBody::append(const uint8_t * data, size_t len){
+  if(!len || _finished || _failed)
+    return;
+  while(len){
+    Segment * last = _segments.empty() ? NULL : &_segments.back();
+    if(!last || last->shared || last->length == last->buffer->length()){
+      SAWSharedBuffer * block = SAWSharedBuffer::create(std::max<size_t>(len, SAW_RESPONSE_STREAM_BLOCK));
+      if(!block){
+        fail();
+        return;
+      }
+      _segments.push_back({block, 0, false});
+      last = &_segments.back();
+    }
+    // readers only see bytes below length, so the block can be filled while lwIP sends from its start
+    const size_t chunk = std::min(len, last->buffer->length() - last->length);
+    memcpy(last->buffer->data() + last->length, data, chunk);
+    last->length += chunk;
+    _length += chunk;
+    data += chunk;
+    len -= chunk;
+  }
+  _wake();
+}
+
+void llc::SAWSharedBody::append(SAWSharedBuffer * buffer, size_t len){
+  if(!len || _finished || _failed){
+    buffer->release();
+    return;
+  }
+  _segments.push_back({buffer, len, true});
+  _length += len;
+  _wake();
+}
+
+void llc::SAWSharedBody::finish(){
+  if(_finished || _failed)
+    return;
+  _finished = true;
+  retain();
+  SAWSingleFlight::Instance()._land(this);
+  _wake();
+  release();
+}
+
+void llc::SAWSharedBody::fail(){
+  if(_finished || _failed)
+    return;
+  if(_started){
+    _failed = true;
+  } else {
+    _code = 503; // Service Unavailable
+    _started = true;
+    _finished = true;
+  }
+  retain();
+  SAWSingleFlight::Instance()._land(this);
+  _wake();
+  release();
+}
+
+size_t llc::SAWSharedBody::view(size_t offset, const uint8_t *& data) const {
+  const size_t index = _segmentAt(offset);
+  if(index == _segments.size())
+    return 0;
+  data = _segments[index].buffer->data() + offset;
+  return _segments[index].length - offset;
+}
+
+size_t llc::SAWSharedBody::read(size_t offset, uint8_t * buf, size_t len) const {
+  size_t index = _segmentAt(offset);
+  size_t read = 0;
+  while(read < len && index < _segments.size()){
+    const size_t chunk = std::min(len - read, _segments[index].length - offset);
+    memcpy(buf + read, _segments[index].buffer->data() + offset, chunk);
+    read += chunk;
+    offset = 0;
+    ++index;
+  }
+  return read;
+}
+
+void llc::SAWSharedBody::subscribe(SAWServerResponse * response){
+  for(SAWServerResponse * waiting : _waiting)
+    if(waiting == response)
+      return;
+  _waiting.push_back(response);
+}
+
+void llc::SAWSharedBody::unsubscribe(SAWServerResponse * response){
+  for(std::vector<SAWServerResponse *> * list : {&_waiting, _waking}){
+    if(!list)
+      continue;
+    for(size_t i = list->size(); i--; )
+      if((*list)[i] == response)
+        list->erase(list->begin() + i);
+  }
+}
+
+/*
+ * Single Flight
+ * */
+
+bool llc::SAWSingleFlight::join(SAWServerRequest * request, const SAWCachePolicy & policy){
+  if(request->method() != HTTP_GET)
+    return false;
+  String key = policy.key(request);
+  SAWSharedBody * body = NULL;
+  {
+    AsyncWebLockGuard l(_lock);
+    for(SAWSharedBody * flight : _flights){
+      if(flight->key() == key){
+        body = flight->retain();
+        break;
+      }
+    }
+    if(!body){
+      SAWSharedBody * lead = new (std::nothrow) SAWSharedBody(key);
+      if(!lead)
+        return false;
+      _flights.push_back(lead->retain());
+      request->_flight = lead;
+      return false;
+    }
+  }
+  // the leader stores the response in the cache for both
+  request->_cachePolicy = NULL;
+  request->send(new AsyncSharedBodyResponse(body));
+  return true;
+}
+
+void llc::SAWSingleFlight::_lead(SAWSharedBody * body, SAWServerResponse * response){
+  SAWSharedBuffer * snapshot = NULL;
+  if(response && response->_sourceValid()){
+    snapshot = response->_snapshot();
+    // otherwise the bytes are copied while the response produces them
+    if(snapshot || response->_teeInto(body)){
+      body->start(response->_code, response->_contentType, response->_headers);
+      if(snapshot){
+        body->append(snapshot, snapshot->length());
+        body->finish();
+      }
+      body->release();
+      return;
+    }
+  }
+  body->fail();
+  body->release();
+}
+
+void llc::SAWSingleFlight::_land(SAWSharedBody * body){
+  AsyncWebLockGuard l(_lock);
+  for(size_t i = 0; i < _flights.size(); ++i){
+    if(_flights[i] == body){
+      _flights.erase(_flights.begin() + i);
+      body->release();
+      return;
+    }
+  }
+}
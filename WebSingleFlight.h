@@ -0,0 +1,113 @@
+#include "llc_array_pod.h"
+
+#include "AsyncWebSynchronization.h"
+
+#include <atomic>
+#include <vector>
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBSINGLEFLIGHT_H_
+#define ASYNCWEBSINGLEFLIGHT_H_
+
+namespace llc
+{
+    class SAWSharedBuffer;
+    class SAWCachePolicy;
+
+    // Status, headers and body of one response while it is produced, shared by every request that asked for the same
+    // thing meanwhile. The body grows in SAWSharedBuffer blocks that stay in place until the last reader is gone, so
+    // readers send straight from them. Used under the server's request lock, like the responses themselves.
+    class SAWSharedBody {
+        struct Segment {
+            SAWSharedBuffer     * buffer;
+            size_t              length;                 // bytes used, only the last block fills up
+            bool                shared;                 // taken over from a response, never written to
+        };
+        std::atomic<uint32_t>   _refs;
+        String                  _key;
+        std::vector<Segment>    _segments               = {};
+        size_t                  _length                 = {};
+        int                     _code                   = {};
+        String                  _contentType            = {};
+        std::vector<AsyncWebHeader> _headers            = {};
+        bool                    _started                = {};
+        bool                    _finished               = {};
+        bool                    _failed                 = {};
+        std::vector<SAWServerResponse *>    _waiting    = {};   // readers that ran out of bytes
+        std::vector<SAWServerResponse *>    * _waking   = {};   // the ones _wake() has not reached yet
+        size_t                  _segmentAt              (size_t & offset)   const;
+        void                    _wake                   ();
+                                ~SAWSharedBody          ();
+    public:                     SAWSharedBody           (const String & key)    : _refs{1}, _key{key} {}
+                                SAWSharedBody           (const SAWSharedBody &) = delete;
+        SAWSharedBody &         operator=               (const SAWSharedBody &) = delete;
+        inline  SAWSharedBody * retain                  ()                      { _refs.fetch_add(1, std::memory_order_relaxed); return this; }
+        inline  void            release                 ()                      { if(1 == _refs.fetch_sub(1, std::memory_order_acq_rel)) delete this; }
+
+        // Producer side
+        void                    start                   (int code, const String & contentType, const LinkedList<AsyncWebHeader *> & headers);
+        void                    append                  (const uint8_t * data, size_t len);
+        // Takes over one reference, the first len bytes of buffer become the next part of the body
+        void                    append                  (SAWSharedBuffer * buffer, size_t len);
+        void                    finish                  ();
+        // Readers get a 503 when the producer had not started, otherwise they are cut off
+        void                    fail                    ();
+
+        // Reader side
+        inline  const String &  key                     ()          const       { return _key; }
+        inline  bool            started                 ()          const       { return _started; }
+        inline  bool            finished                ()          const       { return _finished; }
+        inline  bool            failed                  ()          const       { return _failed; }
+        inline  int             code                    ()          const       { return _code; }
+        inline  const String &  contentType             ()          const       { return _contentType; }
+        inline  const std::vector<AsyncWebHeader> & headers ()      const       { return _headers; }
+        inline  size_t          length                  ()          const       { return _length; }
+        // Contiguous bytes at offset, 0 when the producer has not got that far yet
+        size_t                  view                    (size_t offset, const uint8_t *& data)  const;
+        size_t                  read                    (size_t offset, uint8_t * buf, size_t len)  const;
+        // response->resume() once the status, more bytes or the end are there
+        void                    subscribe               (SAWServerResponse * response);
+        void                    unsubscribe             (SAWServerResponse * response);
+    };
+
+    // Responses being generated for routes in single-flight mode, by SAWCachePolicy key
+    class SAWSingleFlight {
+        std::vector<SAWSharedBody *>    _flights        = {};
+        AsyncWebLock            _lock;
+                                SAWSingleFlight         ()  = default;
+    public:
+                                SAWSingleFlight         (const SAWSingleFlight &) = delete;
+        SAWSingleFlight &       operator=               (const SAWSingleFlight &) = delete;
+        static SAWSingleFlight& Instance                ()                  { static SAWSingleFlight instance; return instance; }
+
+        // Attaches the request to the response in flight for its key and returns true. Otherwise the request becomes
+        // the one generating it, and identical requests attach to it until its body is complete.
+        bool                    join                    (SAWServerRequest * request, const SAWCachePolicy & policy);
+        // From SAWServerRequest::send() and the destructor of a leading request, response NULL when none was sent.
+        // Takes over the request's reference of body.
+        void                    _lead                   (SAWSharedBody * body, SAWServerResponse * response);
+        // From SAWSharedBody once it finished or failed, later requests start a new flight
+        void                    _land                   (SAWSharedBody * body);
+    };
+} // namespace
+
+#endif // ASYNCWEBSINGLEFLIGHT_H_
@@ -0,0 +1,60 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebSocketFrame.h"
+
+#include <string.h>
+
+uint8_t llc::SAWFrameDecoder::headerSize(const uint8_t * header, uint8_t have){
+  if(have < 2)
+    return 2;
+  const uint8_t len = header[1] & 0x7F;
+  return 2 + (len == 126 ? 2 : (len == 127 ? 8 : 0)) + ((header[1] & 0x80) ? 4 : 0);
+}
+
+bool llc::SAWFrameDecoder::_readHeader(uint8_t *& data, size_t & len, SAWFrameHeader & header){
+  while(len && _headerLen < headerSize(_header, _headerLen)){
+    _header[_headerLen++] = *data++;
+    --len;
+  }
+  if(_headerLen < headerSize(_header, _headerLen))
+    return false;
+  const uint8_t * h = _header;
+  _headerLen = 0;
+  header.final = (h[0] & 0x80) != 0;
+  // RSV1 marks the first frame of a compressed message
+  header.rsv1 = (h[0] & 0x40) != 0;
+  header.opcode = h[0] & 0x0F;
+  header.masked = (h[1] & 0x80) != 0;
+  header.len = h[1] & 0x7F;
+  h += 2;
+  if(header.len == 126){
+    header.len = (uint16_t)(h[0]) << 8 | h[1];
+    h += 2;
+  } else if(header.len == 127){
+    header.len = 0;
+    for(uint8_t i = 0; i < 8; ++i)
+      header.len = header.len << 8 | h[i];
+    h += 8;
+  }
+  if(header.masked)
+    memcpy(header.mask, h, 4);
+  return true;
+}
@@ -0,0 +1,85 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBSOCKETFRAME_H_
+#define ASYNCWEBSOCKETFRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+namespace llc
+{
+    // Frame header fields, RFC 6455 section 5.2
+    struct SAWFrameHeader {
+        uint64_t                len                     = {};
+        uint8_t                 mask    [4]             = {};
+        uint8_t                 opcode                  = {};
+        bool                    final                   = {};
+        bool                    rsv1                    = {};
+        bool                    masked                  = {};
+    };
+
+    // Splits the input of a WebSocket into frame headers and payload however TCP segmented it. A header that spans
+    // segments is collected here, payload is handed on in place. decode() calls on its handler
+    //   bool _frameHeader  (const SAWFrameHeader & header)              once the header of a frame is complete
+    //   bool _framePayload (uint8_t * data, size_t len, bool last)      per piece, once with len 0 for an empty frame
+    // and stops as soon as one returns false, e.g. on a protocol error.
+    class SAWFrameDecoder {
+        uint8_t                 _header [14]            = {};
+        uint8_t                 _headerLen              = {};
+        bool                    _inPayload              = {};   // the header is complete, _rest bytes of payload follow
+        uint64_t                _rest                   = {};
+        // Takes header bytes off data, true once the header is complete
+        bool                    _readHeader             (uint8_t *& data, size_t & len, SAWFrameHeader & header);
+    public:
+        // 2 bytes, then the extended length and mask key they announce
+        static  uint8_t         headerSize              (const uint8_t * header, uint8_t have);
+        template<typename Handler>
+        bool                    decode                  (Handler & handler, uint8_t * data, size_t len);
+    };
+
+    template<typename Handler>
+    bool SAWFrameDecoder::decode(Handler & handler, uint8_t * data, size_t len){
+        while(len){
+            if(!_inPayload){
+                SAWFrameHeader header;
+                if(!_readHeader(data, len, header))
+                    return true;    // the rest of the header comes with the next segment
+                if(!handler._frameHeader(header))
+                    return false;
+                _rest = header.len;
+                _inPayload = true;
+            }
+            // zero when the frame is empty, it ends all the same
+            const size_t piece = (size_t)std::min<uint64_t>(_rest, len);
+            _rest -= piece;
+            _inPayload = _rest != 0;
+            if(!handler._framePayload(data, piece, !_inPayload))
+                return false;
+            data += piece;
+            len -= piece;
+        }
+        return true;
+    }
+} // namespace
+
+#endif // ASYNCWEBSOCKETFRAME_H_
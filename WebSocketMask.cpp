@@ -0,0 +1,85 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebSocketMask.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   include <arm_neon.h>
+#endif
+
+namespace {
+  // Machine word of the masking stage: 32 bits on the Xtensa and RISC-V cores, 64 bits on 64-bit hosts.
+  // may_alias: it is read and written over the byte buffer.
+  typedef uintptr_t __attribute__((__may_alias__)) MaskWord;
+
+  inline MaskWord repeatKey(const uint8_t (&key)[4]){
+    MaskWord word;
+    for(size_t i = 0; i < sizeof(MaskWord); i += 4)
+      memcpy((uint8_t *)&word + i, key, 4);
+    return word;
+  }
+} // namespace
+
+void llc::applyWebSocketMask(uint8_t * data, size_t len, const uint8_t (&mask)[4], uint64_t offset){
+  if(!len)
+    return;
+  // key as seen from data[0]
+  uint8_t key[4];
+  for(uint8_t i = 0; i < 4; ++i)
+    key[i] = mask[(offset + i) & 3];
+
+  // byte by byte until data is word aligned, the ESP8266 traps on unaligned word access
+  size_t head = (sizeof(MaskWord) - ((uintptr_t)data & (sizeof(MaskWord) - 1))) & (sizeof(MaskWord) - 1);
+  if(head > len)
+    head = len;
+  for(size_t i = 0; i < head; ++i)
+    data[i] ^= key[i & 3];
+  data += head;
+  len -= head;
+  if(head & 3){
+    const uint8_t rotated[4] = {key[head & 3], key[(head + 1) & 3], key[(head + 2) & 3], key[(head + 3) & 3]};
+    memcpy(key, rotated, 4);
+  }
+
+  // the key repeats every 4 bytes, so wider strides keep it in phase
+#if defined(__SSE2__)
+  uint32_t key32;
+  memcpy(&key32, key, 4);
+  const __m128i wide = _mm_set1_epi32((int)key32);
+  for(; len >= 16; data += 16, len -= 16)
+    _mm_storeu_si128((__m128i *)data, _mm_xor_si128(_mm_loadu_si128((const __m128i *)data), wide));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint32_t key32;
+  memcpy(&key32, key, 4);
+  const uint8x16_t wide = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+  for(; len >= 16; data += 16, len -= 16)
+    vst1q_u8(data, veorq_u8(vld1q_u8(data), wide));
+#endif
+  const MaskWord word = repeatKey(key);
+  for(; len >= sizeof(MaskWord); data += sizeof(MaskWord), len -= sizeof(MaskWord))
+    *(MaskWord *)data ^= word;
+
+  for(size_t i = 0; i < len; ++i)
+    data[i] ^= key[i & 3];
+}
@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBSOCKETMASK_H_
+#define ASYNCWEBSOCKETMASK_H_
+
+namespace llc
+{
+    // XORs len bytes of a WebSocket payload with its masking key in place (RFC 6455 5.3). offset is the position of data[0]
+    // within the frame payload, so a frame that arrives in several TCP segments is unmasked piece by piece.
+    // Works a machine word at a time once data is aligned, 16 bytes at a time with SSE2 or NEON on host builds.
+    void                        applyWebSocketMask      (uint8_t * data, size_t len, const uint8_t (&mask)[4], uint64_t offset = 0);
+} // namespace
+
+#endif // ASYNCWEBSOCKETMASK_H_
@@ -0,0 +1,228 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebResponseImpl.h"
+
+namespace {
+  // Not memchr, the ESP8266 core does not link it by default
+  const uint8_t * findPlaceholder(const uint8_t * p, const uint8_t * end){
+    for(; p < end; ++p)
+      if(*p == llc::TEMPLATE_PLACEHOLDER)
+        return p;
+    return NULL;
+  }
+} // namespace
+
+/*
+ * Compiled Template
+ * */
+
+llc::SAWCompiledTemplate::~SAWCompiledTemplate(){
+  if(_owned)
+    _owned->release();
+}
+
+llc::SAWCompiledTemplate * llc::SAWCompiledTemplate::compile(SAWSharedBuffer * source){
+  if(!source)
+    return NULL;
+  SAWCompiledTemplate * compiled = new (std::nothrow) SAWCompiledTemplate(source->data(), source);
+  if(!compiled){
+    source->release();
+    return NULL;
+  }
+  compiled->_parse(source->length());
+  return compiled;
+}
+
+llc::SAWCompiledTemplate * llc::SAWCompiledTemplate::compileMapped(const uint8_t * source, size_t len){
+  SAWCompiledTemplate * compiled = new (std::nothrow) SAWCompiledTemplate(source, NULL);
+  if(compiled)
+    compiled->_parse(len);
+  return compiled;
+}
+
+void llc::SAWCompiledTemplate::_parse(size_t len){
+  const uint8_t * const begin = _source;
+  const uint8_t * const end = _source + len;
+  const uint8_t * literal = begin;
+  const uint8_t * p = begin;
+  auto addLiteral = [&](const uint8_t * until){
+    if(until > literal)
+      _segments.push_back({uint32_t(literal - begin), uint32_t(until - literal), String()});
+  };
+  while(p < end){
+    const uint8_t * open = findPlaceholder(p, end);
+    if(!open)
+      break;
+    const size_t window = std::min<size_t>(end - open - 1, TEMPLATE_PARAM_NAME_LENGTH + 1);
+    const uint8_t * close = findPlaceholder(open + 1, open + 1 + window);
+    if(!close){
+      p = open + 1;
+      continue;
+    }
+    if(close == open + 1){
+      // "%%" keeps the first percent sign as part of the literal run and drops the second
+      addLiteral(close);
+    } else {
+      char name[TEMPLATE_PARAM_NAME_LENGTH + 1];
+      const size_t nameLen = close - open - 1;
+      memcpy(name, open + 1, nameLen);
+      name[nameLen] = 0;
+      addLiteral(open);
+      _segments.push_back({0, 0, String(name)});
+    }
+    literal = p = close + 1;
+  }
+  addLiteral(end);
+  _segments.shrink_to_fit();
+}
+
+/*
+ * Template Cache
+ * */
+
+llc::SAWTemplateCache::~SAWTemplateCache(){
+  clear();
+}
+
+llc::SAWCompiledTemplate * llc::SAWTemplateCache::_find(const String & path, const void * address, size_t size, time_t modified){
+  AsyncWebLockGuard l(_lock);
+  for(size_t i = 0; i < SAW_TEMPLATE_CACHE_ENTRIES && _entries[i].compiled; ++i){
+    Entry & e = _entries[i];
+    if(e.address != address || e.size != size || e.modified != modified || e.path != path)
+      continue;
+    SAWCompiledTemplate * compiled = e.compiled->retain();
+    // move to front
+    Entry hit = e;
+    for(size_t j = i; j; --j)
+      _entries[j] = _entries[j - 1];
+    _entries[0] = hit;
+    return compiled;
+  }
+  return NULL;
+}
+
+void llc::SAWTemplateCache::_insert(const String & path, const void * address, size_t size, time_t modified, SAWCompiledTemplate * compiled){
+  AsyncWebLockGuard l(_lock);
+  Entry & last = _entries[SAW_TEMPLATE_CACHE_ENTRIES - 1];
+  if(last.compiled)
+    last.compiled->release();
+  for(size_t j = SAW_TEMPLATE_CACHE_ENTRIES - 1; j; --j)
+    _entries[j] = _entries[j - 1];
+  Entry & e = _entries[0];
+  e.path = path;
+  e.address = address;
+  e.size = size;
+  e.modified = modified;
+  e.compiled = compiled->retain();
+}
+
+llc::SAWCompiledTemplate * llc::SAWTemplateCache::acquire(fs::File & file, const String & path){
+  const size_t size = file.size();
+  if(!size || size > SAW_TEMPLATE_MAX_SOURCE)
+    return NULL;
+  // SPIFFS keeps no modification time, such a file is only told apart by its size until invalidate() drops it
+  const time_t modified = file.getLastWrite();
+  SAWCompiledTemplate * compiled = _find(path, NULL, size, modified);
+  if(compiled)
+    return compiled;
+
+  SAWSharedBuffer * source = SAWSharedBuffer::create(size);
+  if(!source)
+    return NULL;
+  const size_t start = file.position();
+  if(file.read(source->data(), size) != size){
+    file.seek(start);
+    source->release();
+    return NULL;
+  }
+  compiled = SAWCompiledTemplate::compile(source);
+  if(compiled)
+    _insert(path, NULL, size, modified, compiled);
+  return compiled;
+}
+
+llc::SAWCompiledTemplate * llc::SAWTemplateCache::acquire_P(const uint8_t * content, size_t len){
+  if(!content || !len)
+    return NULL;
+  SAWCompiledTemplate * compiled = _find(String(), content, len, 0);
+  if(compiled)
+    return compiled;
+#ifdef LLC_ESP32
+  // Flash is memory mapped, literal runs are sent straight from it
+  compiled = SAWCompiledTemplate::compileMapped(content, len);
+#else
+  if(len > SAW_TEMPLATE_MAX_SOURCE)
+    return NULL;
+  SAWSharedBuffer * source = SAWSharedBuffer::create(len);
+  if(!source)
+    return NULL;
+  memcpy_P(source->data(), content, len);
+  compiled = SAWCompiledTemplate::compile(source);
+#endif
+  if(compiled)
+    _insert(String(), content, len, 0, compiled);
+  return compiled;
+}
+
+void llc::SAWTemplateCache::invalidate(const String & path){
+  AsyncWebLockGuard l(_lock);
+  size_t kept = 0;
+  for(size_t i = 0; i < SAW_TEMPLATE_CACHE_ENTRIES && _entries[i].compiled; ++i){
+    if(_entries[i].path == path){
+      _entries[i].compiled->release();
+      continue;
+    }
+    if(kept != i)
+      _entries[kept] = _entries[i];
+    ++kept;
+  }
+  for(size_t i = kept; i < SAW_TEMPLATE_CACHE_ENTRIES; ++i)
+    _entries[i] = Entry();
+}
+
+void llc::SAWTemplateCache::clear(){
+  AsyncWebLockGuard l(_lock);
+  for(size_t i = 0; i < SAW_TEMPLATE_CACHE_ENTRIES; ++i){
+    if(_entries[i].compiled)
+      _entries[i].compiled->release();
+    _entries[i] = Entry();
+  }
+}
+
+/*
+ * Template Output
+ * */
+
+size_t llc::SAWTemplateOutput::write(const uint8_t * data, size_t len){
+  if(_length + len > _capacity){
+    size_t capacity = _capacity ? _capacity : 64;
+    while(capacity < _length + len)
+      capacity *= 2;
+    uint8_t * grown = (uint8_t *)realloc(_data, capacity);
+    if(!grown)
+      return 0;
+    _data = grown;
+    _capacity = capacity;
+  }
+  memcpy(_data + _length, data, len);
+  _length += len;
+  return len;
+}
@@ -0,0 +1,132 @@
+#include "llc_array_pod.h"
+
+#include "AsyncWebSynchronization.h"
+#include "FS.h"
+
+#include <atomic>
+#include <vector>
+
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBTEMPLATE_H_
+#define ASYNCWEBTEMPLATE_H_
+
+// How many compiled templates are kept, least recently used ones are dropped first
+#ifndef SAW_TEMPLATE_CACHE_ENTRIES
+#   ifdef LLC_ESP32
+#       define SAW_TEMPLATE_CACHE_ENTRIES 4
+#   else
+#       define SAW_TEMPLATE_CACHE_ENTRIES 2
+#   endif
+#endif
+// Larger template files keep using the scanning path instead of being loaded into RAM
+#ifndef SAW_TEMPLATE_MAX_SOURCE
+#   ifdef LLC_ESP32
+#       define SAW_TEMPLATE_MAX_SOURCE 16384
+#   else
+#       define SAW_TEMPLATE_MAX_SOURCE 4096
+#   endif
+#endif
+
+namespace llc
+{
+    stxp char               TEMPLATE_PLACEHOLDER        = '%';
+    stxp uint8_t            TEMPLATE_PARAM_NAME_LENGTH  = 32;
+
+    class SAWSharedBuffer;
+
+    // A template split once into literal runs of the source and %placeholder% names. "%%" is a literal percent sign,
+    // a '%' without a closing one within TEMPLATE_PARAM_NAME_LENGTH characters is sent as is.
+    class SAWCompiledTemplate {
+    public:
+        struct Segment {
+            uint32_t            offset;                 // into source(), literal runs only
+            uint32_t            length;
+            String              name;                   // empty for literal runs
+        };
+    private:
+        std::atomic<uint32_t>   _refs;
+        SAWSharedBuffer         * _owned                = {};   // NULL when the source is memory mapped flash
+        const uint8_t           * _source               = {};
+        std::vector<Segment>    _segments               = {};
+                                SAWCompiledTemplate     (const uint8_t * source, SAWSharedBuffer * owned)   : _refs{1}, _owned{owned}, _source{source} {}
+                                ~SAWCompiledTemplate    ();
+        void                    _parse                  (size_t len);
+    public:
+        // Takes over one reference of source, the caller owns the first reference of the result
+        static SAWCompiledTemplate* compile             (SAWSharedBuffer * source);
+        // The bytes must stay readable for the lifetime of the template, e.g. PROGMEM on the ESP32
+        static SAWCompiledTemplate* compileMapped       (const uint8_t * source, size_t len);
+
+        inline  const uint8_t * source                  ()                  const   { return _source; }
+        inline  bool            inRam                   ()                  const   { return _owned != NULL; }
+        inline  size_t          segments                ()                  const   { return _segments.size(); }
+        inline  const Segment & segment                 (size_t index)      const   { return _segments[index]; }
+        inline  SAWCompiledTemplate*    retain          ()                          { _refs.fetch_add(1, std::memory_order_relaxed); return this; }
+        inline  void            release                 ()                          { if(1 == _refs.fetch_sub(1, std::memory_order_acq_rel)) delete this; }
+    };
+
+    // Compiled templates keyed by file path, size and modification time, or by PROGMEM address. Where the filesystem
+    // keeps no modification time (SPIFFS) a file rewritten at the same size needs invalidate().
+    class SAWTemplateCache {
+        struct Entry {
+            String              path                    = {};
+            const void          * address               = {};
+            size_t              size                    = {};
+            time_t              modified                = {};
+            SAWCompiledTemplate * compiled              = {};
+        };
+        Entry                   _entries    [SAW_TEMPLATE_CACHE_ENTRIES]    = {};  // most recently used first
+        AsyncWebLock            _lock;
+
+        SAWCompiledTemplate *   _find                   (const String & path, const void * address, size_t size, time_t modified);
+        void                    _insert                 (const String & path, const void * address, size_t size, time_t modified, SAWCompiledTemplate * compiled);
+                                SAWTemplateCache        ()  = default;
+    public:                     ~SAWTemplateCache       ();
+                                SAWTemplateCache        (const SAWTemplateCache &) = delete;
+        SAWTemplateCache &      operator=               (const SAWTemplateCache &) = delete;
+        static SAWTemplateCache&Instance                ()                  { static SAWTemplateCache instance; return instance; }
+
+        // Return a new reference, or NULL when the source is too large or can't be read.
+        // A file is read from its current position only on a miss.
+        SAWCompiledTemplate *   acquire                 (fs::File & file, const String & path);
+        SAWCompiledTemplate *   acquire_P               (const uint8_t * content, size_t len);
+        // Drops the template compiled from path, call it after writing or removing the file
+        void                    invalidate              (const String & path);
+        void                    clear                   ();
+    };
+
+    // Collects one placeholder's output. The storage is kept between placeholders, so rendering stops allocating once it fits the largest value.
+    class SAWTemplateOutput : public Print {
+        uint8_t                 * _data                 = {};
+        size_t                  _capacity               = {};
+        size_t                  _length                 = {};
+    public:                     ~SAWTemplateOutput      ()                  { free(_data); }
+        using   Print           ::write;
+        size_t                  write                   (const uint8_t * data, size_t len);
+        size_t                  write                   (uint8_t data)      { return write(&data, 1); }
+        inline  const uint8_t * data                    ()          const   { return _data; }
+        inline  size_t          length                  ()          const   { return _length; }
+        inline  void            clear                   ()                  { _length = 0; }
+    };
+} // namespace
+
+#endif // ASYNCWEBTEMPLATE_H_
@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+#
+# Asynchronous WebServer library for Espressif MCUs
+#
+# Compresses a web directory (usually data/) into constexpr PROGMEM arrays plus a sorted
+# lookup table that AsyncEmbeddedWebHandler serves without a filesystem.
+#
+#   embed_web_assets.py <data dir> <output header> [--symbol web_assets] [--exclude PATTERN ...]
+#
+# Files already ending in .gz are embedded as-is and served under their name without .gz.
+# Everything else is gzipped when that makes it smaller, otherwise stored raw.
+# The output is only rewritten when its content changes, so incremental builds stay incremental.
+
+import argparse
+import fnmatch
+import gzip
+import hashlib
+import io
+import os
+import sys
+
+MIME_TYPES = (
+    (".html", "text/html"),
+    (".htm", "text/html"),
+    (".css", "text/css"),
+    (".json", "application/json"),
+    (".js", "application/javascript"),
+    (".png", "image/png"),
+    (".gif", "image/gif"),
+    (".jpg", "image/jpeg"),
+    (".ico", "image/x-icon"),
+    (".svg", "image/svg+xml"),
+    (".eot", "font/eot"),
+    (".woff", "font/woff"),
+    (".woff2", "font/woff2"),
+    (".ttf", "font/ttf"),
+    (".xml", "text/xml"),
+    (".pdf", "application/pdf"),
+    (".zip", "application/zip"),
+    (".gz", "application/x-gzip"),
+)
+
+
+def mime_type(path):
+    for ext, mime in MIME_TYPES:
+        if path.endswith(ext):
+            return mime
+    return "text/plain"
+
+
+def read_excludes(root, extra):
+    patterns = list(extra)
+    exclude_file = os.path.join(root, ".exclude.files")
+    if os.path.isfile(exclude_file):
+        with open(exclude_file) as f:
+            patterns += [line.strip() for line in f if line.strip() and not line.startswith("#")]
+    return patterns
+
+
+def excluded(url, patterns):
+    name = url.rsplit("/", 1)[-1]
+    if name.startswith("."):
+        return True
+    return any(fnmatch.fnmatch(url, p) for p in patterns)
+
+
+def gzip_bytes(raw):
+    out = io.BytesIO()
+    with gzip.GzipFile(fileobj=out, mode="wb", compresslevel=9, mtime=0) as gz:
+        gz.write(raw)
+    return out.getvalue()
+
+
+def collect(root, patterns):
+    assets = {}
+    for base, dirs, files in os.walk(root):
+        dirs.sort()
+        for name in sorted(files):
+            full = os.path.join(base, name)
+            url = "/" + os.path.relpath(full, root).replace(os.sep, "/")
+            if excluded(url, patterns):
+                continue
+            with open(full, "rb") as f:
+                raw = f.read()
+            precompressed = url.endswith(".gz")
+            if precompressed:
+                url, body, encoding = url[:-3], raw, "gzip"
+            else:
+                packed = gzip_bytes(raw)
+                body, encoding = (packed, "gzip") if len(packed) < len(raw) else (raw, "")
+            # foo.js.gz wins over foo.js whichever comes first, same as the filesystem handler
+            if url in assets and assets[url]["precompressed"] and not precompressed:
+                continue
+            assets[url] = {
+                "body": body,
+                "encoding": encoding,
+                "mime": mime_type(url),
+                "etag": '"%s"' % hashlib.sha1(body).hexdigest()[:16],
+                "precompressed": precompressed,
+            }
+    return [dict(url=url, **assets[url]) for url in sorted(assets)]
+
+
+def c_identifier(url, index):
+    ident = "".join(c if c.isalnum() else "_" for c in url.strip("/"))
+    return "_a%u_%s" % (index, ident[:40])
+
+
+def render(assets, symbol, source):
+    lines = [
+        "// Generated by tools/embed_web_assets.py from %s - do not edit." % source,
+        "#ifndef %s_H_" % symbol.upper(),
+        "#define %s_H_" % symbol.upper(),
+        "",
+        "#include <ESPAsyncWebServer.h>",
+        "",
+        "namespace %s" % symbol,
+        "{",
+    ]
+    for i, asset in enumerate(assets):
+        body = asset["body"]
+        asset["ident"] = c_identifier(asset["url"], i)
+        lines.append("    // %s, %u bytes%s" % (asset["url"], len(body), ", gzip" if asset["encoding"] else ""))
+        lines.append("    alignas(4) static constexpr uint8_t %s[] PROGMEM = {" % asset["ident"])
+        for off in range(0, len(body), 16):
+            lines.append("        " + ", ".join("0x%02X" % b for b in body[off:off + 16]) + ",")
+        lines.append("    };")
+    lines.append("")
+    lines.append("    // Sorted by path, AsyncEmbeddedWebHandler looks entries up with a binary search.")
+    lines.append("    static constexpr llc::SAWEmbeddedAsset assets[] = {")
+    for asset in assets:
+        lines.append('        {"%s", %s, sizeof(%s), "%s", "%s", "%s"},' % (
+            asset["url"], asset["ident"], asset["ident"], asset["mime"],
+            asset["etag"].replace('"', '\\"'), asset["encoding"]))
+    lines.append("    };")
+    lines.append("    static constexpr size_t count = sizeof(assets) / sizeof(assets[0]);")
+    lines.append("} // namespace")
+    lines.append("")
+    lines.append("#endif // %s_H_" % symbol.upper())
+    return "\n".join(lines) + "\n"
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("data_dir")
+    parser.add_argument("output")
+    parser.add_argument("--symbol", default="web_assets", help="namespace of the generated table")
+    parser.add_argument("--exclude", action="append", default=[], help="glob of URLs to skip")
+    args = parser.parse_args(argv)
+
+    assets = collect(args.data_dir, read_excludes(args.data_dir, args.exclude))
+    if not assets:
+        sys.stderr.write("embed_web_assets: no files found in %s\n" % args.data_dir)
+        return 1
+    text = render(assets, args.symbol, os.path.basename(os.path.normpath(args.data_dir)))
+
+    if os.path.isfile(args.output):
+        with open(args.output) as f:
+            if f.read() == text:
+                return 0
+    os.makedirs(os.path.dirname(os.path.abspath(args.output)), exist_ok=True)
+    with open(args.output, "w") as f:
+        f.write(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
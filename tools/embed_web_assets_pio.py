@@ -0,0 +1,33 @@
+# PlatformIO pre-build hook for tools/embed_web_assets.py.
+#
+#   [env:myboard]
+#   extra_scripts = pre:.pio/libdeps/myboard/ESP Async WebServer/tools/embed_web_assets_pio.py
+#   custom_web_assets_dir = data
+#   custom_web_assets_header = include/WebAssets.h
+#
+# The header is regenerated before every build and only rewritten when the web directory changed.
+
+import inspect
+import os
+import subprocess
+import sys
+
+Import("env")  # noqa: F821 - injected by PlatformIO
+
+project_dir = env.subst("$PROJECT_DIR")  # noqa: F821
+data_dir = env.GetProjectOption("custom_web_assets_dir", "data")  # noqa: F821
+header = env.GetProjectOption("custom_web_assets_header", "include/WebAssets.h")  # noqa: F821
+symbol = env.GetProjectOption("custom_web_assets_symbol", "web_assets")  # noqa: F821
+
+# SCons runs extra scripts through exec(), so __file__ is not available here.
+script_dir = os.path.dirname(os.path.realpath(inspect.getframeinfo(inspect.currentframe()).filename))
+generator = os.path.join(script_dir, "embed_web_assets.py")
+result = subprocess.call([
+    sys.executable, generator,
+    os.path.join(project_dir, data_dir),
+    os.path.join(project_dir, header),
+    "--symbol", symbol,
+])
+if result:
+    sys.stderr.write("embed_web_assets: generating %s failed\n" % header)
+    env.Exit(result)  # noqa: F821
@@ -0,0 +1,82 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebRingQueue.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+
+// Runs SAWRingQueue and std::deque through the same random pushes, pops and erases, the queue wrapping around its
+// array many times, and compares them after every step.
+
+namespace {
+  template<size_t N>
+  bool compare(unsigned seed){
+    llc::SAWRingQueue<int *, N> queue;
+    std::deque<int *> reference;
+    srand(seed);
+    for(int i = 0; i < 100000; ++i){
+      const int op = rand() % 8;
+      if(op < 4){
+        int * item = (int *)(intptr_t)(i + 1);
+        const bool queued = queue.push_back(item);
+        if(queued != (reference.size() < N)){
+          printf("push %d\n", i);
+          return false;
+        }
+        if(queued)
+          reference.push_back(item);
+      } else if(op < 7 && !reference.empty()){
+        if(queue.pop_front() != reference.front()){
+          printf("pop %d\n", i);
+          return false;
+        }
+        reference.pop_front();
+      } else if(!reference.empty()){
+        const size_t index = rand() % reference.size();
+        queue.erase(index);
+        reference.erase(reference.begin() + index);
+      }
+      if(queue.size() != reference.size() || queue.empty() != reference.empty() || queue.full() != (reference.size() == N)){
+        printf("size %d\n", i);
+        return false;
+      }
+      for(size_t k = 0; k < reference.size(); ++k)
+        if(queue[k] != reference[k]){
+          printf("item %zu at %d\n", k, i);
+          return false;
+        }
+      if(!reference.empty() && (queue.front() != reference.front() || queue.back() != reference.back())){
+        printf("ends %d\n", i);
+        return false;
+      }
+    }
+    return true;
+  }
+} // namespace
+
+int main(){
+  if(!compare<1>(1) || !compare<5>(2) || !compare<16>(3))
+    return 1;
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+// The part of the Arduino core the host builds use
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
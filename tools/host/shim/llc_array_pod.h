@@ -0,0 +1,8 @@
+// Host stand-in for the firmware side llc_array_pod.h: only what the sources built by tools/host use
+#ifndef LLC_ARRAY_POD_H_HOST_SHIM
+#define LLC_ARRAY_POD_H_HOST_SHIM
+
+#define stxp    static constexpr
+#define inxp    inline constexpr
+
+#endif // LLC_ARRAY_POD_H_HOST_SHIM
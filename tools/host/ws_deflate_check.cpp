@@ -0,0 +1,205 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebDeflate.h"
+
+#include <zlib.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Checks SAWDeflate and SAWInflate against zlib: response bodies in every format SAWDeflate writes, permessage-deflate
+// messages both ways with and without context takeover, and inflating oversized, empty and corrupt input.
+
+namespace {
+  const uint8_t SYNC_TAIL[4] = {0x00, 0x00, 0xff, 0xff};
+
+  // JSON-like text with some noise, repetitive enough for matches to be found
+  std::string message(size_t len){
+    static const char sample[] = "{\"temp\":12.5,\"id\":";
+    std::string m;
+    m.reserve(len);
+    for(size_t k = 0; k < len; ++k)
+      m += (rand() % 4 == 0) ? char('a' + rand() % 26) : sample[k % (sizeof(sample) - 1)];
+    return m;
+  }
+
+  // One body written in random pieces, read back by zlib
+  bool body(llc::SAWDeflate::Format format, int zlibWindowBits, const std::string & m){
+    llc::SAWDeflate deflate;
+    if(!deflate.begin(format))
+      return false;
+    std::vector<uint8_t> c(m.size() * 9 / 8 + 12 * (m.size() + 1) + llc::SAWDeflate::FINISH_MAX);
+    size_t cl = 0;
+    for(size_t pos = 0; pos < m.size(); ){
+      const size_t len = std::min<size_t>(m.size() - pos, 1 + rand() % 1500);
+      cl += deflate.write((const uint8_t *)m.data() + pos, len, c.data() + cl);
+      pos += len;
+    }
+    cl += deflate.finish(c.data() + cl);
+
+    z_stream z{};
+    inflateInit2(&z, zlibWindowBits);
+    std::vector<uint8_t> o(m.size() + 16);
+    z.next_in = c.data();
+    z.avail_in = cl;
+    z.next_out = o.data();
+    z.avail_out = o.size();
+    const int zr = inflate(&z, Z_FINISH);
+    const size_t ol = o.size() - z.avail_out;
+    inflateEnd(&z);
+    return zr == Z_STREAM_END && z.avail_in == 0 && ol == m.size() && !memcmp(o.data(), m.data(), ol);
+  }
+
+  bool inflateTo(llc::SAWInflate & inflater, std::vector<uint8_t> c, const std::string & m){
+    c.insert(c.end(), SYNC_TAIL, SYNC_TAIL + 4);
+    uint8_t * out;
+    size_t outLen;
+    if(inflater.inflate(c.data(), c.size(), 100000, out, outLen) != llc::SAWInflate::DONE)
+      return false;
+    const bool same = outLen == m.size() && !memcmp(out, m.data(), outLen);
+    free(out);
+    return same;
+  }
+
+  // zlib sends, SAWInflate receives
+  bool fromZlib(int level, bool keepContext){
+    z_stream z{};
+    deflateInit2(&z, level, Z_DEFLATED, -10, 8, Z_DEFAULT_STRATEGY);
+    llc::SAWInflate inflater;
+    inflater.begin(10, keepContext);
+    bool ok = true;
+    for(int i = 0; ok && i < 300; ++i){
+      const std::string m = message(rand() % 3000);
+      if(!keepContext)
+        deflateReset(&z);
+      std::vector<uint8_t> c(m.size() * 2 + 64);
+      z.next_in = (Bytef *)m.data();
+      z.avail_in = m.size();
+      z.next_out = c.data();
+      z.avail_out = c.size();
+      deflate(&z, Z_SYNC_FLUSH);
+      c.resize(c.size() - z.avail_out - 4);
+      ok = inflateTo(inflater, c, m);
+      if(!ok)
+        printf("zlib level %d, context %d: message %d\n", level, keepContext, i);
+    }
+    deflateEnd(&z);
+    return ok;
+  }
+
+  // SAWDeflate sends, zlib and SAWInflate receive
+  bool toZlib(bool keepContext){
+    llc::SAWDeflate deflater;
+    deflater.begin(llc::SAWDeflate::RAW_SYNC, 10, 3);
+    z_stream z{};
+    inflateInit2(&z, -15);
+    llc::SAWInflate inflater;
+    inflater.begin(10, keepContext);
+    bool ok = true;
+    for(int i = 0; ok && i < 300; ++i){
+      const std::string m = message(rand() % 3000);
+      if(!keepContext)
+        deflater.resetWindow();
+      std::vector<uint8_t> c(m.size() * 9 / 8 + 12 + llc::SAWDeflate::FINISH_MAX);
+      size_t cl = deflater.write((const uint8_t *)m.data(), m.size(), c.data());
+      cl += deflater.flush(c.data() + cl);
+      c.resize(cl);
+
+      std::vector<uint8_t> withTail(c);
+      withTail.insert(withTail.end(), SYNC_TAIL, SYNC_TAIL + 4);
+      std::vector<uint8_t> o(m.size() + 16);
+      z.next_in = withTail.data();
+      z.avail_in = withTail.size();
+      z.next_out = o.data();
+      z.avail_out = o.size();
+      const int zr = inflate(&z, Z_SYNC_FLUSH);
+      const size_t ol = o.size() - z.avail_out;
+      ok = (zr == Z_OK || zr == Z_BUF_ERROR) && ol == m.size() && !memcmp(o.data(), m.data(), ol) && inflateTo(inflater, c, m);
+      if(!ok)
+        printf("SAWDeflate, context %d: message %d\n", keepContext, i);
+    }
+    inflateEnd(&z);
+    return ok;
+  }
+
+  bool limits(){
+    llc::SAWInflate inflater;
+    inflater.begin(10, false);
+    uint8_t * out;
+    size_t outLen;
+
+    const std::string m(5000, 'x');
+    std::vector<uint8_t> c(compressBound(m.size()) + 4);
+    z_stream z{};
+    deflateInit2(&z, 6, Z_DEFLATED, -10, 8, Z_DEFAULT_STRATEGY);
+    z.next_in = (Bytef *)m.data();
+    z.avail_in = m.size();
+    z.next_out = c.data();
+    z.avail_out = c.size();
+    deflate(&z, Z_SYNC_FLUSH);
+    c.resize(c.size() - z.avail_out);
+    deflateEnd(&z);
+    if(inflater.inflate(c.data(), c.size(), m.size() - 1, out, outLen) != llc::SAWInflate::TOO_LARGE){
+      printf("message over the limit\n");
+      return false;
+    }
+    const uint8_t empty[] = {0x00, 0x00, 0x00, 0xff, 0xff};
+    if(inflater.inflate(empty, sizeof(empty), 10, out, outLen) != llc::SAWInflate::DONE || outLen){
+      printf("empty message\n");
+      return false;
+    }
+    free(out);
+    // garbage must be refused or decoded, never read or written out of bounds
+    for(int i = 0; i < 20000; ++i){
+      std::vector<uint8_t> g(rand() % 200);
+      for(uint8_t & b : g)
+        b = rand();
+      if(inflater.inflate(g.data(), g.size(), 4096, out, outLen) == llc::SAWInflate::DONE)
+        free(out);
+    }
+    return true;
+  }
+} // namespace
+
+int main(){
+  srand(1);
+  for(int i = 0; i < 200; ++i){
+    const std::string m = message(rand() % 20000);
+    if(!body(llc::SAWDeflate::RAW, -15, m) || !body(llc::SAWDeflate::ZLIB, 15, m) || !body(llc::SAWDeflate::GZIP, 15 + 16, m)){
+      printf("response body %d of %zu bytes\n", i, m.size());
+      return 1;
+    }
+  }
+  for(int level : {1, 6, 9})
+    for(bool keepContext : {false, true})
+      if(!fromZlib(level, keepContext))
+        return 1;
+  for(bool keepContext : {false, true})
+    if(!toZlib(keepContext))
+      return 1;
+  if(!limits())
+    return 1;
+  printf("ok\n");
+  return 0;
+}
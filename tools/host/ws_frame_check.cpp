@@ -0,0 +1,187 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebSocketFrame.h"
+#include "WebSocketMask.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Feeds a run of frames to SAWFrameDecoder cut into segments every way that matters: at each single position, one
+// byte at a time and at random. Every segment is a heap block of its own size, so the sanitizers built into this
+// check catch a read past a segment. The frames, unmasked payloads and last flags must come out the same each time.
+
+namespace {
+  struct Frame {
+    llc::SAWFrameHeader   header;
+    std::string           payload;
+    size_t                lasts   = 0;
+  };
+
+  struct Recorder {
+    std::vector<Frame>    frames;
+    uint64_t              index   = 0;
+    bool                  failed  = false;
+    size_t                stopAt  = SIZE_MAX;   // _frameHeader() refuses this frame
+
+    bool _frameHeader(const llc::SAWFrameHeader & header){
+      if(frames.size() == stopAt)
+        return false;
+      if(!frames.empty() && frames.back().lasts != 1)
+        failed = true;
+      frames.push_back(Frame{header, std::string(), 0});
+      index = 0;
+      return true;
+    }
+    bool _framePayload(uint8_t * data, size_t len, bool last){
+      if(frames.empty() || frames.back().lasts || index + len > frames.back().header.len || last != (index + len == frames.back().header.len)){
+        failed = true;
+        return false;
+      }
+      Frame & frame = frames.back();
+      if(frame.header.masked)
+        llc::applyWebSocketMask(data, len, frame.header.mask, index);
+      frame.payload.append((const char *)data, len);
+      index += len;
+      frame.lasts += last;
+      return true;
+    }
+  };
+
+  void appendFrame(std::vector<uint8_t> & stream, uint8_t first, const std::string & payload, bool masked){
+    const uint8_t key[4] = {0x11, 0x9e, 0x42, 0xc7};
+    stream.push_back(first);
+    const uint8_t maskBit = masked ? 0x80 : 0;
+    if(payload.size() < 126)
+      stream.push_back(maskBit | uint8_t(payload.size()));
+    else if(payload.size() < 65536){
+      stream.push_back(maskBit | 126);
+      stream.push_back(uint8_t(payload.size() >> 8));
+      stream.push_back(uint8_t(payload.size()));
+    } else {
+      stream.push_back(maskBit | 127);
+      for(int shift = 56; shift >= 0; shift -= 8)
+        stream.push_back(uint8_t(uint64_t(payload.size()) >> shift));
+    }
+    if(masked)
+      stream.insert(stream.end(), key, key + 4);
+    for(size_t i = 0; i < payload.size(); ++i)
+      stream.push_back(uint8_t(payload[i]) ^ (masked ? key[i & 3] : 0));
+  }
+
+  std::string pattern(size_t len, char seed){
+    std::string s(len, 0);
+    for(size_t i = 0; i < len; ++i)
+      s[i] = char(seed + i * 7);
+    return s;
+  }
+
+  // cuts are the segment lengths in order, the rest of the stream is the last segment
+  Recorder run(const std::vector<uint8_t> & stream, const std::vector<size_t> & cuts, size_t stopAt = SIZE_MAX){
+    Recorder recorder;
+    recorder.stopAt = stopAt;
+    llc::SAWFrameDecoder decoder;
+    size_t pos = 0;
+    for(size_t i = 0; pos < stream.size(); ++i){
+      const size_t len = i < cuts.size() ? std::min(cuts[i], stream.size() - pos) : stream.size() - pos;
+      uint8_t * segment = (uint8_t *)malloc(len);
+      memcpy(segment, stream.data() + pos, len);
+      const bool more = decoder.decode(recorder, segment, len);
+      free(segment);
+      pos += len;
+      if(!more)
+        break;
+    }
+    return recorder;
+  }
+
+  bool same(const Recorder & a, const Recorder & b){
+    if(a.failed || b.failed || a.frames.size() != b.frames.size())
+      return false;
+    for(size_t i = 0; i < a.frames.size(); ++i){
+      const Frame & x = a.frames[i];
+      const Frame & y = b.frames[i];
+      if(x.header.opcode != y.header.opcode || x.header.final != y.header.final || x.header.rsv1 != y.header.rsv1
+          || x.header.masked != y.header.masked || x.header.len != y.header.len || x.payload != y.payload || x.lasts != y.lasts)
+        return false;
+    }
+    return true;
+  }
+} // namespace
+
+int main(){
+  std::vector<uint8_t> stream;
+  std::vector<std::string> payloads = {"hello", pattern(300, 'a'), "pp", "", pattern(70000, 'b'), "zz", "", pattern(126, 'c'), pattern(65535, 'd'), pattern(125, 'e')};
+  const uint8_t firsts[] = {0x81, 0x02, 0x89, 0x80, 0xc1, 0x8a, 0x81, 0x82, 0x02, 0x80};
+  for(size_t i = 0; i < payloads.size(); ++i)
+    appendFrame(stream, firsts[i], payloads[i], i % 3 != 1);
+
+  const Recorder whole = run(stream, {});
+  if(whole.failed || whole.frames.size() != payloads.size()){
+    printf("whole stream: %zu frames\n", whole.frames.size());
+    return 1;
+  }
+  for(size_t i = 0; i < payloads.size(); ++i){
+    const Frame & frame = whole.frames[i];
+    if(frame.payload != payloads[i] || frame.lasts != 1 || frame.header.opcode != (firsts[i] & 0x0F)
+        || frame.header.final != ((firsts[i] & 0x80) != 0) || frame.header.rsv1 != ((firsts[i] & 0x40) != 0)){
+      printf("frame %zu decoded wrong\n", i);
+      return 1;
+    }
+  }
+
+  // two segments, cut at every position up to well into the long frames
+  for(size_t cut = 0; cut < std::min<size_t>(stream.size(), 800); ++cut){
+    if(!same(whole, run(stream, {cut}))){
+      printf("cut at %zu\n", cut);
+      return 1;
+    }
+  }
+  // one byte at a time through the headers and the first frames
+  if(!same(whole, run(stream, std::vector<size_t>(1000, 1)))){
+    printf("byte by byte\n");
+    return 1;
+  }
+  // random segment lengths, mostly small ones as a slow sender would produce
+  srand(7);
+  for(int round = 0; round < 200; ++round){
+    std::vector<size_t> cuts;
+    for(size_t total = 0; total < stream.size(); ){
+      const size_t len = (rand() % 4) ? size_t(rand() % 20) : size_t(rand() % 3000);
+      cuts.push_back(len);
+      total += len;
+    }
+    if(!same(whole, run(stream, cuts))){
+      printf("random round %d\n", round);
+      return 1;
+    }
+  }
+  // a refused header stops the input: nothing of that frame or later ones is handed on
+  const Recorder stopped = run(stream, {3, 5, 1}, 2);
+  if(stopped.failed || stopped.frames.size() != 2 || stopped.frames[1].payload != payloads[1]){
+    printf("refused header\n");
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
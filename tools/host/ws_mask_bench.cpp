@@ -0,0 +1,94 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebSocketMask.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Checks applyWebSocketMask against the byte loop it replaced for every alignment, offset and split, then times both
+// on 1 KB to 64 KB frames. --check runs the comparison only.
+
+namespace {
+  void maskBytes(uint8_t * data, size_t len, const uint8_t (&mask)[4], uint64_t offset){
+    for(size_t i = 0; i < len; ++i)
+      data[i] ^= mask[(offset + i) % 4];
+  }
+
+  bool check(){
+    const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    std::vector<uint8_t> source(300);
+    for(size_t i = 0; i < source.size(); ++i)
+      source[i] = uint8_t(rand());
+    for(size_t align = 0; align < 16; ++align){
+      for(size_t len = 0; len < 200; ++len){
+        for(uint64_t offset = 0; offset < 8; ++offset){
+          // one call, and the same bytes in two pieces as two segments would bring them
+          std::vector<uint8_t> expected(source.begin() + align, source.begin() + align + len);
+          maskBytes(expected.data(), len, mask, offset);
+          std::vector<uint8_t> whole(source.begin(), source.begin() + align + len);
+          llc::applyWebSocketMask(whole.data() + align, len, mask, offset);
+          std::vector<uint8_t> split(source.begin(), source.begin() + align + len);
+          const size_t cut = len / 3;
+          llc::applyWebSocketMask(split.data() + align, cut, mask, offset);
+          llc::applyWebSocketMask(split.data() + align + cut, len - cut, mask, offset + cut);
+          if(memcmp(whole.data() + align, expected.data(), len) || memcmp(split.data() + align, expected.data(), len)){
+            printf("mismatch: align %zu len %zu offset %llu\n", align, len, (unsigned long long)offset);
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  template<typename F>
+  double megabytesPerSecond(size_t len, F mask){
+    std::vector<uint8_t> frame(len + 1);
+    const size_t rounds = (64u << 20) / len;
+    const auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < rounds; ++i)
+      mask(frame.data() + 1, len, i);     // odd start, as payloads follow a 2 to 14 byte header
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    volatile uint8_t sink = frame[len / 2];
+    (void)sink;
+    return double(rounds) * len / seconds / (1 << 20);
+  }
+} // namespace
+
+int main(int argc, char ** argv){
+  if(!check())
+    return 1;
+  if(argc > 1 && !strcmp(argv[1], "--check")){
+    printf("ok\n");
+    return 0;
+  }
+  const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+  printf("%8s %14s %14s\n", "frame", "bytes MB/s", "words MB/s");
+  for(size_t len = 1024; len <= 65536; len *= 2){
+    const double bytes = megabytesPerSecond(len, [&](uint8_t * d, size_t n, size_t i){ maskBytes(d, n, mask, i); });
+    const double words = megabytesPerSecond(len, [&](uint8_t * d, size_t n, size_t i){ llc::applyWebSocketMask(d, n, mask, i); });
+    printf("%7zuK %14.0f %14.0f\n", len / 1024, bytes, words);
+  }
+  return 0;
+}